@@ -0,0 +1,219 @@
+#include "BatchRayBending.h"
+#include <cmath>
+
+
+void BatchRayBending::solve4x(Ray const * const aRays, uint32_t const aCount, double const aX, RungeKuttaRayBending::Result * const aResults) const {
+  if(mParameters.mStepper == StepperType::cNativeFehlberg45) {
+    solve4x<ButcherTableauFehlberg45>(aRays, aCount, aX, aResults);
+  }
+  else if(mParameters.mStepper == StepperType::cNativeCashKarp45) {
+    solve4x<ButcherTableauCashKarp45>(aRays, aCount, aX, aResults);
+  }
+  else if(mParameters.mStepper == StepperType::cNativeDormandPrince45) {
+    solve4x<ButcherTableauDormandPrince45>(aRays, aCount, aX, aResults);
+  }
+  else {
+    throw std::invalid_argument("BatchRayBending: only native steppers are supported.");
+  }
+}
+
+BatchRayBending::Variables BatchRayBending::getStart(Ray const &aRay) const {
+  Variables result;
+  result[0u] = aRay.mStart(0u);
+  result[1u] = aRay.mStart(1u) + (mDiffEq.getEarthForm() == Eikonal::EarthForm::cFlat ? 0.0 : mDiffEq.getEarthRadius());
+  result[2u] = aRay.mStart(2u);
+  auto slowness = mDiffEq.getSlowness(aRay.mStart(1u));  // from height
+  result[3u] = aRay.mDirection(0u) * slowness;
+  result[4u] = aRay.mDirection(1u) * slowness;
+  result[5u] = aRay.mDirection(2u) * slowness;
+  return result;
+}
+
+RungeKuttaRayBending::Result BatchRayBending::getResult(bool const aValid, Variables const &aY) const {
+  RungeKuttaRayBending::Result result;
+  result.mValid = aValid;
+  result.mValue(0u) = aY[0u];
+  result.mValue(1u) = aY[1u] - (mDiffEq.getEarthForm() == Eikonal::EarthForm::cFlat ? 0.0 : mDiffEq.getEarthRadius());
+  result.mValue(2u) = aY[2u];
+  result.mDirection(0u) = aY[3u];
+  result.mDirection(1u) = aY[4u];
+  result.mDirection(2u) = aY[5u];
+  result.mDirection.normalize();
+  return result;
+}
+
+// Same algorithm as OdeSolverRungeKutta::solve with the judge x >= aX, but all lanes compute their
+// stages together. The control logic after the stages is done lane by lane.
+template <typename tButcherTableau>
+void BatchRayBending::solve4x(Ray const * const aRays, uint32_t const aCount, double const aX, RungeKuttaRayBending::Result * const aResults) const {
+  mDiffEq.dispatch([this, aRays, aCount, aX, aResults](auto const &aSpecialised) {
+    solve4x<tButcherTableau>(aSpecialised, aRays, aCount, aX, aResults);
+  });
+}
+
+template <typename tButcherTableau, typename tDiffEq>
+void BatchRayBending::solve4x(tDiffEq const &aDiffEq, Ray const * const aRays, uint32_t const aCount, double const aX, RungeKuttaRayBending::Result * const aResults) const {
+  using Tableau = tButcherTableau;
+  static constexpr uint32_t csNvar   = Eikonal::csNvar;
+  static constexpr uint32_t csStages = Tableau::csStages;
+  static constexpr uint32_t csIdle   = std::numeric_limits<uint32_t>::max();
+
+  double const tEnd     = mParameters.mDistAlongRay;
+  double const tolAbs   = mParameters.mTolAbs;
+  double const tolRel   = mParameters.mTolRel;
+
+  LaneVariables y;
+  LaneVariables dydt;
+  LaneVariables yStage;
+  LaneVariables yNew;
+  LaneVariables dydtNew;
+  std::array<LaneVariables, csStages>   k;
+  std::array<double, csLanes>           t;
+  std::array<double, csLanes>           tPrev;
+  std::array<double, csLanes>           h;
+  std::array<double, csLanes>           hNow;
+  std::array<double, csLanes>           ratio;
+  std::array<bool, csLanes>             failed;
+  std::array<bool, csLanes>             failedNew;
+  std::array<bool, csLanes>             verdictPrev;
+  std::array<uint32_t, csLanes>         steps;
+  std::array<uint32_t, csLanes>         rayIndex;
+  std::array<StepSizeController<Tableau>, csLanes> controllers;
+
+  uint32_t nextRay = 0u;
+  uint32_t activeCount = 0u;
+  auto finish = [this, &rayIndex, &activeCount, aResults](uint32_t const aLane, bool const aValid, Variables const &aY) {
+    aResults[rayIndex[aLane]] = getResult(aValid, aY);
+    rayIndex[aLane] = csIdle;
+    --activeCount;
+  };
+  auto load = [&](uint32_t const aLane) {                 // Loads rays until one can start or no more left.
+    while(nextRay < aCount) {
+      rayIndex[aLane] = nextRay;
+      ++activeCount;
+      auto start = getStart(aRays[nextRay]);
+      ++nextRay;
+      Variables derivative;
+      if(aDiffEq.differentials(0.0, start.data(), derivative.data()) == GSL_SUCCESS) {
+        setLane(y, aLane, start);
+        setLane(dydt, aLane, derivative);
+        t[aLane] = 0.0;
+        h[aLane] = mParameters.mStep1;
+        steps[aLane] = 0u;
+        verdictPrev[aLane] = (start[0u] >= aX);
+        controllers[aLane] = StepSizeController<Tableau>(mParameters.mController);
+        break;
+      }
+      else {
+        finish(aLane, false, start);
+      }
+    }
+  };
+
+  if(aCount > 0u) {                                       // Idle lanes must have sane values to avoid NaN.
+    auto start = getStart(aRays[0u]);
+    Variables derivative;
+    aDiffEq.differentials(0.0, start.data(), derivative.data());
+    for(uint32_t l = 0u; l < csLanes; ++l) {
+      setLane(y, l, start);
+      setLane(dydt, l, derivative);
+      t[l] = 0.0;
+      rayIndex[l] = csIdle;
+    }
+  }
+  else {} // nothing to do
+  for(uint32_t l = 0u; l < csLanes; ++l) {
+    load(l);
+  }
+  while(activeCount > 0u) {
+    for(uint32_t l = 0u; l < csLanes; ++l) {
+      hNow[l] = (rayIndex[l] == csIdle ? 0.0 : std::min(h[l], tEnd - t[l]));
+      failed[l] = false;
+      failedNew[l] = false;
+    }
+    k[0u] = dydt;
+    for(uint32_t s = 1u; s < csStages; ++s) {
+      for(uint32_t i = 0u; i < csNvar; ++i) {
+#pragma omp simd
+        for(uint32_t l = 0u; l < csLanes; ++l) {
+          double sum = 0.0;
+          for(uint32_t j = 0u; j < s; ++j) {
+            sum += Tableau::csA[s][j] * k[j][i][l];
+          }
+          yStage[i][l] = y[i][l] + hNow[l] * sum;
+        }
+      }
+      aDiffEq.template differentials<csLanes>(yStage, k[s], failed);
+    }
+    for(uint32_t l = 0u; l < csLanes; ++l) {
+      ratio[l] = 0.0;
+    }
+    for(uint32_t i = 0u; i < csNvar; ++i) {
+#pragma omp simd
+      for(uint32_t l = 0u; l < csLanes; ++l) {
+        double sumB = 0.0;
+        double sumE = 0.0;
+        for(uint32_t j = 0u; j < csStages; ++j) {
+          sumB += Tableau::csB[j] * k[j][i][l];
+          sumE += Tableau::csE[j] * k[j][i][l];
+        }
+        yNew[i][l] = y[i][l] + hNow[l] * sumB;
+        ratio[l] = std::max(ratio[l], std::abs(hNow[l] * sumE) / (tolAbs + tolRel * std::abs(yNew[i][l])));
+      }
+    }
+    if constexpr(Tableau::csFsal) {
+      dydtNew = k[csStages - 1u];
+    }
+    else {
+      aDiffEq.template differentials<csLanes>(yNew, dydtNew, failedNew);
+    }
+    for(uint32_t l = 0u; l < csLanes; ++l) {
+      if(rayIndex[l] == csIdle) {
+        continue;
+      }
+      else {} // nothing to do
+      auto &controller = controllers[l];
+      bool accepted = !failed[l] && controller.isAccepted(ratio[l]);
+      bool failedLane = failed[l] || (accepted && failedNew[l]);
+      if(failedLane || !accepted) {
+        h[l] = (failedLane ? hNow[l] / 2.0 : controller.adjust(hNow[l], ratio[l], false));
+        if(h[l] < mParameters.mStepMin) {
+          finish(l, false, getLane(y, l));
+          load(l);
+        }
+        else {} // nothing to do
+        continue;
+      }
+      else {} // nothing to do
+      auto yLanePrev = getLane(y, l);
+      auto dydtLanePrev = getLane(dydt, l);
+      auto yLane = getLane(yNew, l);
+      auto dydtLane = getLane(dydtNew, l);
+      tPrev[l] = t[l];
+      t[l] = (t[l] + h[l] >= tEnd ? tEnd : t[l] + hNow[l]);
+      h[l] = controller.adjust(hNow[l], ratio[l], true);
+      ++steps[l];
+      if(h[l] > mParameters.mStepMax && RungeKuttaRayBending::decide2resetBigStep(yLanePrev, yLane, mParameters.mMaxCosDirChange)) {
+        t[l] = tPrev[l];
+        h[l] = mParameters.mStep1;
+        controller.reset();                               // y and dydt stay the previous ones.
+      }
+      else if(verdictPrev[l] != (yLane[0u] >= aX)) {
+        HermiteInterpolator<csNvar> interpolator(tPrev[l], yLanePrev, dydtLanePrev, t[l], yLane, dydtLane);
+        auto theta = interpolator.locateEvent([aX](double const, Variables const &aY){ return aY[0u] >= aX; }, verdictPrev[l]);
+        finish(l, true, interpolator.interpolate(theta));
+        load(l);
+        continue;
+      }
+      else {
+        setLane(y, l, yLane);
+        setLane(dydt, l, dydtLane);
+      }
+      if(t[l] >= tEnd || steps[l] == csMaxStep) {
+        finish(l, steps[l] < csMaxStep, getLane(y, l));
+        load(l);
+      }
+      else {} // nothing to do
+    }
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef BATCHRAYBENDING
+#define BATCHRAYBENDING
+
+#include "RungeKuttaRayBending.h"
+
+
+// Integrates many rays in lockstep with the native embedded Runge-Kutta steppers. The rays are
+// kept in structure of arrays layout in csLanes lanes, so Eikonal::differentials can evaluate
+// the refraction gradient of all lanes with vector instructions (compile with -march=native to
+// get AVX2 or AVX-512). Each lane has its own step size control, and a lane is reloaded with the
+// next ray as soon as its ray has finished. Results are the same as of RungeKuttaRayBending::solve4x.
+class BatchRayBending final {
+public:
+#if defined(__AVX512F__)
+  static constexpr uint32_t csLanes = 8u;
+#else
+  static constexpr uint32_t csLanes = 4u;
+#endif
+
+private:
+  static constexpr uint32_t csMaxStep = 31415u;
+
+  using Variables     = Eikonal::Variables;
+  using LaneVariables = Eikonal::LaneVariables<csLanes>;
+
+  RungeKuttaRayBending::Parameters const mParameters;
+  Eikonal                          const &mDiffEq;
+
+public:
+  BatchRayBending(RungeKuttaRayBending::Parameters const &aParameters, Eikonal const &aDiffEq)
+    : mParameters(aParameters)
+    , mDiffEq(aDiffEq) {}
+
+  BatchRayBending(BatchRayBending const&) = default;
+  BatchRayBending(BatchRayBending &&) = delete;
+  BatchRayBending& operator=(BatchRayBending const&) = delete;
+  BatchRayBending& operator=(BatchRayBending &&) = delete;
+
+  // Only the native steppers in 3D are available here.
+  bool isSupported() const { return RungeKuttaRayBending::isNative(mParameters.mStepper) && !mParameters.mPlanar; }
+
+  void solve4x(Ray const * const aRays, uint32_t const aCount, double const aX, RungeKuttaRayBending::Result * const aResults) const;
+
+private:
+  template <typename tButcherTableau>
+  void solve4x(Ray const * const aRays, uint32_t const aCount, double const aX, RungeKuttaRayBending::Result * const aResults) const;
+
+  // tDiffEq is the EikonalSpecialised matching mDiffEq, selected once per batch.
+  template <typename tButcherTableau, typename tDiffEq>
+  void solve4x(tDiffEq const &aDiffEq, Ray const * const aRays, uint32_t const aCount, double const aX, RungeKuttaRayBending::Result * const aResults) const;
+
+  Variables getStart(Ray const &aRay) const;
+  RungeKuttaRayBending::Result getResult(bool const aValid, Variables const &aY) const;
+
+  static Variables getLane(LaneVariables const &aLanes, uint32_t const aLane) {
+    Variables result;
+    for(uint32_t i = 0u; i < Eikonal::csNvar; ++i) {
+      result[i] = aLanes[i][aLane];
+    }
+    return result;
+  }
+
+  static void setLane(LaneVariables &aLanes, uint32_t const aLane, Variables const &aValue) {
+    for(uint32_t i = 0u; i < Eikonal::csNvar; ++i) {
+      aLanes[i][aLane] = aValue[i];
+    }
+  }
+};
+
+#endif
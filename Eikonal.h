@@ -3,9 +3,11 @@
 
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_matrix.h>
+#include "RefractionProfile.h"
 #include <cmath>
 #include <array>
 #include <cstdint>
+#include <optional>
 
 
 // These calculations do not take relative humidity in account, since it has less, than 0.5% the effect on air refractive index as temperature and pressure.
@@ -32,6 +34,15 @@ public:
   static constexpr double   csCelsius2kelvin                = 273.15;
   static constexpr double   csC                             = 299792458.0; // m/s
 
+  // Derivatives of the refractive index and of its derivative by height by the ambient and the
+  // base temperature at a height. The base temperature only matters for water.
+  struct TempDerivatives {
+    double mRefractByAmbient;
+    double mRefractByBase;
+    double mRefractDiffByAmbient;
+    double mRefractDiffByBase;
+  };
+
 private:
   static constexpr uint32_t csTempProfilePointCount         =   8u;
   static constexpr uint32_t csTempProfileDegree             =   4u;
@@ -48,15 +59,19 @@ private:
   double    const mEarthRadius;
   Model     const mModel;
   double          mTempAmbient;    // Celsius
-  double    const mTempAmbOrig; // Celsius
-  double    const mTempAmbMin;
-  double    const mTempAmbMax;
-  double    const mTempBase;       // Celsius
+  double          mTempAmbOrig; // Celsius
+  double          mTempAmbMin;
+  double          mTempAmbMax;
+  double          mTempBase;       // Celsius
+  double          mProfileTolerance;  // 0 means exact calculation without mProfile.
+  std::optional<RefractionProfile> mProfile;
 
 public:
   static constexpr uint32_t csNvar = 6u;
   using Real                       = double;
   using Variables                  = std::array<Real, csNvar>;
+  template <uint32_t tLanes>
+  using LaneVariables              = std::array<std::array<Real, tLanes>, csNvar>;   // Structure of arrays of tLanes rays.
   // For flat Earth, surface has v[4] == 0, the light travels mostly in v[3] direction, v[5] is depth.
   // The light starts close to the origin.
   // 
@@ -71,7 +86,8 @@ public:
   , mTempAmbOrig(aTempAmbient)
   , mTempAmbMin(aTempAmbient)
   , mTempAmbMax(aTempAmbient)
-  , mTempBase(aTempAmbient) {}
+  , mTempBase(aTempAmbient)
+  , mProfileTolerance(0.0) {}
 
   Eikonal(EarthForm const aEarthForm, double const aEarthRadius, Model const aModel, double const aTempAmbient, double const aTempAmbMin, double const aTempAmbMax, double const aTempBase)
   : mEarthForm(aEarthForm)
@@ -81,7 +97,8 @@ public:
   , mTempAmbOrig(aTempAmbient)
   , mTempAmbMin(aTempAmbMin)
   , mTempAmbMax(aTempAmbMax)
-  , mTempBase(aTempBase) {}
+  , mTempBase(aTempBase)
+  , mProfileTolerance(0.0) {}
 
   Eikonal(Eikonal const&) = default;
   Eikonal(Eikonal &&) = default;
@@ -89,21 +106,61 @@ public:
   Eikonal& operator=(Eikonal &&) = delete;
 
   void setWaterTempAmb(Temperature const aWhich) {
+    auto previous = mTempAmbient;
     mTempAmbient = (aWhich == Temperature::cBase ? mTempBase :
                    (aWhich == Temperature::cMinimum ? mTempAmbMin :
                    (aWhich == Temperature::cMaximum ? mTempAmbMax : mTempAmbOrig)));
+    if(mProfileTolerance > 0.0 && previous != mTempAmbient) {
+      buildProfile();
+    }
+    else {} // nothing to do
+  }
+
+  // Changes all temperatures at once for the next frame of a sweep, the current one becomes the ambient.
+  void setTemperatures(double const aTempAmbient, double const aTempAmbMin, double const aTempAmbMax, double const aTempBase) {
+    mTempAmbient = aTempAmbient;
+    mTempAmbOrig = aTempAmbient;
+    mTempAmbMin  = aTempAmbMin;
+    mTempAmbMax  = aTempAmbMax;
+    mTempBase    = aTempBase;
+    if(mProfileTolerance > 0.0) {
+      buildProfile();
+    }
+    else {} // nothing to do
   }
 
+  // Replaces the exact refraction calculation by a table lookup with the given maximal error.
+  // 0 switches back to the exact calculation.
+  void useProfile(double const aTolerance) {
+    mProfileTolerance = aTolerance;
+    if(mProfileTolerance > 0.0) {
+      buildProfile();
+    }
+    else {
+      mProfile.reset();
+    }
+  }
+
+  RefractionProfile const* getProfile() const { return mProfile ? &*mProfile : nullptr; }
+
   EarthForm getEarthForm()   const { return mEarthForm; }
   double    getEarthRadius() const { return mEarthRadius; }
 
+  // Calls aFunctor with the EikonalSpecialised matching the model, Earth form and profile use.
+  // With the profile the model does not matter, so it is instantiated only for cWater.
+  template <typename tFunctor>
+  decltype(auto) dispatch(tFunctor &&aFunctor) const;
+
+  int differentials(double const aT, const double aY[], double aDydt[]) const;
+
+  template <Model tModel, EarthForm tEarthForm, bool tProfile>
   int differentials(double, const double aY[], double aDydt[]) const {
     int result;
-    double n    = getRefract(aY[1]);
+    double n    = getRefract<tModel, tProfile>(aY[1]);
     double v    = csC / n;
     double elevation;
     std::array<double, 3u> zenith;
-    if(mEarthForm == EarthForm::cFlat) {
+    if constexpr(tEarthForm == EarthForm::cFlat) {
       elevation = aY[1];
       zenith[0] = zenith[2] = 0.0;
       zenith[1] = 1.0;
@@ -123,7 +180,7 @@ public:
       aDydt[0] = v * aY[3];
       aDydt[1] = v * aY[4];
       aDydt[2] = v * aY[5];
-      double u = getRefractDiff(elevation) / csC;
+      double u = getRefractDiff<tModel, tProfile>(elevation) / csC;
       aDydt[3] = zenith[0] * u;
       aDydt[4] = zenith[1] * u;
       aDydt[5] = zenith[2] * u;
@@ -134,6 +191,49 @@ public:
     return result;
   }
 
+  // Lane-wise differentials of independent rays for batch integration. Lanes where the ray is
+  // under the surface get aFailed set, the others are left untouched.
+  template <Model tModel, EarthForm tEarthForm, bool tProfile, uint32_t tLanes>
+  void differentials(LaneVariables<tLanes> const &aY, LaneVariables<tLanes> &aDydt, std::array<bool, tLanes> &aFailed) const {
+#pragma omp simd
+    for(uint32_t l = 0u; l < tLanes; ++l) {
+      double elevation;
+      std::array<double, 3u> zenith;
+      if constexpr(tEarthForm == EarthForm::cFlat) {
+        elevation = aY[1][l];
+        zenith[0] = zenith[2] = 0.0;
+        zenith[1] = 1.0;
+      }
+      else {
+        double fromCenter = std::sqrt(aY[0][l] * aY[0][l] + aY[1][l] * aY[1][l] + aY[2][l] * aY[2][l]);
+        elevation = fromCenter - mEarthRadius;
+        zenith[0] = aY[0][l] / fromCenter;
+        zenith[1] = aY[1][l] / fromCenter;
+        zenith[2] = aY[2][l] / fromCenter;
+      }
+      double n;
+      double nDiff;
+      if constexpr(tProfile) {                                // Lanes under the surface get masked below.
+        n     = mProfile->getRefract(std::max(aY[1][l], 0.0));
+        nDiff = mProfile->getRefractDiff(std::max(elevation, 0.0));
+      }
+      else {
+        n     = getRefract<tModel, false>(aY[1][l]);
+        nDiff = getRefractDiff<tModel, false>(elevation);
+      }
+      bool above = elevation > 0.0;
+      double v = (above ? csC / n : 0.0);
+      double u = (above ? nDiff / csC : 0.0);
+      aDydt[0][l] = v * aY[3][l];
+      aDydt[1][l] = v * aY[4][l];
+      aDydt[2][l] = v * aY[5][l];
+      aDydt[3][l] = zenith[0] * u;
+      aDydt[4][l] = zenith[1] * u;
+      aDydt[5][l] = zenith[2] * u;
+      aFailed[l] = aFailed[l] || !above;
+    }
+  }
+
   // Most probably wrong.
   int jacobian(double, const double aY[], double *aDfdy, double aDfdt[]) const {
     gsl_matrix_view dfdy_mat = gsl_matrix_view_array (aDfdy, csNvar, csNvar);  // TODO do directly
@@ -162,8 +262,7 @@ public:
 
 public:
   double getRefract(double const aH) const {
-    return mModel == Model::cConventional ? getConventionalRefract(aH) :
-          (mModel == Model::cPorous ? getPorousRefract(aH) : getWaterRefract(aH));
+    return mProfile && aH >= 0.0 ? mProfile->getRefract(aH) : calculateRefract(aH);
   }
 
   double getSlowness(double const aH) const {
@@ -172,8 +271,39 @@ public:
   }
 
   double getRefractDiff(double const aH) const {
-    return mModel == Model::cConventional ? getConventionalRefractDiff(aH) :
-          (mModel == Model::cPorous ? getPorousRefractDiff(aH) : getWaterRefractDiff(aH));
+    return mProfile && aH >= 0.0 ? mProfile->getRefractDiff(aH) : calculateRefractDiff(aH);
+  }
+
+  template <Model tModel, bool tProfile>
+  double getRefract(double const aH) const {
+    if constexpr(tProfile) {
+      return aH >= 0.0 ? mProfile->getRefract(aH) : calculateRefract(aH);
+    }
+    else if constexpr(tModel == Model::cConventional) {
+      return getConventionalRefract(aH);
+    }
+    else if constexpr(tModel == Model::cPorous) {
+      return getPorousRefract(aH);
+    }
+    else {
+      return getWaterRefract(aH);
+    }
+  }
+
+  template <Model tModel, bool tProfile>
+  double getRefractDiff(double const aH) const {
+    if constexpr(tProfile) {
+      return aH >= 0.0 ? mProfile->getRefractDiff(aH) : calculateRefractDiff(aH);
+    }
+    else if constexpr(tModel == Model::cConventional) {
+      return getConventionalRefractDiff(aH);
+    }
+    else if constexpr(tModel == Model::cPorous) {
+      return getPorousRefractDiff(aH);
+    }
+    else {
+      return getWaterRefractDiff(aH);
+    }
   }
 
   double getRefractDiff2(double const aH) const {
@@ -181,7 +311,30 @@ public:
           (mModel == Model::cPorous ? getPorousRefractDiff2(aH) : getWaterRefractDiff2(aH));
   }
 
+  // Always from the exact calculation.
+  TempDerivatives getTempDerivatives(double const aH) const {
+    return mModel == Model::cConventional ? getConventionalTempDerivatives(aH) :
+          (mModel == Model::cPorous ? getPorousTempDerivatives(aH) : getWaterTempDerivatives(aH));
+  }
+
+  double calculateRefract(double const aH) const {
+    return mModel == Model::cConventional ? getConventionalRefract(aH) :
+          (mModel == Model::cPorous ? getPorousRefract(aH) : getWaterRefract(aH));
+  }
+
+  double calculateRefractDiff(double const aH) const {
+    return mModel == Model::cConventional ? getConventionalRefractDiff(aH) :
+          (mModel == Model::cPorous ? getPorousRefractDiff(aH) : getWaterRefractDiff(aH));
+  }
+
 private:
+  void buildProfile() {
+    mProfile.reset();
+    mProfile.emplace(mProfileTolerance, [this](double const aH){ return calculateRefract(aH); },
+                                        [this](double const aH){ return calculateRefractDiff(aH); },
+                                        [this](double const aH){ return getRefractDiff2(aH); });
+  }
+
   double getConventionalRefract(double const aH) const {
     auto celsius = mTempAmbient + 0.018 + 6.37 * std::exp(-aH * 10.08);
     return 1.0 + 7.86e-4 * 101 / (celsius + 273.15);
@@ -202,6 +355,11 @@ private:
                              - (647.233 * std::exp(-10.08 * aH)));
   }
 
+  TempDerivatives getConventionalTempDerivatives(double const aH) const {
+    auto t = mTempAmbient + 6.37 * std::exp(-10.08 * aH) + 273.168;
+    return TempDerivatives{ -0.079386 / t / t, 0.0, -2.0 * getConventionalRefractDiff(aH) / t, 0.0 };
+  }
+
   double getPorousRefract(double const aH) const {
     auto celsius = mTempAmbient + (-66.8 + 1.9 * mTempAmbient) * (0.002 + 0.994 * std::exp(-aH * 8.35));
     return 1.0 + 7.86e-4 * 101 / (celsius + 273.15);
@@ -223,6 +381,14 @@ private:
                                  - (69.3042 * std::exp(-8.35 * aH)));
   }
 
+  TempDerivatives getPorousTempDerivatives(double const aH) const {
+    auto profile = 0.002 + 0.994 * std::exp(-8.35 * aH);
+    auto t = (1.9 * mTempAmbient - 66.8) * profile + mTempAmbient + 273.15;
+    auto tByAmbient = 1.0 + 1.9 * profile;
+    return TempDerivatives{ -0.079386 / t / t * tByAmbient, 0.0,
+                            1.25190 * std::exp(-8.35 * aH) / t / t - 2.0 * getPorousRefractDiff(aH) / t * tByAmbient, 0.0 };
+  }
+
   double getWaterRefract(double const aH) const {
     auto celsius = mTempAmbient + (mTempBase - mTempAmbient)*(0.011 + 1.05 * std::exp(-20.1 * aH));
     return 1.0 + 7.86e-4 * 101 / (celsius + 273.15);
@@ -243,6 +409,100 @@ private:
     return 0.079386 / t / t * d * ((890.842 * d * std::exp(-40.2 * aH)) / t
                                 -  (424.211 * std::exp(-20.1 * aH)));
   }
+
+  TempDerivatives getWaterTempDerivatives(double const aH) const {
+    auto profile = 0.011 + 1.05 * std::exp(-20.1 * aH);
+    auto t = (mTempBase - mTempAmbient) * profile + mTempAmbient + 273.15;
+    auto refractByT = -0.079386 / t / t;
+    auto refractDiffByD = 1.67544 * std::exp(-20.1 * aH) / t / t;   // d = mTempBase - mTempAmbient
+    auto refractDiffByT = -2.0 * getWaterRefractDiff(aH) / t;
+    return TempDerivatives{ refractByT * (1.0 - profile), refractByT * profile,
+                            -refractDiffByD + refractDiffByT * (1.0 - profile), refractDiffByD + refractDiffByT * profile };
+  }
+};
+
+// Eikonal with model, Earth form and profile use fixed at compile time, so its differentials
+// are straight-line code. It can be used wherever Eikonal is used as ODE definition.
+template <Eikonal::Model tModel, Eikonal::EarthForm tEarthForm, bool tProfile>
+class EikonalSpecialised final {
+public:
+  static constexpr uint32_t csNvar = Eikonal::csNvar;
+  using Real                       = Eikonal::Real;
+  using Variables                  = Eikonal::Variables;
+  template <uint32_t tLanes>
+  using LaneVariables              = Eikonal::LaneVariables<tLanes>;
+
+private:
+  Eikonal const &mEikonal;
+
+public:
+  EikonalSpecialised(Eikonal const &aEikonal) : mEikonal(aEikonal) {}
+
+  EikonalSpecialised(EikonalSpecialised const&) = default;
+  EikonalSpecialised(EikonalSpecialised &&) = default;
+  EikonalSpecialised& operator=(EikonalSpecialised const&) = delete;
+  EikonalSpecialised& operator=(EikonalSpecialised &&) = delete;
+
+  static constexpr Eikonal::EarthForm getEarthForm() { return tEarthForm; }
+  double getEarthRadius()              const { return mEikonal.getEarthRadius(); }
+  double getSlowness(double const aH)    const { return mEikonal.getSlowness(aH); }
+  double getRefract(double const aH)     const { return mEikonal.getRefract<tModel, tProfile>(aH); }
+  double getRefractDiff(double const aH) const { return mEikonal.getRefractDiff<tModel, tProfile>(aH); }
+  double getRefractDiff2(double const aH) const { return mEikonal.getRefractDiff2(aH); }
+  Eikonal::TempDerivatives getTempDerivatives(double const aH) const { return mEikonal.getTempDerivatives(aH); }
+
+  int differentials(double const aT, const double aY[], double aDydt[]) const {
+    return mEikonal.differentials<tModel, tEarthForm, tProfile>(aT, aY, aDydt);
+  }
+
+  template <uint32_t tLanes>
+  void differentials(LaneVariables<tLanes> const &aY, LaneVariables<tLanes> &aDydt, std::array<bool, tLanes> &aFailed) const {
+    mEikonal.differentials<tModel, tEarthForm, tProfile, tLanes>(aY, aDydt, aFailed);
+  }
+
+  int jacobian(double const aT, const double aY[], double *aDfdy, double aDfdt[]) const {
+    return mEikonal.jacobian(aT, aY, aDfdy, aDfdt);
+  }
 };
 
+template <typename tFunctor>
+decltype(auto) Eikonal::dispatch(tFunctor &&aFunctor) const {
+  if(mProfile) {
+    if(mEarthForm == EarthForm::cFlat) {
+      return aFunctor(EikonalSpecialised<Model::cWater, EarthForm::cFlat, true>(*this));
+    }
+    else {
+      return aFunctor(EikonalSpecialised<Model::cWater, EarthForm::cRound, true>(*this));
+    }
+  }
+  else if(mModel == Model::cConventional) {
+    if(mEarthForm == EarthForm::cFlat) {
+      return aFunctor(EikonalSpecialised<Model::cConventional, EarthForm::cFlat, false>(*this));
+    }
+    else {
+      return aFunctor(EikonalSpecialised<Model::cConventional, EarthForm::cRound, false>(*this));
+    }
+  }
+  else if(mModel == Model::cPorous) {
+    if(mEarthForm == EarthForm::cFlat) {
+      return aFunctor(EikonalSpecialised<Model::cPorous, EarthForm::cFlat, false>(*this));
+    }
+    else {
+      return aFunctor(EikonalSpecialised<Model::cPorous, EarthForm::cRound, false>(*this));
+    }
+  }
+  else {
+    if(mEarthForm == EarthForm::cFlat) {
+      return aFunctor(EikonalSpecialised<Model::cWater, EarthForm::cFlat, false>(*this));
+    }
+    else {
+      return aFunctor(EikonalSpecialised<Model::cWater, EarthForm::cRound, false>(*this));
+    }
+  }
+}
+
+inline int Eikonal::differentials(double const aT, const double aY[], double aDydt[]) const {
+  return dispatch([aT, aY, aDydt](auto const &aDiffEq) { return aDiffEq.differentials(aT, aY, aDydt); });
+}
+
 #endif
@@ -0,0 +1,76 @@
+#ifndef EIKONALPLANAR_H
+#define EIKONALPLANAR_H
+
+#include "Eikonal.h"
+
+
+// The refractive index depends only on height, so each ray stays in the vertical plane given
+// by its start point and direction. This system integrates the ray within that plane with
+// 4 variables instead of 6. v[0] is the horizontal and v[1] the vertical coordinate in the
+// plane, v[2] and v[3] are the corresponding components of the slowness vector.
+//
+// For flat Earth, v[1] is the height above the surface.
+// For round Earth, the origin is in the Earth center and the plane goes through it, v[1] is
+// the coordinate along the zenith of the ray start.
+// tEikonal is Eikonal or one of its EikonalSpecialised variants.
+template <typename tEikonal>
+class EikonalPlanar final {
+public:
+  static constexpr uint32_t csNvar = 4u;
+  using Real                       = double;
+  using Variables                  = std::array<Real, csNvar>;
+
+private:
+  tEikonal const &mEikonal;
+
+public:
+  EikonalPlanar(tEikonal const &aEikonal) : mEikonal(aEikonal) {}
+
+  EikonalPlanar(EikonalPlanar const&) = default;
+  EikonalPlanar(EikonalPlanar &&) = default;
+  EikonalPlanar& operator=(EikonalPlanar const&) = delete;
+  EikonalPlanar& operator=(EikonalPlanar &&) = delete;
+
+  Eikonal::EarthForm getEarthForm()   const { return mEikonal.getEarthForm(); }
+  double             getEarthRadius() const { return mEikonal.getEarthRadius(); }
+  double             getSlowness(double const aH) const { return mEikonal.getSlowness(aH); }
+
+  // Uses the vertical coordinate for the refractive index like Eikonal::differentials does,
+  // so the results agree with the 3D integration.
+  int differentials(double, const double aY[], double aDydt[]) const {
+    int result;
+    double n    = mEikonal.getRefract(aY[1]);
+    double v    = Eikonal::csC / n;
+    double elevation;
+    std::array<double, 2u> zenith;
+    if(mEikonal.getEarthForm() == Eikonal::EarthForm::cFlat) {   // Constant for EikonalSpecialised.
+      elevation = aY[1];
+      zenith[0] = 0.0;
+      zenith[1] = 1.0;
+    }
+    else {
+      double fromCenter = std::sqrt(aY[0] * aY[0] + aY[1] * aY[1]);
+      elevation = fromCenter - mEikonal.getEarthRadius();
+      zenith[0] = aY[0] / fromCenter;
+      zenith[1] = aY[1] / fromCenter;
+    }
+    if(elevation > 0.0) {
+      result = GSL_SUCCESS;
+      aDydt[0] = v * aY[2];
+      aDydt[1] = v * aY[3];
+      double u = mEikonal.getRefractDiff(elevation) / Eikonal::csC;
+      aDydt[2] = zenith[0] * u;
+      aDydt[3] = zenith[1] * u;
+    }
+    else {
+      result = GSL_FAILURE;
+    }
+    return result;
+  }
+
+  int jacobian(double, const double[], double *, double[]) const {
+    return GSL_FAILURE;
+  }
+};
+
+#endif // EIKONALPLANAR_H
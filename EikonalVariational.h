@@ -0,0 +1,103 @@
+#ifndef EIKONALVARIATIONAL_H
+#define EIKONALVARIATIONAL_H
+
+#include "Eikonal.h"
+
+
+// The ray of tEikonal together with its derivatives by tParameterCount start parameters: the
+// elevation and the azimuth of the start direction, and optionally the ambient and the base
+// temperature. v[0] - v[5] are the variables of Eikonal, and each parameter has the derivatives
+// of these in the next 6 variables. They follow the variational equation, that is the Jacobian
+// of the Eikonal differentials along the ray times the derivatives, plus the direct dependence
+// of the differentials on the temperatures. So one integration gives the ray and its
+// sensitivities without probing neighbouring rays.
+// tEikonal is Eikonal or one of its EikonalSpecialised variants.
+template <typename tEikonal, uint32_t tParameterCount>
+class EikonalVariational final {
+  static_assert(tParameterCount == 2u || tParameterCount == 4u, "Directions only or directions and temperatures.");
+
+public:
+  static constexpr uint32_t csNvarRay         = Eikonal::csNvar;
+  static constexpr uint32_t csParameterCount  = tParameterCount;
+  static constexpr uint32_t csNvar            = (1u + csParameterCount) * csNvarRay;
+  using Real                                  = double;
+  using Variables                             = std::array<Real, csNvar>;
+
+private:
+  tEikonal const &mEikonal;
+
+public:
+  EikonalVariational(tEikonal const &aEikonal) : mEikonal(aEikonal) {}
+
+  EikonalVariational(EikonalVariational const&) = default;
+  EikonalVariational(EikonalVariational &&) = default;
+  EikonalVariational& operator=(EikonalVariational const&) = delete;
+  EikonalVariational& operator=(EikonalVariational &&) = delete;
+
+  Eikonal::EarthForm getEarthForm()   const { return mEikonal.getEarthForm(); }
+  double             getEarthRadius() const { return mEikonal.getEarthRadius(); }
+
+  // The speed depends on v[1] like in Eikonal::differentials, the bending on the elevation.
+  int differentials(double const aT, const double aY[], double aDydt[]) const {
+    int result = mEikonal.differentials(aT, aY, aDydt);
+    if(result == GSL_SUCCESS) {
+      bool flat = (mEikonal.getEarthForm() == Eikonal::EarthForm::cFlat);   // Constant for EikonalSpecialised.
+      double n     = mEikonal.getRefract(aY[1]);
+      double v     = Eikonal::csC / n;
+      double vDiff = -v * mEikonal.getRefractDiff(aY[1]) / n;
+      double fromCenter = 1.0;
+      double elevation  = aY[1];
+      if(!flat) {
+        fromCenter = std::sqrt(aY[0] * aY[0] + aY[1] * aY[1] + aY[2] * aY[2]);
+        elevation = fromCenter - mEikonal.getEarthRadius();
+      }
+      else {} // nothing to do
+      double u     = mEikonal.getRefractDiff(elevation) / Eikonal::csC;
+      double uDiff = mEikonal.getRefractDiff2(elevation) / Eikonal::csC;
+      Eikonal::TempDerivatives atSpeed{0.0, 0.0, 0.0, 0.0};
+      Eikonal::TempDerivatives atElevation{0.0, 0.0, 0.0, 0.0};
+      if constexpr(csParameterCount > 2u) {
+        atSpeed = mEikonal.getTempDerivatives(aY[1]);
+        atElevation = (flat ? atSpeed : mEikonal.getTempDerivatives(elevation));
+      }
+      else {} // nothing to do
+      for(uint32_t k = 0u; k < csParameterCount; ++k) {
+        double const *d = aY + (k + 1u) * csNvarRay;
+        double *dd = aDydt + (k + 1u) * csNvarRay;
+        dd[0] = v * d[3] + vDiff * aY[3] * d[1];
+        dd[1] = v * d[4] + vDiff * aY[4] * d[1];
+        dd[2] = v * d[5] + vDiff * aY[5] * d[1];
+        if(flat) {
+          dd[3] = 0.0;
+          dd[4] = uDiff * d[1];
+          dd[5] = 0.0;
+        }
+        else {
+          double radial = (aY[0] * d[0] + aY[1] * d[1] + aY[2] * d[2]) / fromCenter;   // Derivative of the elevation.
+          for(uint32_t i = 0u; i < 3u; ++i) {
+            double zenith = aY[i] / fromCenter;
+            dd[3u + i] = u * (d[i] - zenith * radial) / fromCenter + zenith * uDiff * radial;
+          }
+        }
+        if(k >= 2u) {                                     // The temperatures change the differentials themselves.
+          double vByTemp = -v / n * (k == 2u ? atSpeed.mRefractByAmbient : atSpeed.mRefractByBase);
+          double uByTemp = (k == 2u ? atElevation.mRefractDiffByAmbient : atElevation.mRefractDiffByBase) / Eikonal::csC;
+          for(uint32_t i = 0u; i < 3u; ++i) {
+            double zenith = (flat ? (i == 1u ? 1.0 : 0.0) : aY[i] / fromCenter);
+            dd[i]      += vByTemp * aY[3u + i];
+            dd[3u + i] += zenith * uByTemp;
+          }
+        }
+        else {} // nothing to do
+      }
+    }
+    else {} // nothing to do
+    return result;
+  }
+
+  int jacobian(double, const double[], double *, double[]) const {
+    return GSL_FAILURE;
+  }
+};
+
+#endif // EIKONALVARIATIONAL_H
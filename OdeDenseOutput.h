@@ -0,0 +1,70 @@
+#ifndef ODEDENSEOUTPUT_H
+#define ODEDENSEOUTPUT_H
+
+#include <array>
+#include <cstdint>
+
+
+// Continuous output over one accepted step using cubic Hermite interpolation of the
+// endpoint values and derivatives. This is independent of the stepper, so works for
+// both OdeSolverGsl and OdeSolverRungeKutta.
+template <uint32_t tNvar>
+class HermiteInterpolator final {
+public:
+  using Variables = std::array<double, tNvar>;
+
+private:
+  static constexpr double   csEventEpsilon = 1e-12;  // Relative to step size.
+
+  double    const mT0;
+  double    const mH;
+  Variables const mY0;
+  Variables const mDydt0;
+  Variables const mY1;
+  Variables const mDydt1;
+
+public:
+  HermiteInterpolator(double const aT0, Variables const &aY0, Variables const &aDydt0, double const aT1, Variables const &aY1, Variables const &aDydt1)
+  : mT0(aT0)
+  , mH(aT1 - aT0)
+  , mY0(aY0)
+  , mDydt0(aDydt0)
+  , mY1(aY1)
+  , mDydt1(aDydt1) {}
+
+  double getT(double const aTheta) const { return mT0 + aTheta * mH; }
+
+  Variables interpolate(double const aTheta) const {
+    auto theta2 = aTheta * aTheta;
+    auto theta3 = theta2 * aTheta;
+    auto h00 = 2.0 * theta3 - 3.0 * theta2 + 1.0;
+    auto h10 = (theta3 - 2.0 * theta2 + aTheta) * mH;
+    auto h01 = -2.0 * theta3 + 3.0 * theta2;
+    auto h11 = (theta3 - theta2) * mH;
+    Variables result;
+    for(uint32_t i = 0u; i < tNvar; ++i) {
+      result[i] = h00 * mY0[i] + h10 * mDydt0[i] + h01 * mY1[i] + h11 * mDydt1[i];
+    }
+    return result;
+  }
+
+  // Assumes aJudge gives aVerdictStart at the step start and the opposite at its end.
+  // Returns the parameter of the first interpolated point where the verdict has changed.
+  template <typename tJudge>
+  double locateEvent(tJudge &&aJudge, bool const aVerdictStart) const {
+    double lower = 0.0;
+    double upper = 1.0;
+    while(upper - lower > csEventEpsilon) {
+      auto middle = (lower + upper) / 2.0;
+      if(aJudge(getT(middle), interpolate(middle)) == aVerdictStart) {
+        lower = middle;
+      }
+      else {
+        upper = middle;
+      }
+    }
+    return upper;
+  }
+};
+
+#endif // ODEDENSEOUTPUT_H
@@ -1,6 +1,7 @@
 #ifndef ODESOLVERGSL_H
 #define ODESOLVERGSL_H
 
+#include "OdeDenseOutput.h"
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_odeiv2.h>
@@ -15,7 +16,10 @@ enum class StepperType : uint8_t {
   cRungeKuttaFehlberg45        = 2u,
   cRungeKuttaCashKarp45        = 3u,
   cRungeKuttaPrinceDormand89   = 4u,
-  cBulirschStoerBaderDeuflhard = 5u
+  cBulirschStoerBaderDeuflhard = 5u,
+  cNativeFehlberg45            = 6u,   // These are served by OdeSolverRungeKutta instead of GSL.
+  cNativeCashKarp45            = 7u,
+  cNativeDormandPrince45       = 8u
 };
 
 template <typename tOdeDefinition>
@@ -59,7 +63,11 @@ public:
   OdeSolverGsl& operator=(OdeSolverGsl const&) = delete;
   OdeSolverGsl& operator=(OdeSolverGsl &&) = delete;
 
-  Result solve(Variables const &aYstart, std::function<bool(double const, Variables const&)> aJudge, std::function<bool(Variables const& aPrev, Variables const& aNow)> aDecide2resetBigStep);
+  // aOnEvent(t, y) is called at each change of the verdict of aJudge, and returns true to stop there.
+  // Otherwise aJudge may have changed (like to the next target) and the integration goes on.
+  // Without aOnEvent the first change stops.
+  Result solve(Variables const &aYstart, std::function<bool(double const, Variables const&)> aJudge, std::function<bool(Variables const& aPrev, Variables const& aNow)> aDecide2resetBigStep,
+               std::function<bool(double const, Variables const&)> aOnEvent = nullptr);
 };
 
 template <typename tOdeDefinition>
@@ -160,79 +168,87 @@ OdeSolverGsl<tOdeDefinition>::~OdeSolverGsl() {
   gsl_odeiv2_step_free(mStepper);
 }
 
+// The stopping point is located on the continuous output of the step crossing it, so the
+// integration reaches it in one forward pass. Too big steps with too much direction change
+// are still thrown away and repeated starting with the initial step size. Events not stopping
+// the integration are located on the same step as long as the changed judge finds more.
 template <typename tOdeDefinition>
 typename OdeSolverGsl<tOdeDefinition>::Result OdeSolverGsl<tOdeDefinition>::solve(Variables const &aYstart,
                                                                                   std::function<bool(double const, Variables const&)> aJudge,
-                                                                                  std::function<bool(Variables const& aPrev, Variables const& aNow)> aDecide2resetBigStep) {
+                                                                                  std::function<bool(Variables const& aPrev, Variables const& aNow)> aDecide2resetBigStep,
+                                                                                  std::function<bool(double const, Variables const&)> aOnEvent) {
   Result result;
   result.mValid = true;
-  double start = mTstart;
-  double end = mTend;
+  double h = mStepStart;
+  double t = mTstart;
   Variables y = aYstart;
-  uint32_t stepsAll = 0;
-  while(true) {
-    double h = mStepStart;
-    double t = start;
-    bool verdictPrev = aJudge(t, y);
-    Variables yPrev;
-    double tPrev;
-    uint32_t stepsNow = 0;
-    bool wasBigH = false;
-    while (t < end && stepsAll < csMaxStep) {
-      yPrev = y;
-      tPrev = t;
-      int status;
-      auto hPrev = h;
-      do {
-        status = gsl_odeiv2_evolve_apply (mEvolver, mController, mStepper,
-                                         &mSystem,
-                                         &t, end,
-                                         &h, y.data());
-        h /= 2.0;
-      } while(status == GSL_FAILURE);
-      if (status != GSL_SUCCESS) {
-        gsl_odeiv2_evolve_reset(mEvolver);
-        gsl_odeiv2_step_reset(mStepper);
-        throw std::out_of_range("OdeSolverGsl: Can't apply step in evolver.");
-      }
-      else {} // Nothing to do
-      ++stepsAll;
-      ++stepsNow;
-      if(h < mStepMin) {
-        result.mValid = false;
-        break;
-      }
-      else {} // Nothing to do
-      if(verdictPrev != aJudge(t, y)) {
-        break;
-      }
-      else {} // Nothing to do
-      if(h > mStepMax && aDecide2resetBigStep(yPrev, y)) {                    // If h is too big, it may make a too big step yielding false results GSL unable to detect.
-        wasBigH = true;
-        break;
-      }
-      else {} // Nothing to do
+  bool verdictPrev = aJudge(t, y);
+  uint32_t steps = 0;
+  while (t < mTend && steps < csMaxStep) {
+    Variables yPrev = y;
+    double tPrev = t;
+    int status;
+    do {
+      status = gsl_odeiv2_evolve_apply (mEvolver, mController, mStepper,
+                                       &mSystem,
+                                       &t, mTend,
+                                       &h, y.data());
+      h /= 2.0;
+    } while(status == GSL_FAILURE);
+    if (status != GSL_SUCCESS) {
+      gsl_odeiv2_evolve_reset(mEvolver);
+      gsl_odeiv2_step_reset(mStepper);
+      throw std::out_of_range("OdeSolverGsl: Can't apply step in evolver.");
     }
-    gsl_odeiv2_evolve_reset(mEvolver);
-    gsl_odeiv2_step_reset(mStepper);
-    if(!result.mValid || !wasBigH && stepsNow == 1u) {
-      result.mAtIndependent = t;
-      result.mValue = y;
+    else {} // Nothing to do
+    ++steps;
+    if(h < mStepMin) {
+      result.mValid = false;
       break;
     }
-    else {
+    else {} // Nothing to do
+    if(h > mStepMax && aDecide2resetBigStep(yPrev, y)) {                    // If h is too big, it may make a too big step yielding false results GSL unable to detect.
       y = yPrev;
-      start = tPrev;
-      if(!wasBigH) {
-        end = t;
-      }
-      else{} // nothing to do
+      t = tPrev;
+      h = mStepStart;
+      gsl_odeiv2_evolve_reset(mEvolver);
+      gsl_odeiv2_step_reset(mStepper);
     }
-    if(stepsAll == csMaxStep) {
-      result.mValid = false;
+    else if(verdictPrev != aJudge(t, y)) {
+      Variables dydtPrev;
+      Variables dydt;
+      mOdeDef.differentials(tPrev, yPrev.data(), dydtPrev.data());
+      mOdeDef.differentials(t, y.data(), dydt.data());
+      HermiteInterpolator<csNvar> interpolator(tPrev, yPrev, dydtPrev, t, y, dydt);
+      bool stop = false;
+      do {
+        auto theta = interpolator.locateEvent(aJudge, verdictPrev);
+        auto tEvent = interpolator.getT(theta);
+        auto yEvent = interpolator.interpolate(theta);
+        stop = (!aOnEvent || aOnEvent(tEvent, yEvent));
+        if(stop) {
+          t = tEvent;
+          y = yEvent;
+        }
+        else {
+          verdictPrev = aJudge(tPrev, yPrev);
+        }
+      } while(!stop && verdictPrev != aJudge(t, y));
+      if(stop) {
+        break;
+      }
+      else {} // Nothing to do
     }
     else {} // Nothing to do
   }
+  gsl_odeiv2_evolve_reset(mEvolver);
+  gsl_odeiv2_step_reset(mStepper);
+  if(steps == csMaxStep) {
+    result.mValid = false;
+  }
+  else {} // Nothing to do
+  result.mAtIndependent = t;
+  result.mValue = y;
   return result;
 }
 
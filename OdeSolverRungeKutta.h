@@ -0,0 +1,353 @@
+#ifndef ODESOLVERRUNGEKUTTA_H
+#define ODESOLVERRUNGEKUTTA_H
+
+#include "OdeDenseOutput.h"
+#include <gsl/gsl_errno.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+
+// Header-only embedded Runge-Kutta solver as a drop-in alternative of OdeSolverGsl.
+// Both the ODE definition and the Butcher tableau are template parameters, and the judge
+// and reset callbacks are taken as templates as well, so the whole step is inlined without
+// any function pointer or std::function in between.
+
+enum class ErrorController : uint8_t {
+  cStandard             = 0u,  // Same as gsl_odeiv2_control_y_new: elementary controller with asymmetric limits.
+  cProportionalIntegral = 1u   // Gustafsson's PI controller, smoother step sequence with less rejected steps.
+};
+
+// mB are the weights of the propagated solution, mE are the differences of these and the embedded ones.
+// The error order is the exponent of the local error estimate, used for step size control.
+struct ButcherTableauFehlberg45 final {
+  static constexpr uint32_t csStages     = 6u;
+  static constexpr uint32_t csErrorOrder = 5u;
+  static constexpr bool     csFsal       = false;
+  static constexpr double   csC[csStages] = { 0.0, 1.0 / 4.0, 3.0 / 8.0, 12.0 / 13.0, 1.0, 1.0 / 2.0 };
+  static constexpr double   csA[csStages][csStages] = {
+    { 0.0,                   0.0,                0.0,                0.0,               0.0,          0.0 },
+    { 1.0 / 4.0,             0.0,                0.0,                0.0,               0.0,          0.0 },
+    { 3.0 / 32.0,            9.0 / 32.0,         0.0,                0.0,               0.0,          0.0 },
+    { 1932.0 / 2197.0,   -7200.0 / 2197.0,    7296.0 / 2197.0,       0.0,               0.0,          0.0 },
+    { 439.0 / 216.0,        -8.0,             3680.0 / 513.0,     -845.0 / 4104.0,      0.0,          0.0 },
+    { -8.0 / 27.0,           2.0,            -3544.0 / 2565.0,    1859.0 / 4104.0,    -11.0 / 40.0,   0.0 }
+  };
+  static constexpr double   csB[csStages] = { 16.0 / 135.0, 0.0, 6656.0 / 12825.0, 28561.0 / 56430.0, -9.0 / 50.0, 2.0 / 55.0 };
+  static constexpr double   csE[csStages] = { 1.0 / 360.0, 0.0, -128.0 / 4275.0, -2197.0 / 75240.0, 1.0 / 50.0, 2.0 / 55.0 };
+};
+
+struct ButcherTableauCashKarp45 final {
+  static constexpr uint32_t csStages     = 6u;
+  static constexpr uint32_t csErrorOrder = 5u;
+  static constexpr bool     csFsal       = false;
+  static constexpr double   csC[csStages] = { 0.0, 1.0 / 5.0, 3.0 / 10.0, 3.0 / 5.0, 1.0, 7.0 / 8.0 };
+  static constexpr double   csA[csStages][csStages] = {
+    { 0.0,                   0.0,                0.0,                0.0,                  0.0,           0.0 },
+    { 1.0 / 5.0,             0.0,                0.0,                0.0,                  0.0,           0.0 },
+    { 3.0 / 40.0,            9.0 / 40.0,         0.0,                0.0,                  0.0,           0.0 },
+    { 3.0 / 10.0,           -9.0 / 10.0,         6.0 / 5.0,          0.0,                  0.0,           0.0 },
+    { -11.0 / 54.0,          5.0 / 2.0,        -70.0 / 27.0,        35.0 / 27.0,           0.0,           0.0 },
+    { 1631.0 / 55296.0,    175.0 / 512.0,      575.0 / 13824.0,  44275.0 / 110592.0,     253.0 / 4096.0,  0.0 }
+  };
+  static constexpr double   csB[csStages] = { 37.0 / 378.0, 0.0, 250.0 / 621.0, 125.0 / 594.0, 0.0, 512.0 / 1771.0 };
+  static constexpr double   csE[csStages] = { 37.0 / 378.0 - 2825.0 / 27648.0, 0.0, 250.0 / 621.0 - 18575.0 / 48384.0,
+                                              125.0 / 594.0 - 13525.0 / 55296.0, -277.0 / 14336.0, 512.0 / 1771.0 - 1.0 / 4.0 };
+};
+
+// The last stage is evaluated at the new point, so it is reused as the first stage of the next step.
+struct ButcherTableauDormandPrince45 final {
+  static constexpr uint32_t csStages     = 7u;
+  static constexpr uint32_t csErrorOrder = 5u;
+  static constexpr bool     csFsal       = true;
+  static constexpr double   csC[csStages] = { 0.0, 1.0 / 5.0, 3.0 / 10.0, 4.0 / 5.0, 8.0 / 9.0, 1.0, 1.0 };
+  static constexpr double   csA[csStages][csStages] = {
+    { 0.0,                    0.0,                 0.0,                0.0,              0.0,                 0.0,         0.0 },
+    { 1.0 / 5.0,              0.0,                 0.0,                0.0,              0.0,                 0.0,         0.0 },
+    { 3.0 / 40.0,             9.0 / 40.0,          0.0,                0.0,              0.0,                 0.0,         0.0 },
+    { 44.0 / 45.0,          -56.0 / 15.0,         32.0 / 9.0,          0.0,              0.0,                 0.0,         0.0 },
+    { 19372.0 / 6561.0,  -25360.0 / 2187.0,    64448.0 / 6561.0,    -212.0 / 729.0,      0.0,                 0.0,         0.0 },
+    { 9017.0 / 3168.0,     -355.0 / 33.0,      46732.0 / 5247.0,      49.0 / 176.0,  -5103.0 / 18656.0,       0.0,         0.0 },
+    { 35.0 / 384.0,           0.0,               500.0 / 1113.0,     125.0 / 192.0,  -2187.0 / 6784.0,       11.0 / 84.0,  0.0 }
+  };
+  static constexpr double   csB[csStages] = { 35.0 / 384.0, 0.0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0, 0.0 };
+  static constexpr double   csE[csStages] = { 71.0 / 57600.0, 0.0, -71.0 / 16695.0, 71.0 / 1920.0, -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0 };
+};
+
+// Step size control for one integration, shared by the scalar and the batch solver.
+template <typename tButcherTableau>
+class StepSizeController final {
+private:
+  using Tableau                    = tButcherTableau;
+
+  static constexpr double   csSafety         = 0.9;
+  static constexpr double   csMinFactor      = 0.2;
+  static constexpr double   csMaxFactor      = 5.0;
+  static constexpr double   csRatioDecrease  = 1.1;   // Same limits as in GSL standard control.
+  static constexpr double   csRatioIncrease  = 0.5;
+  static constexpr double   csPiBeta         = 0.2 / Tableau::csErrorOrder;
+  static constexpr double   csPiAlpha        = 1.0 / Tableau::csErrorOrder - 0.75 * csPiBeta;
+  static constexpr double   csPiRatioInitial = 1e-4;
+
+  ErrorController mController;
+  double          mRatioPrev;   // Only for PI controller.
+
+public:
+  StepSizeController(ErrorController const aController = ErrorController::cStandard)
+  : mController(aController)
+  , mRatioPrev(csPiRatioInitial) {}
+
+  void reset() { mRatioPrev = csPiRatioInitial; }
+
+  // aRatio is the maximum of the error relative to the tolerance over all variables.
+  bool isAccepted(double const aRatio) const {
+    return mController == ErrorController::cStandard ? aRatio <= csRatioDecrease : aRatio <= 1.0;
+  }
+
+  double adjust(double const aH, double const aRatio, bool const aAccepted);
+};
+
+template <typename tButcherTableau>
+double StepSizeController<tButcherTableau>::adjust(double const aH, double const aRatio, bool const aAccepted) {
+  double factor;
+  if(mController == ErrorController::cStandard) {
+    if(aRatio > csRatioDecrease) {
+      factor = std::max(csMinFactor, csSafety * std::pow(aRatio, -1.0 / Tableau::csErrorOrder));
+    }
+    else if(aRatio < csRatioIncrease) {
+      factor = std::min(csMaxFactor, std::max(1.0, csSafety * std::pow(aRatio, -1.0 / (Tableau::csErrorOrder + 1.0))));
+    }
+    else {
+      factor = 1.0;
+    }
+  }
+  else {
+    auto ratio = std::max(aRatio, 1e-10);
+    if(aAccepted) {
+      factor = csSafety * std::pow(ratio, -csPiAlpha) * std::pow(mRatioPrev, csPiBeta);
+      mRatioPrev = std::max(ratio, csPiRatioInitial);
+    }
+    else {
+      factor = std::min(1.0, csSafety * std::pow(ratio, -1.0 / Tableau::csErrorOrder));
+    }
+    factor = std::min(csMaxFactor, std::max(csMinFactor, factor));
+  }
+  return aH * factor;
+}
+
+template <typename tOdeDefinition, typename tButcherTableau>
+class OdeSolverRungeKutta final {
+public:
+  static constexpr uint32_t csNvar = tOdeDefinition::csNvar;
+  using Variables                  = std::array<double, csNvar>;
+
+  struct Result final {
+    bool      mValid;
+    double    mAtIndependent;
+    Variables mValue;
+  };
+
+private:
+  using OdeDefinition              = tOdeDefinition;
+  using Tableau                    = tButcherTableau;
+
+  static constexpr uint32_t csMaxStep        = 31415u;
+  static constexpr uint32_t csStages         = Tableau::csStages;
+
+  double            const mTstart;
+  double            const mTend;
+  double            const mTolAbs;
+  double            const mTolRel;
+  double            const mStepStart;
+  double            const mStepMin;
+  double            const mStepMax;
+  OdeDefinition     const& mOdeDef;
+  StepSizeController<Tableau> mController;
+
+public:
+  OdeSolverRungeKutta(const double aTstart, const double aTend, const double aAtol, const double aRtol,
+                      const double aStepStart, double const aStepMin, double const aStepMax, OdeDefinition const& aOdeDef,
+                      ErrorController const aController = ErrorController::cStandard)
+  : mTstart(aTstart)
+  , mTend(aTend)
+  , mTolAbs(aAtol)
+  , mTolRel(aRtol)
+  , mStepStart(aStepStart)
+  , mStepMin(aStepMin)
+  , mStepMax(aStepMax)
+  , mOdeDef(aOdeDef)
+  , mController(aController) {}
+
+  OdeSolverRungeKutta(OdeSolverRungeKutta const&) = default;
+  OdeSolverRungeKutta(OdeSolverRungeKutta &&) = delete;
+  OdeSolverRungeKutta& operator=(OdeSolverRungeKutta const&) = delete;
+  OdeSolverRungeKutta& operator=(OdeSolverRungeKutta &&) = delete;
+
+  template <typename tJudge, typename tDecide2resetBigStep>
+  Result solve(Variables const &aYstart, tJudge &&aJudge, tDecide2resetBigStep &&aDecide2resetBigStep) {
+    return solve(aYstart, aJudge, aDecide2resetBigStep, [](double const, Variables const&){ return true; });
+  }
+
+  // aOnEvent(t, y) is called at each change of the verdict of aJudge, and returns true to stop there.
+  // Otherwise aJudge may have changed (like to the next target) and the integration goes on.
+  template <typename tJudge, typename tDecide2resetBigStep, typename tOnEvent>
+  Result solve(Variables const &aYstart, tJudge &&aJudge, tDecide2resetBigStep &&aDecide2resetBigStep, tOnEvent &&aOnEvent);
+
+private:
+  bool step(double &aT, double const aTend, double &aH, Variables &aY, Variables &aDydt);
+  double getErrorRatio(Variables const &aY, Variables const &aErr) const;
+};
+
+// The stopping point is located on the continuous output of the step crossing it, so the
+// integration reaches it in one forward pass. Too big steps with too much direction change
+// are still thrown away and repeated starting with the initial step size. Events not stopping
+// the integration are located on the same step as long as the changed judge finds more.
+template <typename tOdeDefinition, typename tButcherTableau>
+template <typename tJudge, typename tDecide2resetBigStep, typename tOnEvent>
+typename OdeSolverRungeKutta<tOdeDefinition, tButcherTableau>::Result OdeSolverRungeKutta<tOdeDefinition, tButcherTableau>::solve(Variables const &aYstart,
+                                                                                                                                  tJudge &&aJudge,
+                                                                                                                                  tDecide2resetBigStep &&aDecide2resetBigStep,
+                                                                                                                                  tOnEvent &&aOnEvent) {
+  Result result;
+  result.mValid = true;
+  double t = mTstart;
+  double h = mStepStart;
+  Variables y = aYstart;
+  Variables dydt;
+  mController.reset();
+  bool verdictPrev = aJudge(t, y);
+  uint32_t steps = 0;
+  if(mOdeDef.differentials(t, y.data(), dydt.data()) != GSL_SUCCESS) {
+    result.mValid = false;
+  }
+  else {} // Nothing to do
+  while (result.mValid && t < mTend && steps < csMaxStep) {
+    Variables yPrev = y;
+    Variables dydtPrev = dydt;
+    double tPrev = t;
+    if(!step(t, mTend, h, y, dydt)) {
+      result.mValid = false;
+      break;
+    }
+    else {} // Nothing to do
+    ++steps;
+    if(h > mStepMax && aDecide2resetBigStep(yPrev, y)) {                    // If h is too big, it may make a too big step yielding false results.
+      y = yPrev;
+      dydt = dydtPrev;
+      t = tPrev;
+      h = mStepStart;
+      mController.reset();
+    }
+    else if(verdictPrev != aJudge(t, y)) {
+      HermiteInterpolator<csNvar> interpolator(tPrev, yPrev, dydtPrev, t, y, dydt);
+      bool stop = false;
+      do {
+        auto theta = interpolator.locateEvent(aJudge, verdictPrev);
+        auto tEvent = interpolator.getT(theta);
+        auto yEvent = interpolator.interpolate(theta);
+        stop = aOnEvent(tEvent, yEvent);
+        if(stop) {
+          t = tEvent;
+          y = yEvent;
+        }
+        else {
+          verdictPrev = aJudge(tPrev, yPrev);
+        }
+      } while(!stop && verdictPrev != aJudge(t, y));
+      if(stop) {
+        break;
+      }
+      else {} // Nothing to do
+    }
+    else {} // Nothing to do
+  }
+  if(steps == csMaxStep) {
+    result.mValid = false;
+  }
+  else {} // Nothing to do
+  result.mAtIndependent = t;
+  result.mValue = y;
+  return result;
+}
+
+// Makes one successful step not beyond aTend, retrying with smaller step size on too big error or
+// on failing differentials. Returns false if the step size would fall below mStepMin.
+template <typename tOdeDefinition, typename tButcherTableau>
+bool OdeSolverRungeKutta<tOdeDefinition, tButcherTableau>::step(double &aT, double const aTend, double &aH, Variables &aY, Variables &aDydt) {
+  std::array<Variables, csStages> k;
+  Variables yStage;
+  Variables yNew;
+  Variables err;
+  Variables dydtNew;
+  k[0u] = aDydt;
+  while(true) {
+    bool finalStep = (aT + aH >= aTend);
+    double h = (finalStep ? aTend - aT : aH);
+    bool failed = false;
+    for(uint32_t s = 1u; s < csStages && !failed; ++s) {
+      for(uint32_t i = 0u; i < csNvar; ++i) {
+        double sum = 0.0;
+        for(uint32_t j = 0u; j < s; ++j) {
+          sum += Tableau::csA[s][j] * k[j][i];
+        }
+        yStage[i] = aY[i] + h * sum;
+      }
+      failed = (mOdeDef.differentials(aT + Tableau::csC[s] * h, yStage.data(), k[s].data()) != GSL_SUCCESS);
+    }
+    if(!failed) {
+      for(uint32_t i = 0u; i < csNvar; ++i) {
+        double sumB = 0.0;
+        double sumE = 0.0;
+        for(uint32_t j = 0u; j < csStages; ++j) {
+          sumB += Tableau::csB[j] * k[j][i];
+          sumE += Tableau::csE[j] * k[j][i];
+        }
+        yNew[i] = aY[i] + h * sumB;
+        err[i]  = h * sumE;
+      }
+      double ratio = getErrorRatio(yNew, err);
+      bool accepted = mController.isAccepted(ratio);
+      if(accepted) {
+        if constexpr(Tableau::csFsal) {
+          dydtNew = k[csStages - 1u];
+        }
+        else {
+          failed = (mOdeDef.differentials(aT + h, yNew.data(), dydtNew.data()) != GSL_SUCCESS);
+        }
+      }
+      else {} // Nothing to do
+      if(accepted && !failed) {
+        aT = (finalStep ? aTend : aT + h);
+        aY = yNew;
+        aDydt = dydtNew;
+        aH = mController.adjust(h, ratio, true);
+        return true;
+      }
+      else if(!failed) {
+        aH = mController.adjust(h, ratio, false);
+      }
+      else {} // Nothing to do
+    }
+    else {} // Nothing to do
+    if(failed) {
+      aH = h / 2.0;
+    }
+    else {} // Nothing to do
+    if(aH < mStepMin) {
+      return false;
+    }
+    else {} // Nothing to do
+  }
+}
+
+template <typename tOdeDefinition, typename tButcherTableau>
+double OdeSolverRungeKutta<tOdeDefinition, tButcherTableau>::getErrorRatio(Variables const &aY, Variables const &aErr) const {
+  double result = 0.0;
+  for(uint32_t i = 0u; i < csNvar; ++i) {
+    result = std::max(result, std::abs(aErr[i]) / (mTolAbs + mTolRel * std::abs(aY[i])));
+  }
+  return result;
+}
+
+#endif // ODESOLVERRUNGEKUTTA_H
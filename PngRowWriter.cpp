@@ -0,0 +1,82 @@
+#include "PngRowWriter.h"
+#include <csetjmp>
+#include <stdexcept>
+#include <string>
+
+
+// libpng reports errors by longjmp to the last setjmp, which are turned into exceptions here.
+PngRowWriter::PngRowWriter(char const * const aName, uint32_t const aWidth, uint32_t const aHeight, std::vector<Color> const &aPalette)
+  : mWidth(aWidth)
+  , mHeight(aHeight) {
+  mFile = std::fopen(aName, "wb");
+  if(mFile == nullptr) {
+    throw std::runtime_error(std::string("Cannot open ") + aName);
+  }
+  else {} // nothing to do
+  mPng = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  mInfo = (mPng == nullptr ? nullptr : png_create_info_struct(mPng));
+  if(mInfo == nullptr) {
+    release();
+    throw std::runtime_error("Cannot create PNG writer");
+  }
+  else {} // nothing to do
+  std::vector<png_color> palette(aPalette.size());
+  for(uint32_t i = 0u; i < aPalette.size(); ++i) {
+    palette[i].red   = aPalette[i].mRed;
+    palette[i].green = aPalette[i].mGreen;
+    palette[i].blue  = aPalette[i].mBlue;
+  }
+  writeHeader(aName, palette);
+}
+
+PngRowWriter::~PngRowWriter() {
+  release();
+}
+
+void PngRowWriter::write(uint8_t const * const aRow) {
+  if(mRowsWritten >= mHeight || mPng == nullptr) {
+    throw std::runtime_error("PNG row written after the last one");
+  }
+  else {} // nothing to do
+  if(setjmp(png_jmpbuf(mPng))) {
+    release();
+    throw std::runtime_error("Cannot write PNG row");
+  }
+  else {
+    png_write_row(mPng, const_cast<png_bytep>(aRow));
+    ++mRowsWritten;
+    if(mRowsWritten == mHeight) {
+      png_write_end(mPng, nullptr);
+      release();
+    }
+    else {} // nothing to do
+  }
+}
+
+// Has no locals of its own, which the longjmp could clobber.
+void PngRowWriter::writeHeader(char const * const aName, std::vector<png_color> const &aPalette) {
+  if(setjmp(png_jmpbuf(mPng))) {
+    release();
+    throw std::runtime_error(std::string("Cannot write PNG header to ") + aName);
+  }
+  else {
+    png_init_io(mPng, mFile);
+    png_set_IHDR(mPng, mInfo, mWidth, mHeight, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(mPng, mInfo, aPalette.data(), static_cast<int>(aPalette.size()));
+    png_write_info(mPng, mInfo);
+  }
+}
+
+void PngRowWriter::release() {
+  if(mPng != nullptr) {
+    png_destroy_write_struct(&mPng, mInfo == nullptr ? nullptr : &mInfo);
+  }
+  else {} // nothing to do
+  mPng = nullptr;
+  mInfo = nullptr;
+  if(mFile != nullptr) {
+    std::fclose(mFile);
+    mFile = nullptr;
+  }
+  else {} // nothing to do
+}
@@ -0,0 +1,50 @@
+#ifndef PNGROWWRITER_H
+#define PNGROWWRITER_H
+
+#include <png.h>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+
+// Encodes an 8 bit palette PNG from top to bottom one row at a time, so the caller needs to keep
+// only the rows not written yet. The file is complete when the last row has been written.
+// Throws std::runtime_error on any I/O or libpng error.
+class PngRowWriter final {
+public:
+  struct Color {
+    uint8_t mRed;
+    uint8_t mGreen;
+    uint8_t mBlue;
+  };
+
+private:
+  uint32_t const  mWidth;
+  uint32_t const  mHeight;
+  uint32_t        mRowsWritten = 0u;
+  std::FILE      *mFile        = nullptr;
+  png_structp     mPng         = nullptr;
+  png_infop       mInfo        = nullptr;
+
+public:
+  PngRowWriter(char const * const aName, uint32_t const aWidth, uint32_t const aHeight, std::vector<Color> const &aPalette);
+  ~PngRowWriter();
+
+  PngRowWriter(PngRowWriter const&) = delete;
+  PngRowWriter(PngRowWriter &&) = delete;
+  PngRowWriter& operator=(PngRowWriter const&) = delete;
+  PngRowWriter& operator=(PngRowWriter &&) = delete;
+
+  uint32_t getWidth()       const { return mWidth; }
+  uint32_t getHeight()      const { return mHeight; }
+  uint32_t getRowsWritten() const { return mRowsWritten; }
+
+  // aRow holds mWidth palette indices.
+  void write(uint8_t const * const aRow);
+
+private:
+  void writeHeader(char const * const aName, std::vector<png_color> const &aPalette);
+  void release();
+};
+
+#endif // PNGROWWRITER_H
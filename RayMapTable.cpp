@@ -0,0 +1,171 @@
+#include "RayMapTable.h"
+#include <cmath>
+
+
+RayMapTable::RayMapTable(Vertex const &aStart, Range const &aRange, double const aTolerance, BatchSolver const &aSolver)
+  : mStart(aStart)
+  , mRange(aRange)
+  , mTolerance(aTolerance)
+  , mCellElevation((aRange.mElevationHigh - aRange.mElevationLow) / csBaseCells)
+  , mCellAzimuth((aRange.mAzimuthHigh - aRange.mAzimuthLow) / csBaseCells) {
+  struct Cell {
+    uint32_t mNode;
+    uint32_t mAzimuth;
+    uint32_t mElevation;
+    uint32_t mSize;
+  };
+  std::unordered_map<uint64_t, RungeKuttaRayBending::Result> samples;
+  std::vector<Cell> pending;
+  std::vector<Cell> next;
+  uint32_t const rootSize = csFinest / csBaseCells;
+  mNodes.resize(csBaseCells * csBaseCells);
+  for(uint32_t e = 0u; e < csBaseCells; ++e) {
+    for(uint32_t a = 0u; a < csBaseCells; ++a) {
+      pending.push_back({e * csBaseCells + a, a * rootSize, e * rootSize, rootSize});
+    }
+  }
+  std::vector<uint64_t> keys;
+  std::vector<Ray> rays;
+  std::vector<RungeKuttaRayBending::Result> results;
+  while(!pending.empty()) {
+    keys.clear();
+    rays.clear();
+    auto request = [this, &samples, &keys, &rays](uint32_t const aAzimuth, uint32_t const aElevation) {
+      auto key = getKey(aAzimuth, aElevation);
+      if(samples.find(key) == samples.end()) {
+        samples.emplace(key, RungeKuttaRayBending::Result{});
+        keys.push_back(key);
+        Ray ray;
+        ray.mStart = mStart;
+        ray.mDirection = getDirection(aAzimuth, aElevation);
+        rays.push_back(ray);
+      }
+      else {} // nothing to do
+    };
+    for(auto const &cell : pending) {                         // All samples of this level are integrated in one batch.
+      auto half = cell.mSize / 2u;
+      for(uint32_t e = 0u; e <= cell.mSize; e += (half > 0u ? half : cell.mSize)) {
+        for(uint32_t a = 0u; a <= cell.mSize; a += (half > 0u ? half : cell.mSize)) {
+          request(cell.mAzimuth + a, cell.mElevation + e);
+        }
+      }
+    }
+    results.resize(rays.size());
+    aSolver(rays.data(), rays.size(), results.data());
+    for(uint32_t i = 0u; i < keys.size(); ++i) {
+      samples[keys[i]] = results[i];
+    }
+    next.clear();
+    for(auto const &cell : pending) {
+      auto &node = mNodes[cell.mNode];
+      auto size = cell.mSize;
+      node.mFirstChild = csNoChild;
+      node.mCorners[0u] = samples[getKey(cell.mAzimuth,        cell.mElevation)];
+      node.mCorners[1u] = samples[getKey(cell.mAzimuth + size, cell.mElevation)];
+      node.mCorners[2u] = samples[getKey(cell.mAzimuth,        cell.mElevation + size)];
+      node.mCorners[3u] = samples[getKey(cell.mAzimuth + size, cell.mElevation + size)];
+      uint32_t validCount = 0u;
+      for(auto const &corner : node.mCorners) {
+        validCount += (corner.mValid ? 1u : 0u);
+      }
+      bool close = (validCount == 4u);
+      auto half = size / 2u;
+      if(half > 0u) {
+        for(uint32_t e = 0u; e <= size; e += half) {
+          for(uint32_t a = 0u; a <= size; a += half) {
+            if(a == half || e == half) {
+              auto const &sample = samples[getKey(cell.mAzimuth + a, cell.mElevation + e)];
+              validCount += (sample.mValid ? 1u : 0u);
+              close = close && isClose(sample, interpolate(node.mCorners, static_cast<double>(a) / size, static_cast<double>(e) / size));
+            }
+            else {} // nothing to do
+          }
+        }
+      }
+      else {} // nothing to do
+      bool const deepEnough = (size <= (rootSize >> csMinDepth));
+      if(close && deepEnough) {
+        node.mKind = Kind::cInterpolate;
+      }
+      else if(validCount == 0u && deepEnough) {
+        node.mKind = Kind::cInvalid;
+      }
+      else if(half == 0u) {
+        node.mKind = Kind::cDirect;
+      }
+      else {
+        node.mKind = Kind::cSplit;
+        node.mFirstChild = static_cast<uint32_t>(mNodes.size());
+        mNodes.resize(mNodes.size() + 4u);                    // Invalidates node.
+        for(uint32_t i = 0u; i < 4u; ++i) {
+          next.push_back({static_cast<uint32_t>(mNodes.size() - 4u + i), cell.mAzimuth + (i % 2u) * half, cell.mElevation + (i / 2u) * half, half});
+        }
+      }
+    }
+    std::swap(pending, next);
+  }
+  mSampleCount = samples.size();
+}
+
+std::optional<RungeKuttaRayBending::Result> RayMapTable::lookup(Vector const &aDirection) const {
+  std::optional<RungeKuttaRayBending::Result> result;
+  auto elevation = std::asin(std::max(-1.0, std::min(1.0, aDirection(1u) / aDirection.norm())));
+  auto azimuth = std::atan2(aDirection(2u), aDirection(0u));
+  auto u = (azimuth - mRange.mAzimuthLow) / mCellAzimuth;
+  auto v = (elevation - mRange.mElevationLow) / mCellElevation;
+  if(u >= 0.0 && v >= 0.0 && u < csBaseCells && v < csBaseCells) {
+    auto rootU = static_cast<uint32_t>(u);
+    auto rootV = static_cast<uint32_t>(v);
+    u -= rootU;
+    v -= rootV;
+    auto const *node = &mNodes[rootV * csBaseCells + rootU];
+    while(node->mKind == Kind::cSplit) {
+      uint32_t child = 0u;
+      u *= 2.0;
+      v *= 2.0;
+      if(u >= 1.0) {
+        child += 1u;
+        u -= 1.0;
+      }
+      else {} // nothing to do
+      if(v >= 1.0) {
+        child += 2u;
+        v -= 1.0;
+      }
+      else {} // nothing to do
+      node = &mNodes[node->mFirstChild + child];
+    }
+    if(node->mKind == Kind::cInterpolate) {
+      result = interpolate(node->mCorners, u, v);
+    }
+    else if(node->mKind == Kind::cInvalid) {
+      result = RungeKuttaRayBending::Result{};
+      result->mValid = false;
+    }
+    else {} // nothing to do
+  }
+  else {} // nothing to do
+  return result;
+}
+
+Vector RayMapTable::getDirection(uint32_t const aAzimuth, uint32_t const aElevation) const {
+  auto azimuth = mRange.mAzimuthLow + aAzimuth * mCellAzimuth * csBaseCells / csFinest;
+  auto elevation = mRange.mElevationLow + aElevation * mCellElevation * csBaseCells / csFinest;
+  return Vector(std::cos(elevation) * std::cos(azimuth), std::sin(elevation), std::cos(elevation) * std::sin(azimuth));
+}
+
+bool RayMapTable::isClose(RungeKuttaRayBending::Result const &aExpected, RungeKuttaRayBending::Result const &aResult) const {
+  return aExpected.mValid && aResult.mValid && (aExpected.mValue - aResult.mValue).norm() <= mTolerance;
+}
+
+RungeKuttaRayBending::Result RayMapTable::interpolate(std::array<RungeKuttaRayBending::Result, 4u> const &aCorners, double const aAzimuth, double const aElevation) {
+  RungeKuttaRayBending::Result result;
+  auto w0 = (1.0 - aAzimuth) * (1.0 - aElevation);
+  auto w1 = aAzimuth * (1.0 - aElevation);
+  auto w2 = (1.0 - aAzimuth) * aElevation;
+  auto w3 = aAzimuth * aElevation;
+  result.mValid = true;
+  result.mValue = w0 * aCorners[0u].mValue + w1 * aCorners[1u].mValue + w2 * aCorners[2u].mValue + w3 * aCorners[3u].mValue;
+  result.mDirection = (w0 * aCorners[0u].mDirection + w1 * aCorners[1u].mDirection + w2 * aCorners[2u].mDirection + w3 * aCorners[3u].mDirection).normalized();
+  return result;
+}
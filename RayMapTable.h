@@ -0,0 +1,82 @@
+#ifndef RAYMAPTABLE_H
+#define RAYMAPTABLE_H
+
+#include "RungeKuttaRayBending.h"
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+
+// Samples the mapping of launch direction to hit point of rays from a fixed start on an
+// adaptive grid over elevation and azimuth, so rays can be answered by bilinear interpolation.
+// The range is split into csBaseCells x csBaseCells root cells, and each cell is split into
+// 4 children as long as its center or edge midpoints deviate more than the tolerance from
+// the interpolation of its corners. Cells with both valid and invalid samples (like near the
+// surface) or not converging at csMaxDepth are marked for direct integration. Cells are taken as
+// interpolated or all invalid only from csMinDepth on, so the 9 samples of a root cell alone cannot
+// hide a thin strip of valid rays or bridge a thin strip of invalid ones.
+class RayMapTable final {
+public:
+  struct Range {
+    double mElevationLow;
+    double mElevationHigh;
+    double mAzimuthLow;
+    double mAzimuthHigh;
+  };
+
+  // Solves aCount rays into aResults.
+  using BatchSolver = std::function<void(Ray const * const aRays, uint32_t const aCount, RungeKuttaRayBending::Result * const aResults)>;
+
+private:
+  static constexpr uint32_t csBaseCells = 16u;
+  static constexpr uint32_t csMinDepth  = 2u;
+  static constexpr uint32_t csMaxDepth  = 8u;
+  static constexpr uint32_t csFinest    = csBaseCells << csMaxDepth;  // Grid coordinates of samples are in [0, csFinest].
+  static constexpr uint32_t csNoChild   = 0u;                         // Root cells are never children.
+
+  enum class Kind : uint8_t {
+    cInterpolate = 0u,
+    cInvalid     = 1u,
+    cDirect      = 2u,
+    cSplit       = 3u
+  };
+
+  struct Node {
+    Kind     mKind;
+    uint32_t mFirstChild;                                     // 4 consecutive nodes: low-low, high-low, low-high, high-high azimuth-elevation
+    std::array<RungeKuttaRayBending::Result, 4u> mCorners;    // in the same order.
+  };
+
+  Vertex            const mStart;
+  Range             const mRange;
+  double            const mTolerance;
+  double            const mCellElevation;
+  double            const mCellAzimuth;
+  std::vector<Node>       mNodes;
+  uint32_t                mSampleCount;
+
+public:
+  RayMapTable(Vertex const &aStart, Range const &aRange, double const aTolerance, BatchSolver const &aSolver);
+
+  RayMapTable(RayMapTable const&) = delete;
+  RayMapTable(RayMapTable &&) = delete;
+  RayMapTable& operator=(RayMapTable const&) = delete;
+  RayMapTable& operator=(RayMapTable &&) = delete;
+
+  Vertex const& getStart()       const { return mStart; }
+  uint32_t      getSampleCount() const { return mSampleCount; }
+  uint32_t      getNodeCount()   const { return mNodes.size(); }
+
+  // Returns nothing if the direction is outside the range or needs direct integration.
+  std::optional<RungeKuttaRayBending::Result> lookup(Vector const &aDirection) const;
+
+private:
+  Vector getDirection(uint32_t const aAzimuth, uint32_t const aElevation) const;
+  bool isClose(RungeKuttaRayBending::Result const &aExpected, RungeKuttaRayBending::Result const &aResult) const;
+
+  static uint64_t getKey(uint32_t const aAzimuth, uint32_t const aElevation) { return (static_cast<uint64_t>(aElevation) << 32u) | aAzimuth; }
+  static RungeKuttaRayBending::Result interpolate(std::array<RungeKuttaRayBending::Result, 4u> const &aCorners, double const aAzimuth, double const aElevation);
+};
+
+#endif // RAYMAPTABLE_H
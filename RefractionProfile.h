@@ -0,0 +1,136 @@
+#ifndef REFRACTIONPROFILE_H
+#define REFRACTIONPROFILE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+
+// Tabulated refractive index n(h) and its derivative dn/dh for non-negative heights. The grid
+// has a uniform band [0, csHeight0) followed by bands doubling in width up to csHeightMax,
+// each band having the same number of intervals, so it is dense near the ground where the
+// profiles change fast. Both n and dn/dh are interpolated by cubic Hermite polynomials using
+// dn/dh and d2n/dh2 at the nodes. The interval count is doubled until the error measured
+// inside the intervals is below the tolerance for both. Above csHeightMax all the models are
+// constant within double precision, so the values there are taken from the last node.
+// Below 0 the exact functions are needed, because the table does not cover it.
+class RefractionProfile final {
+private:
+  static constexpr double   csHeight0      = 1.0 / 64.0;  // m
+  static constexpr uint32_t csBandCount    = 10u;         // Up to csHeight0 * 2^9 == 8 m
+  static constexpr double   csHeightMax    = csHeight0 * (1u << (csBandCount - 1u));
+  static constexpr uint32_t csIntervalsMin = 8u;
+  static constexpr uint32_t csIntervalsMax = 4096u;
+
+  struct Node {
+    double mN;
+    double mDiff;
+    double mDiff2;
+    double mWidth;   // of the interval starting here
+  };
+
+  uint32_t          mIntervals;   // per band
+  std::vector<Node> mNodes;
+  double            mErrorRefract;
+  double            mErrorDiff;
+
+public:
+  template <typename tRefract, typename tRefractDiff, typename tRefractDiff2>
+  RefractionProfile(double const aTolerance, tRefract &&aRefract, tRefractDiff &&aRefractDiff, tRefractDiff2 &&aRefractDiff2);
+
+  // Maximal error measured at the quarter points of the intervals.
+  double getErrorRefract() const { return mErrorRefract; }
+  double getErrorDiff()    const { return mErrorDiff; }
+  uint32_t getNodeCount()  const { return mNodes.size(); }
+
+  // aH must be non-negative.
+  double getRefract(double const aH) const {
+    double theta;
+    auto index = locate(aH, theta);
+    return interpolate(mNodes[index].mN, mNodes[index].mDiff, mNodes[index + 1u].mN, mNodes[index + 1u].mDiff, getWidth(index), theta);
+  }
+
+  // aH must be non-negative.
+  double getRefractDiff(double const aH) const {
+    double theta;
+    auto index = locate(aH, theta);
+    return interpolate(mNodes[index].mDiff, mNodes[index].mDiff2, mNodes[index + 1u].mDiff, mNodes[index + 1u].mDiff2, getWidth(index), theta);
+  }
+
+private:
+  double calculateWidth(uint32_t const aIndex) const {
+    auto band = aIndex / mIntervals;
+    return (band == 0u ? csHeight0 : std::ldexp(csHeight0, band - 1u)) / mIntervals;
+  }
+
+  double getHeight(uint32_t const aIndex) const {
+    auto band = aIndex / mIntervals;
+    auto inBand = static_cast<double>(aIndex % mIntervals) / mIntervals;
+    return band == 0u ? csHeight0 * inBand : std::ldexp(csHeight0, band - 1u) * (1.0 + inBand);
+  }
+
+  double getWidth(uint32_t const aIndex) const { return mNodes[aIndex].mWidth; }
+
+  // Returns the index of the interval and the position aTheta within it in [0, 1].
+  // The band and the position in it come from the exponent and mantissa of aH / csHeight0.
+  uint32_t locate(double const aH, double &aTheta) const {
+    uint32_t band;
+    double inBand;
+    auto relative = aH * (1.0 / csHeight0);
+    if(relative < 1.0) {
+      band = 0u;
+      inBand = relative;
+    }
+    else if(aH < csHeightMax) {
+      uint64_t bits;
+      std::memcpy(&bits, &relative, sizeof(bits));
+      band = static_cast<uint32_t>((bits >> 52u) & 0x7ffu) - 1022u;             // relative == 2^(band - 1) * (1 + inBand)
+      inBand = static_cast<double>(bits & ((uint64_t(1u) << 52u) - 1u)) * (1.0 / (uint64_t(1u) << 52u));
+    }
+    else {
+      band = csBandCount - 1u;
+      inBand = 1.0;
+    }
+    auto position = inBand * mIntervals;
+    auto inside = std::min(static_cast<uint32_t>(position), mIntervals - 1u);
+    aTheta = position - inside;
+    return band * mIntervals + inside;
+  }
+
+  static double interpolate(double const aY0, double const aDydh0, double const aY1, double const aDydh1, double const aWidth, double const aTheta) {
+    auto theta2 = aTheta * aTheta;
+    auto theta3 = theta2 * aTheta;
+    return (2.0 * theta3 - 3.0 * theta2 + 1.0) * aY0 + (theta3 - 2.0 * theta2 + aTheta) * aWidth * aDydh0
+         + (-2.0 * theta3 + 3.0 * theta2) * aY1 + (theta3 - theta2) * aWidth * aDydh1;
+  }
+};
+
+template <typename tRefract, typename tRefractDiff, typename tRefractDiff2>
+RefractionProfile::RefractionProfile(double const aTolerance, tRefract &&aRefract, tRefractDiff &&aRefractDiff, tRefractDiff2 &&aRefractDiff2) {
+  for(mIntervals = csIntervalsMin; mIntervals <= csIntervalsMax; mIntervals *= 2u) {
+    auto nodeCount = csBandCount * mIntervals + 1u;
+    mNodes.resize(nodeCount);
+    for(uint32_t i = 0u; i < nodeCount; ++i) {
+      auto h = getHeight(i);
+      mNodes[i] = Node{ aRefract(h), aRefractDiff(h), aRefractDiff2(h), calculateWidth(i) };
+    }
+    mErrorRefract = 0.0;
+    mErrorDiff = 0.0;
+    for(uint32_t i = 0u; i < nodeCount - 1u; ++i) {
+      for(double theta = 0.25; theta < 1.0; theta += 0.25) {
+        auto h = getHeight(i) + theta * getWidth(i);
+        mErrorRefract = std::max(mErrorRefract, std::abs(getRefract(h) - aRefract(h)));
+        mErrorDiff = std::max(mErrorDiff, std::abs(getRefractDiff(h) - aRefractDiff(h)));
+      }
+    }
+    if(mErrorRefract <= aTolerance && mErrorDiff <= aTolerance) {
+      break;
+    }
+    else {} // nothing to do
+  }
+  mIntervals = std::min(mIntervals, csIntervalsMax);
+}
+
+#endif // REFRACTIONPROFILE_H
@@ -2,7 +2,7 @@
 #include <cmath>
 
 
-RungeKuttaRayBending::Result RungeKuttaRayBending::solve4xFlat(Vertex const &aStart, Vector const &aDir, double const aX) {
+void RungeKuttaRayBending::solveTrajectoryFlat(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults) {
   typename Eikonal::Variables start;
   start[0u] = aStart(0u);
   start[1u] = aStart(1u);
@@ -11,22 +11,20 @@ RungeKuttaRayBending::Result RungeKuttaRayBending::solve4xFlat(Vertex const &aSt
   start[3u] = aDir(0u) * slowness;
   start[4u] = aDir(1u) * slowness;
   start[5u] = aDir(2u) * slowness;
-  auto solution = mSolver.solve(start,
-      [aX](double const, typename Eikonal::Variables const& aY){ return aY[0] >= aX; },
-    [this](typename Eikonal::Variables const& aYprev, typename Eikonal::Variables const& aYnow) { return decide2resetBigStep(aYprev, aYnow); });
-  Result result;
-  result.mValid = solution.mValid;
-  result.mValue(0u) = solution.mValue[0u];
-  result.mValue(1u) = solution.mValue[1u];
-  result.mValue(2u) = solution.mValue[2u];
-  result.mDirection(0u) = solution.mValue[3u];
-  result.mDirection(1u) = solution.mValue[4u];
-  result.mDirection(2u) = solution.mValue[5u];
-  result.mDirection.normalize();
-  return result;
+  solveTargets<Eikonal>(start, aXs, aCount, 0.0, aResults, [](typename Eikonal::Variables const& aY){ return aY[0]; }, [](typename Eikonal::Variables const& aY){
+    Result result;
+    result.mValue(0u) = aY[0u];
+    result.mValue(1u) = aY[1u];
+    result.mValue(2u) = aY[2u];
+    result.mDirection(0u) = aY[3u];
+    result.mDirection(1u) = aY[4u];
+    result.mDirection(2u) = aY[5u];
+    result.mDirection.normalize();
+    return result;
+  });
 }
 
-RungeKuttaRayBending::Result RungeKuttaRayBending::solve4xRound(Vertex const &aStart, Vector const &aDir, double const aX) {
+void RungeKuttaRayBending::solveTrajectoryRound(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults) {
   typename Eikonal::Variables start;
   start[0u] = aStart(0u);
   start[1u] = aStart(1u) + mDiffEq.getEarthRadius();
@@ -35,17 +33,149 @@ RungeKuttaRayBending::Result RungeKuttaRayBending::solve4xRound(Vertex const &aS
   start[3u] = aDir(0u) * slowness;
   start[4u] = aDir(1u) * slowness;
   start[5u] = aDir(2u) * slowness;
-  auto solution = mSolver.solve(start,
-      [aX](double const, typename Eikonal::Variables const& aY){ return aY[0] >= aX; },     // We now neglect the variation in perpendicular along the travelled distance.
-    [this](typename Eikonal::Variables const& aYprev, typename Eikonal::Variables const& aYnow) { return decide2resetBigStep(aYprev, aYnow); });
-  Result result;
-  result.mValid = solution.mValid;
-  result.mValue(0u) = solution.mValue[0u];
-  result.mValue(1u) = solution.mValue[1u] - mDiffEq.getEarthRadius();
-  result.mValue(2u) = solution.mValue[2u];
-  result.mDirection(0u) = solution.mValue[3u];
-  result.mDirection(1u) = solution.mValue[4u];
-  result.mDirection(2u) = solution.mValue[5u];
-  result.mDirection.normalize();
+  auto earthRadius = mDiffEq.getEarthRadius();
+  // We now neglect the variation in perpendicular along the travelled distance.
+  solveTargets<Eikonal>(start, aXs, aCount, 0.0, aResults, [](typename Eikonal::Variables const& aY){ return aY[0]; }, [earthRadius](typename Eikonal::Variables const& aY){
+    Result result;
+    result.mValue(0u) = aY[0u];
+    result.mValue(1u) = aY[1u] - earthRadius;
+    result.mValue(2u) = aY[2u];
+    result.mDirection(0u) = aY[3u];
+    result.mDirection(1u) = aY[4u];
+    result.mDirection(2u) = aY[5u];
+    result.mDirection.normalize();
+    return result;
+  });
+}
+
+// The horizontal unit vector of the plane is taken perpendicular to the zenith of the start.
+// For flat Earth the crossing happens at horizontal distance (x - start) / cos(azimuth).
+void RungeKuttaRayBending::solveTrajectoryPlanar(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults) {
+  Vertex origin;
+  Vector up;
+  if(mDiffEq.getEarthForm() == Eikonal::EarthForm::cFlat) {
+    origin = Vertex(aStart(0u), 0.0, aStart(2u));
+    up = Vector(0.0, 1.0, 0.0);
+  }
+  else {
+    origin = Vertex(0.0, -mDiffEq.getEarthRadius(), 0.0);
+    up = (aStart - origin).normalized();
+  }
+  Vector horizontal = aDir - aDir.dot(up) * up;
+  if(horizontal.norm() < cgGeneralEpsilon * cgGeneralEpsilon) {
+    horizontal = (std::abs(up(2u)) < 0.5 ? Vector(0.0, 0.0, 1.0) : Vector(1.0, 0.0, 0.0)).cross(up);
+  }
+  else {} // nothing to do
+  horizontal.normalize();
+  typename EikonalPlanar<Eikonal>::Variables start;
+  start[0u] = (aStart - origin).dot(horizontal);
+  start[1u] = (aStart - origin).dot(up);
+  auto slowness = mDiffEq.getSlowness(aStart(1u));  // from height
+  start[2u] = aDir.dot(horizontal) * slowness;
+  start[3u] = aDir.dot(up) * slowness;
+  solveTargets<EikonalPlanar<Eikonal>>(start, aXs, aCount, origin(0u), aResults, [&horizontal, &up](typename EikonalPlanar<Eikonal>::Variables const& aY){
+    return aY[0] * horizontal(0u) + aY[1] * up(0u);
+  }, [&origin, &horizontal, &up](typename EikonalPlanar<Eikonal>::Variables const& aY){
+    Result result;
+    result.mValue = origin + aY[0u] * horizontal + aY[1u] * up;
+    result.mDirection = aY[2u] * horizontal + aY[3u] * up;
+    result.mDirection.normalize();
+    return result;
+  });
+}
+
+RungeKuttaRayBending::ResultJacobian RungeKuttaRayBending::solveJacobian(Vertex const &aStart, Vector const &aDir, double const aX, bool const aTemperatures, bool const aStopAtLowest) {
+  ResultJacobian result;
+  if(aTemperatures) {
+    solveJacobian<4u>(aStart, aDir, aX, aStopAtLowest, result);
+  }
+  else {
+    solveJacobian<2u>(aStart, aDir, aX, aStopAtLowest, result);
+    for(uint32_t k = 2u; k < csParameterCount; ++k) {
+      result.mJacobian[k].mValue = Vector::Zero();
+      result.mJacobian[k].mDirection = Vector::Zero();
+    }
+  }
   return result;
 }
+
+// The direction derivatives start from those of the unit start direction, scaled by the start
+// slowness like the direction itself, and the temperatures change the start slowness. At the end
+// the derivatives are moved to constant x along the ray with the differentials there, and the
+// direction ones to the normalised direction.
+template <uint32_t tParameterCount>
+void RungeKuttaRayBending::solveJacobian(Vertex const &aStart, Vector const &aDir, double const aX, bool const aStopAtLowest, ResultJacobian &aResult) {
+  using Variational = EikonalVariational<Eikonal, tParameterCount>;
+  constexpr uint32_t cRay = Variational::csNvarRay;
+  bool flat = (mDiffEq.getEarthForm() == Eikonal::EarthForm::cFlat);
+  typename Variational::Variables start;
+  start.fill(0.0);
+  start[0u] = aStart(0u);
+  start[1u] = aStart(1u) + (flat ? 0.0 : mDiffEq.getEarthRadius());
+  start[2u] = aStart(2u);
+  auto slowness = mDiffEq.getSlowness(aStart(1u));  // from height
+  auto horizontal = std::sqrt(aDir(0u) * aDir(0u) + aDir(2u) * aDir(2u));
+  Vector byElevation(-aDir(1u) * aDir(0u) / horizontal, horizontal, -aDir(1u) * aDir(2u) / horizontal);
+  Vector byAzimuth(-aDir(2u), 0.0, aDir(0u));
+  for(uint32_t i = 0u; i < 3u; ++i) {
+    start[3u + i] = aDir(i) * slowness;
+    start[cRay + 3u + i] = byElevation(i) * slowness;
+    start[2u * cRay + 3u + i] = byAzimuth(i) * slowness;
+  }
+  if constexpr(tParameterCount > 2u) {
+    auto byTemp = mDiffEq.getTempDerivatives(aStart(1u));
+    for(uint32_t i = 0u; i < 3u; ++i) {
+      start[3u * cRay + 3u + i] = aDir(i) * byTemp.mRefractByAmbient / Eikonal::csC;
+      start[4u * cRay + 3u + i] = aDir(i) * byTemp.mRefractByBase / Eikonal::csC;
+    }
+  }
+  else {} // nothing to do
+  auto getRadial = [flat](typename Variational::Variables const& aY) {
+    return flat ? aY[4u] : aY[0u] * aY[3u] + aY[1u] * aY[4u] + aY[2u] * aY[5u];
+  };
+  auto judge = [aX, aStopAtLowest, &getRadial](double const aT, typename Variational::Variables const& aY) {
+    return aY[0u] >= aX || (aStopAtLowest && aT > 0.0 && getRadial(aY) > 0.0);
+  };
+  typename OdeSolverGsl<Variational>::Result solution;
+  if(mParameters.mStepper == StepperType::cNativeFehlberg45) {
+    solution = solveVariationalNative<tParameterCount, ButcherTableauFehlberg45>(start, judge);
+  }
+  else if(mParameters.mStepper == StepperType::cNativeCashKarp45) {
+    solution = solveVariationalNative<tParameterCount, ButcherTableauCashKarp45>(start, judge);
+  }
+  else if(mParameters.mStepper == StepperType::cNativeDormandPrince45) {
+    solution = solveVariationalNative<tParameterCount, ButcherTableauDormandPrince45>(start, judge);
+  }
+  else {
+    auto &solver = getSolverGsl<Variational>();
+    if(!solver) {
+      solver.emplace(mParameters.mStepper, 0.0, mParameters.mDistAlongRay, mParameters.mTolAbs, mParameters.mTolRel,
+                     mParameters.mStep1, mParameters.mStepMin, mParameters.mStepMax, getDiffEqVariational<tParameterCount>());
+    }
+    else {} // nothing to do
+    solution = solver->solve(start, judge, [this](typename Variational::Variables const& aYprev, typename Variational::Variables const& aYnow) {
+      return decide2resetBigStep(getRay(aYprev), getRay(aYnow), mMaxCosDirChange);
+    });
+  }
+  auto const &y = solution.mValue;
+  Eikonal::Variables dydt;
+  bool atX = (y[0u] >= aX && mDiffEq.differentials(solution.mAtIndependent, y.data(), dydt.data()) == GSL_SUCCESS && dydt[0u] != 0.0);
+  aResult.mValid = solution.mValid;
+  for(uint32_t i = 0u; i < 3u; ++i) {
+    aResult.mValue(i) = y[i];
+    aResult.mDirection(i) = y[i + 3u];
+  }
+  aResult.mValue(1u) -= (flat ? 0.0 : mDiffEq.getEarthRadius());
+  auto norm = aResult.mDirection.norm();
+  aResult.mDirection /= norm;
+  for(uint32_t k = 0u; k < tParameterCount; ++k) {
+    auto const *d = y.data() + (k + 1u) * cRay;
+    double shift = (atX ? -d[0u] / dydt[0u] : 0.0);       // Of the path parameter to get back to constant x.
+    auto &derivative = aResult.mJacobian[k];
+    for(uint32_t i = 0u; i < 3u; ++i) {
+      derivative.mValue(i) = d[i] + (atX ? shift * dydt[i] : 0.0);
+      derivative.mDirection(i) = d[i + 3u] + (atX ? shift * dydt[i + 3u] : 0.0);
+    }
+    derivative.mDirection = (derivative.mDirection - aResult.mDirection.dot(derivative.mDirection) * aResult.mDirection) / norm;
+  }
+}
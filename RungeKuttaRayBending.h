@@ -4,40 +4,92 @@
 #include "mathUtil.h"
 #include "3dGeomUtil.h"
 #include "Eikonal.h"
+#include "EikonalPlanar.h"
+#include "EikonalVariational.h"
 #include "OdeSolverGsl.h"
+#include "OdeSolverRungeKutta.h"
+#include <algorithm>
+#include <optional>
+#include <type_traits>
 
 
 class RungeKuttaRayBending final {
-private:
-  Eikonal const        &mDiffEq;
-  OdeSolverGsl<Eikonal> mSolver;
-  double                mMaxCosDirChange;
-
 public:
   struct Parameters {
-    StepperType mStepper;
-    double      mDistAlongRay;
-    double      mTolAbs;
-    double      mTolRel;
-    double      mStep1;
-    double      mStepMin;
-    double      mStepMax;
-    double      mMaxCosDirChange;
+    StepperType     mStepper;
+    ErrorController mController;       // Only for native steppers.
+    double          mDistAlongRay;
+    double          mTolAbs;
+    double          mTolRel;
+    double          mStep1;
+    double          mStepMin;
+    double          mStepMax;
+    double          mMaxCosDirChange;
+    bool            mPlanar;           // Integrates in the vertical plane of the ray with 4 variables.
   };
 
+private:
+  Parameters                                    const  mParameters;
+  Eikonal                                       const &mDiffEq;
+  EikonalPlanar<Eikonal>                        const  mDiffEqPlanar;
+  EikonalVariational<Eikonal, 2u>               const  mDiffEqDirections;
+  EikonalVariational<Eikonal, 4u>               const  mDiffEqAll;
+  std::optional<OdeSolverGsl<Eikonal>>                 mSolverGsl;         // Only for GSL steppers.
+  std::optional<OdeSolverGsl<EikonalPlanar<Eikonal>>>  mSolverGslPlanar;   // Only for GSL steppers in planar mode.
+  std::optional<OdeSolverGsl<EikonalVariational<Eikonal, 2u>>> mSolverGslDirections;   // Only for GSL steppers, constructed on the first solveJacobian.
+  std::optional<OdeSolverGsl<EikonalVariational<Eikonal, 4u>>> mSolverGslAll;
+  double                                               mMaxCosDirChange;
+
+public:
   struct Result {
     bool   mValid;
     Vertex mValue;
     Vector mDirection;
   };
 
+  // Start parameters of solveJacobian in the order of the Jacobian columns.
+  enum class Parameter : uint8_t {
+    cElevation   = 0u,   // of the start direction, radians
+    cAzimuth     = 1u,   // of the start direction, radians
+    cTempAmbient = 2u,   // Celsius
+    cTempBase    = 3u    // Celsius
+  };
+  static constexpr uint32_t csParameterCount = 4u;
+
+  // Derivatives of a Result by one start Parameter.
+  struct Derivative {
+    Vector mValue;
+    Vector mDirection;
+  };
+
+  // A Result with its derivatives by each Parameter.
+  struct ResultJacobian : public Result {
+    std::array<Derivative, csParameterCount> mJacobian;
+
+    Derivative const& get(Parameter const aBy) const { return mJacobian[static_cast<uint32_t>(aBy)]; }
+  };
+
   RungeKuttaRayBending(Parameters const &aParameters, Eikonal const &aDiffEq)
-    : mDiffEq(aDiffEq)
-    , mSolver(aParameters.mStepper, 0.0, aParameters.mDistAlongRay, aParameters.mTolAbs, aParameters.mTolRel,
-              aParameters.mStep1, aParameters.mStepMin, aParameters.mStepMax, aDiffEq)
-    , mMaxCosDirChange(aParameters.mMaxCosDirChange) {}
+    : mParameters(aParameters)
+    , mDiffEq(aDiffEq)
+    , mDiffEqPlanar(aDiffEq)
+    , mDiffEqDirections(aDiffEq)
+    , mDiffEqAll(aDiffEq)
+    , mMaxCosDirChange(aParameters.mMaxCosDirChange) {
+    if(isNative(aParameters.mStepper)) {
+      // nothing to do
+    }
+    else if(aParameters.mPlanar) {
+      mSolverGslPlanar.emplace(aParameters.mStepper, 0.0, aParameters.mDistAlongRay, aParameters.mTolAbs, aParameters.mTolRel,
+                               aParameters.mStep1, aParameters.mStepMin, aParameters.mStepMax, mDiffEqPlanar);
+    }
+    else {
+      mSolverGsl.emplace(aParameters.mStepper, 0.0, aParameters.mDistAlongRay, aParameters.mTolAbs, aParameters.mTolRel,
+                         aParameters.mStep1, aParameters.mStepMin, aParameters.mStepMax, aDiffEq);
+    }
+  }
 
-  RungeKuttaRayBending(RungeKuttaRayBending const&) = default;
+  RungeKuttaRayBending(RungeKuttaRayBending const&) = delete;   // The copy would still integrate the Eikonal of the original. Use SolverPool.
   RungeKuttaRayBending(RungeKuttaRayBending &&) = delete;
   RungeKuttaRayBending& operator=(RungeKuttaRayBending const&) = delete;
   RungeKuttaRayBending& operator=(RungeKuttaRayBending &&) = delete;
@@ -45,19 +97,204 @@ public:
   double getRefract(double const aH) const { return mDiffEq.getRefract(aH); }
 
   Result solve4x(Vertex const &aStart, Vector const &aDir, double const aX) {
-    return mDiffEq.getEarthForm() == Eikonal::EarthForm::cFlat ? solve4xFlat(aStart, aDir, aX) : solve4xRound(aStart, aDir, aX);
+    Result result;
+    solveTrajectory(aStart, aDir, &aX, 1u, &result);
+    return result;
+  }
+
+  // Records the ray at each of the aCount ascending aXs into aResults during one integration.
+  // If the integration fails or ends before a target, the first one not reached gets the last
+  // state like solve4x, and the rest are invalid.
+  void solveTrajectory(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults) {
+    if(mParameters.mPlanar) {
+      solveTrajectoryPlanar(aStart, aDir, aXs, aCount, aResults);
+    }
+    else if(mDiffEq.getEarthForm() == Eikonal::EarthForm::cFlat) {
+      solveTrajectoryFlat(aStart, aDir, aXs, aCount, aResults);
+    }
+    else {
+      solveTrajectoryRound(aStart, aDir, aXs, aCount, aResults);
+    }
+  }
+
+  // Like solve4x, with the Jacobian of the result taken at the same x from the same integration.
+  // The temperature columns are only integrated if aTemperatures, otherwise they are zero. If
+  // aStopAtLowest and the ray turns upwards before aX, it stops at its lowest point instead. The
+  // derivatives there are taken at the same point of the path, and as the elevation is stationary,
+  // its derivative is that of the lowest elevation. Integrates in 3D even in planar mode.
+  ResultJacobian solveJacobian(Vertex const &aStart, Vector const &aDir, double const aX, bool const aTemperatures, bool const aStopAtLowest = false);
+
+  static bool isNative(StepperType const aStepper) {
+    return aStepper == StepperType::cNativeFehlberg45 || aStepper == StepperType::cNativeCashKarp45 || aStepper == StepperType::cNativeDormandPrince45;
+  }
+
+  // The second half of the variables is the direction for both Eikonal and EikonalPlanar.
+  template <typename tVariables>
+  static bool decide2resetBigStep(tVariables const& aYprev, tVariables const& aYnow, double const aMaxCosDirChange) {
+    constexpr uint32_t cDim = std::tuple_size<tVariables>::value / 2u;
+    double dot = 0.0;
+    double normPrev = 0.0;
+    double norm = 0.0;
+    for(uint32_t i = cDim; i < 2u * cDim; ++i) {
+      dot      += aYprev[i] * aYnow[i];
+      normPrev += aYprev[i] * aYprev[i];
+      norm     += aYnow[i] * aYnow[i];
+    }
+    auto dirChangeCos = dot / std::sqrt(norm) / std::sqrt(normPrev);
+    return dirChangeCos < aMaxCosDirChange;
   }
 
 private:
-  Result solve4xFlat(Vertex const &aStart, Vector const &aDir, double const aX);
-  Result solve4xRound(Vertex const &aStart, Vector const &aDir, double const aX);
+  void solveTrajectoryFlat(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults);
+  void solveTrajectoryRound(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults);
+  void solveTrajectoryPlanar(Vertex const &aStart, Vector const &aDir, double const * const aXs, uint32_t const aCount, Result * const aResults);
 
-  bool decide2resetBigStep(typename Eikonal::Variables const& aYprev, typename Eikonal::Variables const& aYnow) {
-    Vector dirPrev(aYprev[3u], aYprev[4u], aYprev[5u]);
-    Vector dir(aYnow[3u], aYnow[4u], aYnow[5u]);
-    auto dirChangeCos = dir.dot(dirPrev) / dir.norm() / dirPrev.norm();
-    return dirChangeCos < mMaxCosDirChange;
+  template <uint32_t tParameterCount>
+  void solveJacobian(Vertex const &aStart, Vector const &aDir, double const aX, bool const aStopAtLowest, ResultJacobian &aResult);
+
+  template <uint32_t tParameterCount, typename tButcherTableau, typename tJudge>
+  typename OdeSolverGsl<EikonalVariational<Eikonal, tParameterCount>>::Result solveVariationalNative(typename EikonalVariational<Eikonal, tParameterCount>::Variables const &aStart, tJudge &&aJudge);
+
+  // aGetX(y) is compared to aXs[i] - aOffset, and aConvert(y) gives the Result without validity.
+  template <typename tOdeDefinition, typename tGetX, typename tConvert>
+  void solveTargets(typename tOdeDefinition::Variables const &aStart, double const * const aXs, uint32_t const aCount, double const aOffset,
+                    Result * const aResults, tGetX &&aGetX, tConvert &&aConvert);
+
+  template <typename tOdeDefinition, typename tJudge, typename tOnEvent>
+  typename OdeSolverGsl<tOdeDefinition>::Result solve(typename tOdeDefinition::Variables const &aStart, tJudge &&aJudge, tOnEvent &&aOnEvent);
+
+  // Native steppers run on the EikonalSpecialised matching the Eikonal, selected once per ray.
+  template <typename tOdeDefinition, typename tButcherTableau, typename tJudge, typename tOnEvent>
+  typename OdeSolverGsl<tOdeDefinition>::Result solveNative(typename tOdeDefinition::Variables const &aStart, tJudge &&aJudge, tOnEvent &&aOnEvent);
+
+  template <typename tOdeDefinition, typename tButcherTableau, typename tSpecialised, typename tJudge, typename tOnEvent>
+  typename OdeSolverGsl<tOdeDefinition>::Result solveSpecialised(tSpecialised const &aDiffEq, typename tOdeDefinition::Variables const &aStart, tJudge &&aJudge, tOnEvent &&aOnEvent);
+
+  template <typename tVariables>
+  static Eikonal::Variables getRay(tVariables const &aY) {
+    Eikonal::Variables result;
+    std::copy(aY.begin(), aY.begin() + Eikonal::csNvar, result.begin());
+    return result;
   }
+
+  template <uint32_t tParameterCount>
+  EikonalVariational<Eikonal, tParameterCount> const& getDiffEqVariational() const {
+    if constexpr(tParameterCount == 2u) {
+      return mDiffEqDirections;
+    }
+    else {
+      return mDiffEqAll;
+    }
+  }
+
+  template <typename tOdeDefinition>
+  std::optional<OdeSolverGsl<tOdeDefinition>>& getSolverGsl() {
+    if constexpr(std::is_same_v<tOdeDefinition, Eikonal>) {
+      return mSolverGsl;
+    }
+    else if constexpr(std::is_same_v<tOdeDefinition, EikonalPlanar<Eikonal>>) {
+      return mSolverGslPlanar;
+    }
+    else if constexpr(std::is_same_v<tOdeDefinition, EikonalVariational<Eikonal, 2u>>) {
+      return mSolverGslDirections;
+    }
+    else {
+      return mSolverGslAll;
+    }
+  }
+
 };
 
+template <uint32_t tParameterCount, typename tButcherTableau, typename tJudge>
+typename OdeSolverGsl<EikonalVariational<Eikonal, tParameterCount>>::Result RungeKuttaRayBending::solveVariationalNative(typename EikonalVariational<Eikonal, tParameterCount>::Variables const &aStart, tJudge &&aJudge) {
+  return mDiffEq.dispatch([this, &aStart, &aJudge](auto const &aSpecialised) {
+    using Variational = EikonalVariational<std::decay_t<decltype(aSpecialised)>, tParameterCount>;
+    Variational variational(aSpecialised);
+    OdeSolverRungeKutta<Variational, tButcherTableau> solver(0.0, mParameters.mDistAlongRay, mParameters.mTolAbs, mParameters.mTolRel,
+                                                             mParameters.mStep1, mParameters.mStepMin, mParameters.mStepMax, variational, mParameters.mController);
+    auto solution = solver.solve(aStart, aJudge, [this](typename Variational::Variables const& aYprev, typename Variational::Variables const& aYnow) {
+      return decide2resetBigStep(getRay(aYprev), getRay(aYnow), mMaxCosDirChange);
+    });
+    typename OdeSolverGsl<EikonalVariational<Eikonal, tParameterCount>>::Result result;
+    result.mValid         = solution.mValid;
+    result.mAtIndependent = solution.mAtIndependent;
+    result.mValue         = solution.mValue;
+    return result;
+  });
+}
+
+template <typename tOdeDefinition, typename tGetX, typename tConvert>
+void RungeKuttaRayBending::solveTargets(typename tOdeDefinition::Variables const &aStart, double const * const aXs, uint32_t const aCount, double const aOffset,
+                                        Result * const aResults, tGetX &&aGetX, tConvert &&aConvert) {
+  if(aCount > 0u) {                                       // Nothing to read or write otherwise.
+    uint32_t reached = 0u;
+    auto solution = solve<tOdeDefinition>(aStart, [aXs, aCount, aOffset, &reached, &aGetX](double const, typename tOdeDefinition::Variables const& aY){
+      return reached < aCount && aGetX(aY) >= aXs[reached] - aOffset;
+    }, [aCount, aResults, &reached, &aConvert](double const, typename tOdeDefinition::Variables const& aY){
+      aResults[reached] = aConvert(aY);
+      aResults[reached].mValid = true;
+      ++reached;
+      return reached == aCount;
+    });
+    if(reached < aCount) {
+      aResults[reached] = aConvert(solution.mValue);
+      aResults[reached].mValid = solution.mValid;
+      ++reached;
+    }
+    else if(!solution.mValid) {                           // Stopped at the last target on the last allowed step.
+      aResults[aCount - 1u].mValid = false;
+    }
+    else {} // nothing to do
+    for(; reached < aCount; ++reached) {
+      aResults[reached].mValid = false;
+    }
+  }
+  else {} // nothing to do
+}
+
+template <typename tOdeDefinition, typename tJudge, typename tOnEvent>
+typename OdeSolverGsl<tOdeDefinition>::Result RungeKuttaRayBending::solve(typename tOdeDefinition::Variables const &aStart, tJudge &&aJudge, tOnEvent &&aOnEvent) {
+  if(mParameters.mStepper == StepperType::cNativeFehlberg45) {
+    return solveNative<tOdeDefinition, ButcherTableauFehlberg45>(aStart, aJudge, aOnEvent);
+  }
+  else if(mParameters.mStepper == StepperType::cNativeCashKarp45) {
+    return solveNative<tOdeDefinition, ButcherTableauCashKarp45>(aStart, aJudge, aOnEvent);
+  }
+  else if(mParameters.mStepper == StepperType::cNativeDormandPrince45) {
+    return solveNative<tOdeDefinition, ButcherTableauDormandPrince45>(aStart, aJudge, aOnEvent);
+  }
+  else {
+    return getSolverGsl<tOdeDefinition>()->solve(aStart, aJudge,
+      [this](typename tOdeDefinition::Variables const& aYprev, typename tOdeDefinition::Variables const& aYnow) { return decide2resetBigStep(aYprev, aYnow, mMaxCosDirChange); },
+      aOnEvent);
+  }
+}
+
+template <typename tOdeDefinition, typename tButcherTableau, typename tJudge, typename tOnEvent>
+typename OdeSolverGsl<tOdeDefinition>::Result RungeKuttaRayBending::solveNative(typename tOdeDefinition::Variables const &aStart, tJudge &&aJudge, tOnEvent &&aOnEvent) {
+  return mDiffEq.dispatch([this, &aStart, &aJudge, &aOnEvent](auto const &aSpecialised) {
+    if constexpr(std::is_same_v<tOdeDefinition, Eikonal>) {
+      return solveSpecialised<tOdeDefinition, tButcherTableau>(aSpecialised, aStart, aJudge, aOnEvent);
+    }
+    else {
+      EikonalPlanar<std::decay_t<decltype(aSpecialised)>> planar(aSpecialised);
+      return solveSpecialised<tOdeDefinition, tButcherTableau>(planar, aStart, aJudge, aOnEvent);
+    }
+  });
+}
+
+template <typename tOdeDefinition, typename tButcherTableau, typename tSpecialised, typename tJudge, typename tOnEvent>
+typename OdeSolverGsl<tOdeDefinition>::Result RungeKuttaRayBending::solveSpecialised(tSpecialised const &aDiffEq, typename tOdeDefinition::Variables const &aStart, tJudge &&aJudge, tOnEvent &&aOnEvent) {
+  OdeSolverRungeKutta<tSpecialised, tButcherTableau> solver(0.0, mParameters.mDistAlongRay, mParameters.mTolAbs, mParameters.mTolRel,
+                                                            mParameters.mStep1, mParameters.mStepMin, mParameters.mStepMax, aDiffEq, mParameters.mController);
+  auto solution = solver.solve(aStart, aJudge,
+    [this](typename tOdeDefinition::Variables const& aYprev, typename tOdeDefinition::Variables const& aYnow) { return decide2resetBigStep(aYprev, aYnow, mMaxCosDirChange); },
+    aOnEvent);
+  typename OdeSolverGsl<tOdeDefinition>::Result result;
+  result.mValid         = solution.mValid;
+  result.mAtIndependent = solution.mAtIndependent;
+  result.mValue         = solution.mValue;
+  return result;
+}
+
 #endif
@@ -0,0 +1,104 @@
+#ifndef SOLVERPOOL_H
+#define SOLVERPOOL_H
+
+#include "RungeKuttaRayBending.h"
+#include "BatchRayBending.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+// Keeps the integrator state of finished work for reuse. A thread borrows a workspace for some
+// rays and the Lease gives it back on destruction, so repeated renders and sweeps in one process
+// construct each workspace (including the GSL stepper, controller and evolver) only once per
+// concurrently working thread. The workspaces refer to the Eikonal given here, so they follow
+// its changes like setWaterTempAmb.
+class SolverPool final {
+public:
+  struct Workspace final {
+    RungeKuttaRayBending                      mSolver;
+    BatchRayBending                           mBatchSolver;
+    std::vector<Ray>                          mBatchRays;      // Scratch buffers of Medium::traceBatch
+    std::vector<uint32_t>                     mBatchIndices;
+    std::vector<RungeKuttaRayBending::Result> mBatchResults;
+
+    Workspace(RungeKuttaRayBending::Parameters const &aParameters, Eikonal const &aDiffEq)
+      : mSolver(aParameters, aDiffEq)
+      , mBatchSolver(aParameters, aDiffEq) {}
+
+    Workspace(Workspace const&) = delete;
+    Workspace(Workspace &&) = delete;
+    Workspace& operator=(Workspace const&) = delete;
+    Workspace& operator=(Workspace &&) = delete;
+  };
+
+  class Lease final {
+  private:
+    SolverPool                 &mPool;
+    std::unique_ptr<Workspace>  mWorkspace;
+
+  public:
+    Lease(SolverPool &aPool, std::unique_ptr<Workspace> &&aWorkspace) : mPool(aPool), mWorkspace(std::move(aWorkspace)) {}
+    ~Lease() { mPool.giveBack(std::move(mWorkspace)); }
+
+    Lease(Lease const&) = delete;
+    Lease(Lease &&) = delete;
+    Lease& operator=(Lease const&) = delete;
+    Lease& operator=(Lease &&) = delete;
+
+    Workspace* operator->() const { return mWorkspace.get(); }
+    Workspace& operator*()  const { return *mWorkspace; }
+  };
+
+private:
+  RungeKuttaRayBending::Parameters const  mParameters;
+  Eikonal                          const &mDiffEq;
+  std::mutex                              mMutex;
+  std::vector<std::unique_ptr<Workspace>> mIdle;
+  uint32_t                                mAllocationCount = 0u;
+
+public:
+  SolverPool(RungeKuttaRayBending::Parameters const &aParameters, Eikonal const &aDiffEq)
+    : mParameters(aParameters)
+    , mDiffEq(aDiffEq) {}
+
+  SolverPool(SolverPool const&) = delete;
+  SolverPool(SolverPool &&) = delete;
+  SolverPool& operator=(SolverPool const&) = delete;
+  SolverPool& operator=(SolverPool &&) = delete;
+
+  RungeKuttaRayBending::Parameters const& getParameters() const { return mParameters; }
+
+  // Count of workspaces constructed so far.
+  uint32_t getAllocationCount() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mAllocationCount;
+  }
+
+  Lease borrow() {
+    std::unique_ptr<Workspace> workspace;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if(!mIdle.empty()) {
+        workspace = std::move(mIdle.back());
+        mIdle.pop_back();
+      }
+      else {
+        ++mAllocationCount;
+      }
+    }
+    if(!workspace) {                                  // Constructed outside the lock, GSL allocation may take a while.
+      workspace = std::make_unique<Workspace>(mParameters, mDiffEq);
+    }
+    else {} // nothing to do
+    return Lease(*this, std::move(workspace));
+  }
+
+private:
+  void giveBack(std::unique_ptr<Workspace> &&aWorkspace) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mIdle.push_back(std::move(aWorkspace));
+  }
+};
+
+#endif // SOLVERPOOL_H
@@ -0,0 +1,154 @@
+#include "Texture.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+Texture::Texture(png::image<png::gray_pixel> const &aImage)
+  : mWidth(aImage.get_width())
+  , mHeight(aImage.get_height())
+  , mStride((aImage.get_width() + csAlignment - 1u) / csAlignment * csAlignment) {
+  mHeap = static_cast<uint8_t*>(std::aligned_alloc(csAlignment, std::max<size_t>(static_cast<size_t>(mStride) * mHeight, csAlignment)));
+  if(mHeap == nullptr) {
+    throw std::bad_alloc();
+  }
+  else {} // nothing to do
+  for(uint32_t y = 0u; y < mHeight; ++y) {
+    auto row = mHeap + static_cast<size_t>(y) * mStride;
+    for(uint32_t x = 0u; x < mWidth; ++x) {
+      row[x] = aImage.get_pixel(x, y);
+    }
+    std::fill(row + mWidth, row + mStride, 0u);
+  }
+  mPixels = mHeap;
+}
+
+Texture::~Texture() {
+  std::free(mHeap);
+  if(mMapped != nullptr) {
+    ::munmap(mMapped, mMappedSize);
+  }
+  else {} // nothing to do
+}
+
+std::shared_ptr<Texture const> Texture::load(std::string const &aName, bool const aUseCache) {
+  std::shared_ptr<Texture const> result;
+  uint64_t sourceSize = 0u;
+  int64_t sourceTime = 0;
+  auto cacheName = aName + ".texture";
+  bool cached = aUseCache && getSourceStamp(aName, sourceSize, sourceTime);
+  if(cached) {
+    result = map(cacheName, sourceSize, sourceTime);
+  }
+  else {} // nothing to do
+  if(!result) {
+    auto decoded = std::make_shared<Texture const>(png::image<png::gray_pixel>(aName));
+    if(cached) {
+      decoded->write(cacheName, sourceSize, sourceTime);
+    }
+    else {} // nothing to do
+    result = decoded;
+  }
+  else {} // nothing to do
+  return result;
+}
+
+bool Texture::getSourceStamp(std::string const &aName, uint64_t &aSize, int64_t &aTime) {
+  struct stat status;
+  bool result = (::stat(aName.c_str(), &status) == 0);
+  if(result) {
+    aSize = static_cast<uint64_t>(status.st_size);
+    aTime = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+  }
+  else {} // nothing to do
+  return result;
+}
+
+// Returns nullptr if the cache is missing or does not belong to the source.
+std::shared_ptr<Texture const> Texture::map(std::string const &aCacheName, uint64_t const aSourceSize, int64_t const aSourceTime) {
+  std::shared_ptr<Texture> result;
+  int file = ::open(aCacheName.c_str(), O_RDONLY);
+  struct stat status;
+  if(file >= 0 && ::fstat(file, &status) == 0 && static_cast<size_t>(status.st_size) >= csAlignment) {
+    auto size = static_cast<size_t>(status.st_size);
+    void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if(mapped != MAP_FAILED) {
+      CacheHeader header;
+      std::memcpy(&header, mapped, sizeof(header));
+      if(std::memcmp(header.mMagic, csMagic, sizeof(csMagic)) == 0 && header.mSourceSize == aSourceSize && header.mSourceTime == aSourceTime &&
+         header.mStride >= header.mWidth && csAlignment + static_cast<size_t>(header.mStride) * header.mHeight <= size) {
+        result.reset(new Texture());
+        result->mWidth      = header.mWidth;
+        result->mHeight     = header.mHeight;
+        result->mStride     = header.mStride;
+        result->mMapped     = mapped;
+        result->mMappedSize = size;
+        result->mPixels     = static_cast<uint8_t const*>(mapped) + csAlignment;
+      }
+      else {
+        ::munmap(mapped, size);
+      }
+    }
+    else {} // nothing to do
+  }
+  else {} // nothing to do
+  if(file >= 0) {
+    ::close(file);
+  }
+  else {} // nothing to do
+  return result;
+}
+
+// Written to a temporary file and renamed, so concurrent runs never map a partial cache.
+void Texture::write(std::string const &aCacheName, uint64_t const aSourceSize, int64_t const aSourceTime) const {
+  static_assert(sizeof(CacheHeader) <= csAlignment);
+  char block[csAlignment] = {};
+  CacheHeader header;
+  std::memcpy(header.mMagic, csMagic, sizeof(csMagic));
+  header.mWidth      = mWidth;
+  header.mHeight     = mHeight;
+  header.mStride     = mStride;
+  header.mReserved   = 0u;
+  header.mSourceSize = aSourceSize;
+  header.mSourceTime = aSourceTime;
+  std::memcpy(block, &header, sizeof(header));
+  auto temporaryName = aCacheName + '.' + std::to_string(::getpid());
+  std::FILE *file = std::fopen(temporaryName.c_str(), "wb");
+  if(file != nullptr) {
+    auto size = static_cast<size_t>(mStride) * mHeight;
+    bool ok = std::fwrite(block, 1u, csAlignment, file) == csAlignment && std::fwrite(mPixels, 1u, size, file) == size;
+    ok = (std::fclose(file) == 0) && ok;
+    if(!ok || std::rename(temporaryName.c_str(), aCacheName.c_str()) != 0) {
+      std::remove(temporaryName.c_str());
+    }
+    else {} // nothing to do
+  }
+  else {} // nothing to do
+}
+
+void Texture::buildMipLevels() const {
+  std::call_once(mMipBuilt, [this]() {
+    int32_t width = mWidth;
+    int32_t height = mHeight;
+    for(uint32_t level = 1u; width > 1 || height > 1; ++level) {
+      MipLevel coarser{(width + 1) / 2, (height + 1) / 2, {}};
+      coarser.mTexels.reserve(coarser.mWidth * coarser.mHeight);
+      for(int32_t y = 0; y < coarser.mHeight; ++y) {
+        for(int32_t x = 0; x < coarser.mWidth; ++x) {
+          auto x1 = std::min(2 * x + 1, width - 1);           // The last odd column and row are repeated.
+          auto y1 = std::min(2 * y + 1, height - 1);
+          coarser.mTexels.push_back((getTexel(level - 1u, 2 * x, 2 * y) + getTexel(level - 1u, x1, 2 * y) +
+                                     getTexel(level - 1u, 2 * x, y1)    + getTexel(level - 1u, x1, y1)) / 4.0);
+        }
+      }
+      width = coarser.mWidth;
+      height = coarser.mHeight;
+      mMipLevels.push_back(std::move(coarser));
+    }
+  });
+}
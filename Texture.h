@@ -0,0 +1,100 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "png.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// 8 bit gray picture in one block of memory with rows starting on cache line boundaries.
+// Either decoded from a PNG into an aligned heap block, or mapped read only from a raw cache
+// file written by an earlier run, so repeated runs on the same picture skip PNG decoding.
+// The mip pyramid for filtered lookups is built only on request, once for all users of the
+// texture. Its level 0 is the picture itself.
+class Texture final {
+public:
+  static constexpr uint32_t csAlignment = 64u;    // bytes, row starts and the first pixel
+
+private:
+  // Layout of the cache file, the pixels follow at csAlignment.
+  struct CacheHeader {
+    char     mMagic[8];
+    uint32_t mWidth;
+    uint32_t mHeight;
+    uint32_t mStride;
+    uint32_t mReserved;
+    uint64_t mSourceSize;                         // of the PNG, to detect changes
+    int64_t  mSourceTime;                         // modification of the PNG in nanoseconds
+  };
+  static constexpr char csMagic[8] = {'R', 'K', 'R', 'B', 'T', 'X', '0', '1'};
+
+  // Level k of the mip pyramid has texels of 2^k x 2^k pixels, each the mean of 4 texels of level k - 1.
+  struct MipLevel {
+    int32_t            mWidth;
+    int32_t            mHeight;
+    std::vector<float> mTexels;
+  };
+
+  uint32_t  mWidth      = 0u;
+  uint32_t  mHeight     = 0u;
+  uint32_t  mStride     = 0u;
+  uint8_t  *mHeap       = nullptr;                // aligned, if decoded
+  void     *mMapped     = nullptr;                // whole cache file, if mapped
+  size_t    mMappedSize = 0u;
+  uint8_t const *mPixels = nullptr;
+  mutable std::once_flag         mMipBuilt;
+  mutable std::vector<MipLevel>  mMipLevels;      // levels 1 and up
+
+public:
+  explicit Texture(png::image<png::gray_pixel> const &aImage);
+  ~Texture();
+
+  Texture(Texture const&) = delete;
+  Texture(Texture &&) = delete;
+  Texture& operator=(Texture const&) = delete;
+  Texture& operator=(Texture &&) = delete;
+
+  // Decodes aName, or with aUseCache maps aName.texture if it belongs to the current aName, and
+  // writes it otherwise. Failing to write the cache is not an error, the PNG is decoded then.
+  static std::shared_ptr<Texture const> load(std::string const &aName, bool const aUseCache);
+
+  uint32_t getWidth()  const { return mWidth; }
+  uint32_t getHeight() const { return mHeight; }
+  uint8_t  getPixel(uint32_t const aX, uint32_t const aY) const { return mPixels[aY * mStride + aX]; }
+  uint8_t const* getRow(uint32_t const aY) const { return mPixels + aY * mStride; }
+
+  // Thread safe, builds only on the first call.
+  void     buildMipLevels() const;
+  // Including level 0, valid after buildMipLevels.
+  uint32_t getMipLevelCount() const { return mMipLevels.size() + 1u; }
+  // 0 outside the level.
+  double getTexel(uint32_t const aLevel, int32_t const aX, int32_t const aY) const {
+    double result = 0.0;
+    if(aLevel == 0u) {
+      if(aX >= 0 && aY >= 0 && aX < static_cast<int32_t>(mWidth) && aY < static_cast<int32_t>(mHeight)) {
+        result = getPixel(aX, aY);
+      }
+      else {} // nothing to do
+    }
+    else {
+      auto const &level = mMipLevels[aLevel - 1u];
+      if(aX >= 0 && aY >= 0 && aX < level.mWidth && aY < level.mHeight) {
+        result = level.mTexels[aY * level.mWidth + aX];
+      }
+      else {} // nothing to do
+    }
+    return result;
+  }
+
+private:
+  Texture() = default;
+
+  static bool getSourceStamp(std::string const &aName, uint64_t &aSize, int64_t &aTime);
+  static std::shared_ptr<Texture const> map(std::string const &aCacheName, uint64_t const aSourceSize, int64_t const aSourceTime);
+  void write(std::string const &aCacheName, uint64_t const aSourceSize, int64_t const aSourceTime) const;
+};
+
+#endif // TEXTURE_H
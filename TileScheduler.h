@@ -0,0 +1,286 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Threads kept for the lifetime of the pool, so a run only wakes them up instead of creating and
+// joining them. The calling thread takes part as thread 0. Runs must not be nested or concurrent.
+class WorkerPool final {
+private:
+  uint32_t const                       mThreadCount;
+  std::vector<std::thread>             mThreads;      // threads 1 to mThreadCount - 1
+  std::mutex                           mMutex;
+  std::condition_variable              mStart;
+  std::condition_variable              mDone;
+  std::function<void(uint32_t)> const *mJob = nullptr;
+  std::exception_ptr                   mError;        // first one thrown by threads 1 to mThreadCount - 1 in the run
+  uint64_t                             mGeneration = 0u;
+  uint32_t                             mBusy = 0u;
+  bool                                 mStop = false;
+
+public:
+  explicit WorkerPool(uint32_t const aThreadCount)
+    : mThreadCount(std::max(aThreadCount, 1u)) {
+    for(uint32_t i = 1u; i < mThreadCount; ++i) {
+      mThreads.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mStop = true;
+    }
+    mStart.notify_all();
+    for(auto &thread : mThreads) {
+      thread.join();
+    }
+  }
+
+  WorkerPool(WorkerPool const&) = delete;
+  WorkerPool(WorkerPool &&) = delete;
+  WorkerPool& operator=(WorkerPool const&) = delete;
+  WorkerPool& operator=(WorkerPool &&) = delete;
+
+  uint32_t getThreadCount() const { return mThreadCount; }
+
+  // Calls aJob(uint32_t aThread) on each thread and returns when all of them have returned. If
+  // any of them threw, rethrows the exception of thread 0 if it threw, else the first one.
+  void run(std::function<void(uint32_t)> const &aJob) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mJob = &aJob;
+      mBusy = mThreadCount - 1u;
+      ++mGeneration;
+    }
+    mStart.notify_all();
+    std::exception_ptr error;
+    try {
+      aJob(0u);
+    }
+    catch(...) {
+      error = std::current_exception();                 // The others still use aJob.
+    }
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mDone.wait(lock, [this] { return mBusy == 0u; });
+      mJob = nullptr;
+      if(!error) {
+        error = mError;
+      }
+      else {} // nothing to do
+      mError = nullptr;
+    }
+    if(error) {
+      std::rethrow_exception(error);
+    }
+    else {} // nothing to do
+  }
+
+private:
+  void work(uint32_t const aThread) {
+    uint64_t generation = 0u;
+    std::unique_lock<std::mutex> lock(mMutex);
+    while(true) {
+      mStart.wait(lock, [this, generation] { return mStop || mGeneration != generation; });
+      if(mStop) {
+        break;
+      }
+      else {} // nothing to do
+      generation = mGeneration;
+      auto const *job = mJob;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        (*job)(aThread);
+      }
+      catch(...) {
+        error = std::current_exception();               // Rethrown by run.
+      }
+      lock.lock();
+      if(error && !mError) {
+        mError = error;
+      }
+      else {} // nothing to do
+      --mBusy;
+      if(mBusy == 0u) {
+        mDone.notify_one();
+      }
+      else {} // nothing to do
+    }
+  }
+};
+
+
+// Runs aWork for each of aTileCount tiles on the threads of a WorkerPool. Each thread starts with a
+// contiguous range of tiles, so neighbouring tiles (in the order the caller numbers them, like
+// scanline order) are traced by the same thread for ray coherence. A thread takes its tiles from
+// the front of its range, and when it runs out, it steals the back half of the largest range left.
+// The ranges are packed in one atomic word each, so both are a single compare and swap.
+class TileScheduler final {
+public:
+  struct ThreadStats {
+    uint32_t mTiles;      // processed
+    uint32_t mSteals;     // successful
+    double   mFinished;   // seconds since the start of run
+  };
+
+private:
+  struct alignas(64) Range {
+    std::atomic<uint64_t> mBeginEnd;  // begin in the high, end in the low 32 bits
+  };
+
+  WorkerPool                    &mWorkers;
+  uint32_t const                 mThreadCount;
+  uint32_t const                 mTileCount;
+  std::unique_ptr<Range[]>       mRanges;
+  std::vector<ThreadStats>       mStats;
+  double                         mWall = 0.0;
+
+public:
+  TileScheduler(WorkerPool &aWorkers, uint32_t const aTileCount)
+    : mWorkers(aWorkers)
+    , mThreadCount(aWorkers.getThreadCount())
+    , mTileCount(aTileCount)
+    , mRanges(new Range[mThreadCount])
+    , mStats(mThreadCount) {}
+
+  TileScheduler(TileScheduler const&) = delete;
+  TileScheduler(TileScheduler &&) = delete;
+  TileScheduler& operator=(TileScheduler const&) = delete;
+  TileScheduler& operator=(TileScheduler &&) = delete;
+
+  // aWork(uint32_t aThread, uint32_t aTile) is called concurrently for different threads.
+  template <typename tWork>
+  void run(tWork &&aWork);
+
+  // Like run, but the threads take the next tile from one shared counter instead of ranges, so
+  // the tiles finish about in their order. For callers consuming the results in order, which
+  // keep then only the few tiles in flight.
+  template <typename tWork>
+  void runInOrder(tWork &&aWork);
+
+  std::vector<ThreadStats> const& getStats() const { return mStats; }
+  double getWall() const { return mWall; }
+
+  // Difference of the first and last finishing thread relative to the wall clock time of run.
+  double getImbalance() const {
+    double first = mWall;
+    double last = 0.0;
+    for(auto const &stats : mStats) {
+      first = std::min(first, stats.mFinished);
+      last = std::max(last, stats.mFinished);
+    }
+    return mWall > 0.0 ? (last - first) / mWall : 0.0;
+  }
+
+private:
+  static uint64_t pack(uint32_t const aBegin, uint32_t const aEnd) { return (static_cast<uint64_t>(aBegin) << 32u) | aEnd; }
+  static uint32_t getBegin(uint64_t const aPacked) { return static_cast<uint32_t>(aPacked >> 32u); }
+  static uint32_t getEnd(uint64_t const aPacked) { return static_cast<uint32_t>(aPacked); }
+
+  bool pop(uint32_t const aThread, uint32_t &aTile) {
+    auto &range = mRanges[aThread].mBeginEnd;
+    auto packed = range.load();
+    bool result = false;
+    while(getBegin(packed) < getEnd(packed)) {
+      if(range.compare_exchange_weak(packed, pack(getBegin(packed) + 1u, getEnd(packed)))) {
+        aTile = getBegin(packed);
+        result = true;
+        break;
+      }
+      else {} // nothing to do, packed was reloaded
+    }
+    return result;
+  }
+
+  // Moves the back half of the largest other range to aThread. Returns false if all are empty.
+  bool steal(uint32_t const aThread) {
+    bool result = false;
+    bool anyLeft = true;
+    while(!result && anyLeft) {
+      uint32_t victim = aThread;
+      uint32_t largest = 0u;
+      uint64_t victimPacked = 0u;
+      for(uint32_t i = 0u; i < mThreadCount; ++i) {
+        auto packed = mRanges[i].mBeginEnd.load();
+        auto size = getEnd(packed) - getBegin(packed);
+        if(i != aThread && getBegin(packed) < getEnd(packed) && size > largest) {
+          victim = i;
+          largest = size;
+          victimPacked = packed;
+        }
+        else {} // nothing to do
+      }
+      anyLeft = (victim != aThread);
+      if(anyLeft) {
+        auto begin = getBegin(victimPacked);
+        auto end = getEnd(victimPacked);
+        auto middle = end - (end - begin + 1u) / 2u;
+        if(mRanges[victim].mBeginEnd.compare_exchange_strong(victimPacked, pack(begin, middle))) {
+          mRanges[aThread].mBeginEnd.store(pack(middle, end));
+          result = true;
+        }
+        else {} // nothing to do, the victim or an other thief was faster
+      }
+      else {} // nothing to do
+    }
+    return result;
+  }
+};
+
+template <typename tWork>
+void TileScheduler::run(tWork &&aWork) {
+  for(uint32_t i = 0u; i < mThreadCount; ++i) {
+    mRanges[i].mBeginEnd.store(pack(static_cast<uint64_t>(mTileCount) * i / mThreadCount, static_cast<uint64_t>(mTileCount) * (i + 1u) / mThreadCount));
+  }
+  auto start = std::chrono::steady_clock::now();
+  mWorkers.run([this, start, &aWork](uint32_t const i) {
+    ThreadStats stats{0u, 0u, 0.0};                     // Local to avoid false sharing.
+    uint32_t tile;
+    while(true) {
+      if(pop(i, tile)) {
+        aWork(i, tile);
+        ++stats.mTiles;
+      }
+      else if(steal(i)) {
+        ++stats.mSteals;
+      }
+      else {
+        break;
+      }
+    }
+    stats.mFinished = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    mStats[i] = stats;
+  });
+  mWall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename tWork>
+void TileScheduler::runInOrder(tWork &&aWork) {
+  std::atomic<uint32_t> next(0u);
+  auto start = std::chrono::steady_clock::now();
+  mWorkers.run([this, start, &next, &aWork](uint32_t const i) {
+    ThreadStats stats{0u, 0u, 0.0};
+    for(auto tile = next++; tile < mTileCount; tile = next++) {
+      aWork(i, tile);
+      ++stats.mTiles;
+    }
+    stats.mFinished = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    mStats[i] = stats;
+  });
+  mWall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+#endif // TILESCHEDULER_H
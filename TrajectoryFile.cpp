@@ -0,0 +1,74 @@
+#include "TrajectoryFile.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "TrajectoryFile stores and maps the doubles in host order.");
+
+TrajectoryFile::~TrajectoryFile() {
+  if(mMapped != nullptr) {
+    ::munmap(mMapped, mMappedSize);
+  }
+  else {} // nothing to do
+}
+
+bool TrajectoryFile::write(std::string const &aName, uint32_t const aColumnCount, uint64_t const aRowCount, double const * const * const aColumns) {
+  static_assert(sizeof(Header) <= csAlignment);
+  auto columnSize = static_cast<size_t>(aRowCount) * sizeof(double);
+  std::vector<char> buffer(csAlignment + aColumnCount * columnSize, 0);
+  Header header;
+  std::memcpy(header.mMagic, csMagic, sizeof(csMagic));
+  header.mColumnCount = aColumnCount;
+  header.mReserved    = 0u;
+  header.mRowCount    = aRowCount;
+  std::memcpy(buffer.data(), &header, sizeof(header));
+  for(uint32_t i = 0u; i < aColumnCount; ++i) {
+    std::memcpy(buffer.data() + csAlignment + i * columnSize, aColumns[i], columnSize);
+  }
+  std::FILE *file = std::fopen(aName.c_str(), "wb");
+  bool result = (file != nullptr);
+  if(result) {
+    result = std::fwrite(buffer.data(), 1u, buffer.size(), file) == buffer.size();
+    result = (std::fclose(file) == 0) && result;
+  }
+  else {} // nothing to do
+  return result;
+}
+
+std::unique_ptr<TrajectoryFile const> TrajectoryFile::map(std::string const &aName) {
+  std::unique_ptr<TrajectoryFile> result;
+  int file = ::open(aName.c_str(), O_RDONLY);
+  struct stat status;
+  if(file >= 0 && ::fstat(file, &status) == 0 && static_cast<size_t>(status.st_size) >= csAlignment) {
+    auto size = static_cast<size_t>(status.st_size);
+    void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    if(mapped != MAP_FAILED) {
+      Header header;
+      std::memcpy(&header, mapped, sizeof(header));
+      if(std::memcmp(header.mMagic, csMagic, sizeof(csMagic)) == 0 &&
+         csAlignment + static_cast<size_t>(header.mColumnCount) * header.mRowCount * sizeof(double) <= size) {
+        result.reset(new TrajectoryFile());
+        result->mColumnCount = header.mColumnCount;
+        result->mRowCount    = header.mRowCount;
+        result->mMapped      = mapped;
+        result->mMappedSize  = size;
+        result->mColumns     = reinterpret_cast<double const*>(static_cast<char const*>(mapped) + csAlignment);
+      }
+      else {
+        ::munmap(mapped, size);
+      }
+    }
+    else {} // nothing to do
+  }
+  else {} // nothing to do
+  if(file >= 0) {
+    ::close(file);
+  }
+  else {} // nothing to do
+  return result;
+}
@@ -0,0 +1,54 @@
+#ifndef TRAJECTORYFILE_H
+#define TRAJECTORYFILE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+
+// Samples of a ray in a columnar little endian binary file: a header padded to csAlignment
+// bytes, then each column as mRowCount doubles. Written with one buffered write, and read by
+// mapping the file, so the columns are used in place without parsing.
+class TrajectoryFile final {
+public:
+  static constexpr uint32_t csAlignment = 64u;    // bytes, of the header
+
+private:
+  struct Header {
+    char     mMagic[8];
+    uint32_t mColumnCount;
+    uint32_t mReserved;
+    uint64_t mRowCount;
+  };
+  static constexpr char csMagic[8] = {'R', 'K', 'R', 'B', 'T', 'R', '0', '1'};
+
+  uint32_t      mColumnCount = 0u;
+  uint64_t      mRowCount    = 0u;
+  void         *mMapped      = nullptr;           // whole file
+  size_t        mMappedSize  = 0u;
+  double const *mColumns     = nullptr;
+
+public:
+  ~TrajectoryFile();
+
+  TrajectoryFile(TrajectoryFile const&) = delete;
+  TrajectoryFile(TrajectoryFile &&) = delete;
+  TrajectoryFile& operator=(TrajectoryFile const&) = delete;
+  TrajectoryFile& operator=(TrajectoryFile &&) = delete;
+
+  // aColumns points to aColumnCount columns of aRowCount values each. Returns false if the file
+  // could not be written.
+  static bool write(std::string const &aName, uint32_t const aColumnCount, uint64_t const aRowCount, double const * const * const aColumns);
+
+  // Returns nullptr if the file is missing or malformed.
+  static std::unique_ptr<TrajectoryFile const> map(std::string const &aName);
+
+  uint32_t getColumnCount() const { return mColumnCount; }
+  uint64_t getRowCount()    const { return mRowCount; }
+  double const* getColumn(uint32_t const aColumn) const { return mColumns + aColumn * mRowCount; }
+
+private:
+  TrajectoryFile() = default;
+};
+
+#endif // TRAJECTORYFILE_H
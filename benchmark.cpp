@@ -0,0 +1,164 @@
+#include "simpleRaytracer.h"
+#include "CLI11.hpp"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+// Measures ray tracing throughput on the default scene of main (water base, round Earth,
+// camera at 1.1 m, bulletin of 9 m height at 1000 m) for each stepper, single threaded.
+
+struct StepperCase {
+  char const     *mName;
+  StepperType     mStepper;
+  ErrorController mController;
+  bool            mPlanar;
+};
+
+StepperCase const cgCases[] = {
+  { "RungeKuttaFehlberg45",                  StepperType::cRungeKuttaFehlberg45,  ErrorController::cStandard,            false },
+  { "RungeKuttaCashKarp45",                  StepperType::cRungeKuttaCashKarp45,  ErrorController::cStandard,            false },
+  { "NativeFehlberg45",                      StepperType::cNativeFehlberg45,      ErrorController::cStandard,            false },
+  { "NativeCashKarp45",                      StepperType::cNativeCashKarp45,      ErrorController::cStandard,            false },
+  { "NativeDormandPrince45",                 StepperType::cNativeDormandPrince45, ErrorController::cStandard,            false },
+  { "NativeFehlberg45 PI controller",        StepperType::cNativeFehlberg45,      ErrorController::cProportionalIntegral, false },
+  { "NativeDormandPrince45 PI controller",   StepperType::cNativeDormandPrince45, ErrorController::cProportionalIntegral, false },
+  { "RungeKuttaFehlberg45 planar",           StepperType::cRungeKuttaFehlberg45,  ErrorController::cStandard,            true  },
+  { "NativeFehlberg45 planar",               StepperType::cNativeFehlberg45,      ErrorController::cStandard,            true  }
+};
+
+// Times Eikonal::differentials on random states below 3 m for each model, with exact
+// refraction and with the tabulated profile, and prints the largest deviation relative to
+// the largest magnitude of each derivative.
+void benchmarkDifferentials(double const aProfileTolerance, uint32_t const aCalls) {
+  std::mt19937 generator(1u);
+  std::uniform_real_distribution<double> heights(0.0, 3.0);
+  std::vector<Eikonal::Variables> states(1024u);
+  for(auto &state : states) {
+    state = Eikonal::Variables{ heights(generator) * 100.0, heights(generator), 0.0, 0.0033, 0.0, 0.0 };
+  }
+  std::array<char const *, 3u> const names = { "conventional", "porous", "water" };
+  double checksum = 0.0;                                      // Printed, so the calls are not optimised away.
+  for(uint32_t m = 0u; m < names.size(); ++m) {
+    auto model = static_cast<Eikonal::Model>(m);
+    Eikonal exact(Eikonal::EarthForm::cFlat, 6371000.0, model, (model == Eikonal::Model::cPorous ? 38.5 : 10.0), 5.0, 40.0, 13.0);
+    Eikonal profile(exact);
+    profile.useProfile(aProfileTolerance);
+    double deviation = 0.0;
+    std::array<double, 2u> nsPerCall;
+    for(uint32_t which = 0u; which < 2u; ++which) {
+      auto const &eikonal = (which == 0u ? exact : profile);
+      Eikonal::Variables dydt;
+      double sum = 0.0;
+      auto begin = std::chrono::steady_clock::now();
+      for(uint32_t i = 0u; i < aCalls; ++i) {
+        eikonal.differentials(0.0, states[i % states.size()].data(), dydt.data());
+        sum += dydt[4u];
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+      nsPerCall[which] = elapsed.count() * 1e9 / aCalls;
+      checksum += sum;
+    }
+    Eikonal::Variables scale{};
+    for(auto const &state : states) {
+      Eikonal::Variables dydt;
+      exact.differentials(0.0, state.data(), dydt.data());
+      for(uint32_t i = 0u; i < Eikonal::csNvar; ++i) {
+        scale[i] = std::max(scale[i], std::abs(dydt[i]));
+      }
+    }
+    for(auto const &state : states) {
+      Eikonal::Variables dydtExact;
+      Eikonal::Variables dydtProfile;
+      exact.differentials(0.0, state.data(), dydtExact.data());
+      profile.differentials(0.0, state.data(), dydtProfile.data());
+      for(uint32_t i = 0u; i < Eikonal::csNvar; ++i) {
+        deviation = std::max(deviation, std::abs(dydtExact[i] - dydtProfile[i]) / std::max(scale[i], 1e-30));
+      }
+    }
+    std::cout << "differentials " << std::setw(26) << std::left << names[m] << std::right << std::fixed << std::setprecision(1)
+              << std::setw(8) << nsPerCall[0u] << " ns exact " << std::setw(8) << nsPerCall[1u] << " ns profile ("
+              << profile.getProfile()->getNodeCount() << " nodes)   max relative deviation " << std::scientific << std::setprecision(2) << deviation << '\n';
+  }
+  std::cout << "differentials checksum " << std::scientific << std::setprecision(6) << checksum << '\n';
+}
+
+int main(int aArgc, char **aArgv) {
+  CLI::App opt{"Usage"};
+  double elevationLow = -0.003;
+  opt.add_option("--elevationLow", elevationLow, "lowest ray elevation (radian) [-0.003]");
+  double elevationHigh = 0.008;
+  opt.add_option("--elevationHigh", elevationHigh, "highest ray elevation (radian) [0.008]");
+  double azimuth = 0.006;
+  opt.add_option("--azimuth", azimuth, "half of azimuth range (radian) [0.006]");
+  uint32_t differentialCalls = 10000000u;
+  opt.add_option("--differentialCalls", differentialCalls, "count of Eikonal::differentials calls to time, 0 to skip [10000000]");
+  std::string nameIn = "monoscopeRca.png";
+  opt.add_option("--nameIn", nameIn, "input filename [monoscopeRca.png]");
+  double profileTolerance = 1e-12;
+  opt.add_option("--profileTolerance", profileTolerance, "error limit of the tabulated refraction profile [1e-12]");
+  uint32_t raysSqrt = 100u;
+  opt.add_option("--raysSqrt", raysSqrt, "square root of ray count traced by each stepper [100]");
+  CLI11_PARSE(opt, aArgc, aArgv);
+
+  if(differentialCalls > 0u) {
+    benchmarkDifferentials(profileTolerance, differentialCalls);
+  }
+  else {} // nothing to do
+
+  double const dist       = 1000.0;
+  double const earthRadius = 6371000.0;
+  double const tempBase   = 13.0;
+  double const tempAmb    = 10.0;
+  RungeKuttaRayBending::Parameters paraRk;
+  paraRk.mDistAlongRay    = dist * 2.0;
+  paraRk.mTolAbs          = 0.001;
+  paraRk.mTolRel          = 0.001;
+  paraRk.mStep1           = 0.01;
+  paraRk.mStepMin         = 1e-4;
+  paraRk.mStepMax         = 55.5;
+  paraRk.mMaxCosDirChange = 0.99999999999;
+
+  Object object(nameIn.c_str(), dist, 0.0, 9.0, earthRadius);
+  std::vector<Ray> rays;
+  Ray ray;
+  ray.mStart = Vertex(1.0, 1.1, 0.0);
+  for(uint32_t i = 0u; i < raysSqrt; ++i) {
+    for(uint32_t j = 0u; j < raysSqrt; ++j) {
+      auto elevation = elevationLow + (elevationHigh - elevationLow) * i / (raysSqrt - 1.0);
+      auto azim = -azimuth + 2.0 * azimuth * j / (raysSqrt - 1.0);
+      ray.mDirection = Vector(std::cos(elevation) * std::cos(azim), std::sin(elevation), std::cos(elevation) * std::sin(azim));
+      rays.push_back(ray);
+    }
+  }
+  std::vector<uint8_t> colors(rays.size());
+  for(auto const &item : cgCases) {
+    paraRk.mStepper    = item.mStepper;
+    paraRk.mController = item.mController;
+    paraRk.mPlanar     = item.mPlanar;
+    Medium medium(paraRk, Eikonal::EarthForm::cRound, earthRadius, Eikonal::Model::cWater, tempAmb, tempBase - 5.0, tempBase + 1.0, tempBase, object);
+    uint64_t checksum = 0u;
+    auto begin = std::chrono::steady_clock::now();
+    for(auto const &r : rays) {
+      checksum += medium.trace(r);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    std::cout << std::setw(40) << std::left << item.mName << std::setw(14) << std::right << std::fixed << std::setprecision(1)
+              << rays.size() / elapsed.count() << " rays/s   checksum " << checksum << '\n';
+    if(RungeKuttaRayBending::isNative(item.mStepper) && !item.mPlanar) {
+      checksum = 0u;
+      begin = std::chrono::steady_clock::now();
+      medium.traceBatch(rays.data(), rays.size(), colors.data());
+      elapsed = std::chrono::steady_clock::now() - begin;
+      for(auto const c : colors) {
+        checksum += c;
+      }
+      std::cout << std::setw(40) << std::left << "  batch" << std::setw(14) << std::right << std::fixed << std::setprecision(1)
+                << rays.size() / elapsed.count() << " rays/s   checksum " << checksum << "   lanes " << BatchRayBending::csLanes << '\n';
+    }
+    else {} // nothing to do
+  }
+  return 0;
+}
@@ -2,14 +2,26 @@
 #include "3dGeomUtil.h"
 #include "OdeSolverGsl.h"
 #include "RungeKuttaRayBending.h"
+#include "SolverPool.h"
+#include "TileScheduler.h"
+#include "TrajectoryFile.h"
 #include "mathUtil.h"
 #include "CLI11.hpp"
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 
 struct MoreParameters {
+  bool               mBatch;
+  bool               mBinary;
   Eikonal::EarthForm mEarthForm;
   double             mEarthRadius;
   Eikonal::Model     mMode;
@@ -19,13 +31,23 @@ struct MoreParameters {
   double             mCamCenter;
   double             mDist;
   uint32_t           mSamples;
+  uint32_t           mRestrictCpu;
   bool               mSilent;
+  uint32_t           mSweepCount;
+  std::string        mSweepParameter;
+  double             mSweepStart;
+  double             mSweepStep;
 };
 
-RungeKuttaRayBending::Result comp1(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters const& aMore) {
+// Options which can be swept. The rest would need other solver parameters or Eikonal construction.
+std::map<std::string, double MoreParameters::*> const cgSweepable = {
+  {"camCenter", &MoreParameters::mCamCenter}, {"dist", &MoreParameters::mDist}, {"tempAmb", &MoreParameters::mTempAmb}, {"tempBase", &MoreParameters::mTempBase}};
 
-  Eikonal eikonal(aMore.mEarthForm, aMore.mEarthRadius, aMore.mMode, aMore.mTempAmb, aMore.mTempAmb, aMore.mTempAmb, aMore.mTempBase);
-  RungeKuttaRayBending rk(aParameters, eikonal);
+double   constexpr cgPreciseTolerance  = 1e-6;   // For locating the critical and mirror directions.
+uint32_t constexpr cgRootMaxIterations = 100u;
+
+// The solvers come from aPool, so the many calls of the searches construct them only once.
+RungeKuttaRayBending::Result comp1(SolverPool &aPool, MoreParameters const& aMore) {
   Vertex start(0.0, aMore.mCamCenter, 0.0);
   Vector dir(std::cos(aMore.mDir / 180.0 * cgPi), std::sin(aMore.mDir / 180.0 * cgPi), 0.0);
   RungeKuttaRayBending::Result solution;
@@ -36,21 +58,48 @@ RungeKuttaRayBending::Result comp1(RungeKuttaRayBending::Parameters const& aPara
     solution.mValue[2] = 0.0;
   }
   else {
-    solution = rk.solve4x(start, dir, aMore.mDist);
+    solution = aPool.borrow()->mSolver.solve4x(start, dir, aMore.mDist);
   }
   return solution;
 }
 
-void comp(std::string const& aPrefix, RungeKuttaRayBending::Parameters const& aParameters, MoreParameters const& aMore, bool aNeedXd) {
+// All the samples come from one integration along the ray. The valid ones go into a text file
+// or a TrajectoryFile.
+void comp(std::string const& aPrefix, SolverPool &aPool, MoreParameters const& aMore, bool aNeedXd) {
   std::vector<Vertex> stuff;
-  std::ofstream out(aPrefix + "values.txt");
   auto end = aMore.mDist * (1.0 + 0.5 / aMore.mSamples);
   auto more = aMore;
+  std::vector<double> xs;
   for(more.mDist = 0.0; more.mDist <= end; more.mDist += aMore.mDist / aMore.mSamples) {
-    RungeKuttaRayBending::Result solution = comp1(aParameters, more);
+    xs.push_back(more.mDist);
+  }
+  std::vector<RungeKuttaRayBending::Result> solutions(xs.size());
+  more.mDist = 0.0;
+  solutions.front() = comp1(aPool, more);               // The start itself
+  Vertex start(0.0, aMore.mCamCenter, 0.0);
+  Vector dir(std::cos(aMore.mDir / 180.0 * cgPi), std::sin(aMore.mDir / 180.0 * cgPi), 0.0);
+  aPool.borrow()->mSolver.solveTrajectory(start, dir, xs.data() + 1u, xs.size() - 1u, solutions.data() + 1u);
+  for(auto const &solution : solutions) {
     if(solution.mValid) {
       stuff.push_back(solution.mValue);
-      out << std::setprecision(10) << solution.mValue[0] << '\t' << std::setprecision(10) << solution.mValue[1] << '\n';
+    }
+  }
+  if(aMore.mBinary) {
+    std::vector<double> columns(stuff.size() * 2u);
+    for(size_t i = 0u; i < stuff.size(); ++i) {
+      columns[i] = stuff[i][0];
+      columns[stuff.size() + i] = stuff[i][1];
+    }
+    double const *starts[2u] = {columns.data(), columns.data() + stuff.size()};
+    if(!TrajectoryFile::write(aPrefix + "values.bin", 2u, stuff.size(), starts)) {
+      std::cerr << "Can't write " << aPrefix << "values.bin\n";
+    }
+    else {} // nothing to do
+  }
+  else {
+    std::ofstream out(aPrefix + "values.txt");
+    for(auto const &sample : stuff) {
+      out << std::setprecision(10) << sample[0] << '\t' << std::setprecision(10) << sample[1] << '\n';
     }
   }
   if(!aMore.mSilent) {
@@ -91,8 +140,14 @@ std::tuple<CliResult, RungeKuttaRayBending::Parameters, MoreParameters, std::str
   CLI::App opt{"Usage"};
   std::string nameBase = "water";
   opt.add_option("--base", nameBase, "base type (conventional / porous / water) [water]");
+  more.mBatch = false;
+  opt.add_option("--batch", more.mBatch, "read queries from stdin, one per line as: base tempAmb tempBase camCenter dist dir, nan for the defaults, and write the start and mirror direction for each (true, false) [false]");
+  more.mBinary = false;
+  opt.add_option("--binary", more.mBinary, "write the samples into critvalues.bin and mirrvalues.bin as TrajectoryFile columns x and y instead of text (true, false) [false]");
   more.mCamCenter = 1.1;
   opt.add_option("--camCenter", more.mCamCenter, "start height (m) [1.1]");
+  std::string nameController = "Standard";
+  opt.add_option("--controller", nameController, "error controller for native steppers (Standard / ProportionalIntegral) [Standard]");
   more.mDir = std::nan("");
   opt.add_option("--dir", more.mDir, "start direction, neg downwards (degrees) [computed to touch surface]");
   more.mDist = 1000.0;
@@ -103,8 +158,12 @@ std::tuple<CliResult, RungeKuttaRayBending::Parameters, MoreParameters, std::str
   opt.add_option("--earthRadius", rawRadius, "Earth radius (km) [6371.0]");
   parameters.mMaxCosDirChange = 0.99999999999;
   opt.add_option("--maxCosDirChange", parameters.mMaxCosDirChange, "Maximum of cos of direction change to reset big step [0.99999999999]");
+  parameters.mPlanar = false;
+  opt.add_option("--planar", parameters.mPlanar, "integrate in the vertical plane with 4 variables (true, false) [false]");
   more.mSamples = 100;
   opt.add_option("--samples", more.mSamples, "number of samples on ray [100]");
+  more.mRestrictCpu = 0u;
+  opt.add_option("--saveCpus", more.mRestrictCpu, "amount of CPUs to save to keep the system responsive in sweeps and batches (natural integer) [0]");
   more.mSilent = true;
   opt.add_option("--silent", more.mSilent, "surpress parameter echo (true, false) [true]");
   parameters.mStep1 = 0.01;
@@ -113,8 +172,16 @@ std::tuple<CliResult, RungeKuttaRayBending::Parameters, MoreParameters, std::str
   opt.add_option("--stepMin", parameters.mStepMin, "maximal step size (m) [1e-7]");
   parameters.mStepMax = 22.2;
   opt.add_option("--stepMax", parameters.mStepMax, "maximal step size (m) [22.2]");
+  more.mSweepCount = 0u;
+  opt.add_option("--sweepCount", more.mSweepCount, "compute the critical direction for this many values of the swept option into iterated.txt, 0 for a single ray pair (count) [0]");
+  more.mSweepParameter = "tempAmb";
+  opt.add_option("--sweepParameter", more.mSweepParameter, "option to sweep (camCenter / dist / tempAmb / tempBase), others with iterateEikonal.sh [tempAmb]");
+  more.mSweepStart = 0.0;
+  opt.add_option("--sweepStart", more.mSweepStart, "value of the swept option in the first point [0.0]");
+  more.mSweepStep = 0.0;
+  opt.add_option("--sweepStep", more.mSweepStep, "change of the swept option between points [0.0]");
   std::string nameStepper = "RungeKuttaFehlberg45";
-  opt.add_option("--stepper", nameStepper, "stepper type (RungeKutta23 / RungeKuttaClass4 / RungeKuttaFehlberg45 / RungeKuttaCashKarp45 / RungeKuttaPrinceDormand89 / BulirschStoerBaderDeuflhard) [RungeKuttaFehlberg45]");
+  opt.add_option("--stepper", nameStepper, "stepper type (RungeKutta23 / RungeKuttaClass4 / RungeKuttaFehlberg45 / RungeKuttaCashKarp45 / RungeKuttaPrinceDormand89 / BulirschStoerBaderDeuflhard / NativeFehlberg45 / NativeCashKarp45 / NativeDormandPrince45) [RungeKuttaFehlberg45]");
   more.mTempAmb = std::nan("");
   opt.add_option("--tempAmb", more.mTempAmb, "ambient temperature (Celsius) [20 for conventional, 38.5 for porous, 10 for water]");
   more.mTempBase = 13.0;
@@ -171,16 +238,48 @@ std::tuple<CliResult, RungeKuttaRayBending::Parameters, MoreParameters, std::str
     else if(nameStepper == "BulirschStoerBaderDeuflhard") {
       parameters.mStepper = StepperType::cBulirschStoerBaderDeuflhard;
     }
+    else if(nameStepper == "NativeFehlberg45") {
+      parameters.mStepper = StepperType::cNativeFehlberg45;
+    }
+    else if(nameStepper == "NativeCashKarp45") {
+      parameters.mStepper = StepperType::cNativeCashKarp45;
+    }
+    else if(nameStepper == "NativeDormandPrince45") {
+      parameters.mStepper = StepperType::cNativeDormandPrince45;
+    }
     else {
       std::cerr << "Illegal stepper value: " << nameStepper << '\n';
       result = CliResult::cParamError;
     }
 
+    if(nameController == "Standard") {
+      parameters.mController = ErrorController::cStandard;
+    }
+    else if(nameController == "ProportionalIntegral") {
+      parameters.mController = ErrorController::cProportionalIntegral;
+    }
+    else {
+      std::cerr << "Illegal controller value: " << nameController << '\n';
+      result = CliResult::cParamError;
+    }
+
     if(std::isnan(more.mTempAmb)) {
       more.mTempAmb = (more.mMode == Eikonal::Model::cConventional ? 20.0 :
               (more.mMode == Eikonal::Model::cPorous ? 38.5 : 10.0));
     }
     else {} // nothing to do
+
+    if(more.mBatch && more.mSweepCount > 0u) {
+      std::cerr << "Batch mode is not possible in sweeps.\n";
+      result = CliResult::cParamError;
+    }
+    else {} // nothing to do
+
+    if(more.mSweepCount > 0u && cgSweepable.find(more.mSweepParameter) == cgSweepable.end()) {
+      std::cerr << "Illegal sweep parameter value: " << more.mSweepParameter << '\n';
+      result = CliResult::cParamError;
+    }
+    else {} // nothing to do
   }
   catch(CLI::RuntimeError &e) {
     std::cout << e.get_exit_code() << '\n';
@@ -203,22 +302,105 @@ std::tuple<CliResult, RungeKuttaRayBending::Parameters, MoreParameters, std::str
   return std::make_tuple(result, parameters, more, nameBase, nameForm, nameStepper);
 }
 
-bool resolveCriticalIfNeeded(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters &aMore) {
-  double const cTolerance = 1e-6;
+RungeKuttaRayBending::Parameters getPreciseParameters(RungeKuttaRayBending::Parameters const& aParameters) {
   auto parameters = aParameters;
+  parameters.mTolAbs = cgPreciseTolerance;
+  parameters.mTolRel = cgPreciseTolerance;
+  return parameters;
+}
+
+// Like comp1, with the derivatives of the result by the start direction, per degree.
+RungeKuttaRayBending::ResultJacobian comp1Jacobian(SolverPool &aPool, MoreParameters const& aMore, bool const aStopAtLowest) {
+  Vertex start(0.0, aMore.mCamCenter, 0.0);
+  Vector dir(std::cos(aMore.mDir / 180.0 * cgPi), std::sin(aMore.mDir / 180.0 * cgPi), 0.0);
+  auto solution = aPool.borrow()->mSolver.solveJacobian(start, dir, aMore.mDist, false, aStopAtLowest);
+  for(auto const by : {RungeKuttaRayBending::Parameter::cElevation, RungeKuttaRayBending::Parameter::cAzimuth}) {
+    auto &derivative = solution.mJacobian[static_cast<uint32_t>(by)];
+    derivative.mValue     *= cgPi / 180.0;
+    derivative.mDirection *= cgPi / 180.0;
+  }
+  return solution;
+}
+
+// Finds the root of a function of the start direction between aPositive, where it is positive, and
+// aOther. aProbe(more) returns the validity of the ray of more.mDir, the function value and its
+// derivative. Invalid rays and non-positive values count on the side of aOther. The first probe
+// is at aGuess, and then Newton steps go from the last valid probe. Steps leaving the bracket
+// are replaced by bisection. Returns the side of aPositive.
+template <typename tProbe>
+double findRoot(MoreParameters const& aMore, double aPositive, double aOther, double const aGuess, tProbe &&aProbe) {
+  auto more = aMore;
+  double current = std::nan("");                          // The last valid probe.
+  double value = std::nan("");
+  double derivative = std::nan("");
+  double next = aGuess;
+  for(uint32_t i = 0u; i < cgRootMaxIterations && std::abs(aPositive - aOther) > cgPreciseTolerance; ++i) {
+    if(!(std::min(aPositive, aOther) < next && next < std::max(aPositive, aOther))) {
+      next = (aPositive + aOther) / 2.0;
+    }
+    else {} // nothing to do
+    if(current == aPositive && std::abs(aPositive - next) < cgPreciseTolerance) {
+      break;
+    }
+    else {} // nothing to do
+    more.mDir = next;
+    auto [valid, nextValue, nextDerivative] = aProbe(more);
+    if(valid && nextValue > 0.0) {
+      aPositive = next;
+    }
+    else {
+      aOther = next;
+    }
+    if(valid) {
+      current = next;
+      value = nextValue;
+      derivative = nextDerivative;
+    }
+    else {} // nothing to do
+    next = current - value / derivative;
+  }
+  return aPositive;
+}
+
+// aPrecisePool must have the getPreciseParameters tolerances.
+// The critical ray just touches the surface at its lowest point, or at the end if it does not
+// turn upwards before. So it is the root of the lowest elevation, which is located with its
+// derivative by the start direction instead of bisecting the validity of the ray. The search
+// starts at aGuess if given, otherwise at the straight ray reaching the surface at the end.
+bool resolveCriticalIfNeeded(SolverPool &aPrecisePool, MoreParameters &aMore, double const aGuess = std::nan("")) {
   auto more = aMore;
-  parameters.mTolAbs = cTolerance;
-  parameters.mTolRel = cTolerance;
   more.mDir = 0.0;
 
-  auto solution = comp1(parameters, more);
+  auto solution = comp1(aPrecisePool, more);
   if(solution.mValid) {
     if(std::isnan(aMore.mDir)) {
-      aMore.mDir = binarySearch(-45, 0.0, cTolerance, [&parameters, &more](auto const angle){
-        more.mDir = angle;
-        auto solution = comp1(parameters, more);
-        return solution.mValid;
-      }) + cTolerance;
+      auto guess = (std::isnan(aGuess) ? -std::atan(more.mCamCenter / more.mDist) / cgPi * 180.0 : aGuess);
+      auto critical = findRoot(more, 0.0, -45.0, guess, [&aPrecisePool](MoreParameters const& aProbed){
+        auto solution = comp1Jacobian(aPrecisePool, aProbed, true);
+        auto const &derivative = solution.get(RungeKuttaRayBending::Parameter::cElevation);
+        double elevation;
+        double elevationDerivative;
+        if(aProbed.mEarthForm == Eikonal::EarthForm::cFlat) {
+          elevation = solution.mValue(1);
+          elevationDerivative = derivative.mValue(1);
+        }
+        else {
+          Vector fromCenter = solution.mValue + Vector(0.0, aProbed.mEarthRadius, 0.0);
+          elevation = fromCenter.norm() - aProbed.mEarthRadius;
+          elevationDerivative = fromCenter.dot(derivative.mValue) / fromCenter.norm();
+        }
+        return std::make_tuple(solution.mValid, elevation, elevationDerivative);
+      });
+      more.mDir = critical;
+      if(!comp1(aPrecisePool, more).mValid) {           // The plain integration may still fail at the grazing point.
+        critical = binarySearch(critical, 0.0, cgPreciseTolerance, [&aPrecisePool, &more](auto const angle){
+          more.mDir = angle;
+          auto solution = comp1(aPrecisePool, more);
+          return solution.mValid;
+        }) + cgPreciseTolerance;
+      }
+      else {} // nothing to do
+      aMore.mDir = critical;
     }
     else {} // nothing to do
   }
@@ -227,45 +409,272 @@ bool resolveCriticalIfNeeded(RungeKuttaRayBending::Parameters const& aParameters
   return solution.mValid;
 }
 
-double calculateMirrorDirection(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters const& aMore) {
-  double const cTolerance = 1e-6;
-  auto parameters = aParameters;
-  auto more = aMore;
-  parameters.mTolAbs = cTolerance;
-  parameters.mTolRel = cTolerance;
+// aPrecisePool must have the getPreciseParameters tolerances.
+// The mirror ray arrives horizontally, so its direction is the root of the vertical component of
+// the arriving direction. The horizontal start direction is a trivial root, as the ray stays far
+// from the surface, and the rays just below arrive downwards. So the search goes from the critical
+// direction, where the ray arrives upwards after touching the surface, to the horizontal.
+double calculateMirrorDirection(SolverPool &aPrecisePool, MoreParameters const& aMore) {
+  return findRoot(aMore, aMore.mDir, 0.0, aMore.mDir / 2.0, [&aPrecisePool](MoreParameters const& aProbed){
+    auto solution = comp1Jacobian(aPrecisePool, aProbed, false);
+    return std::make_tuple(solution.mValid, solution.mDirection(1), solution.get(RungeKuttaRayBending::Parameter::cElevation).mDirection(1));
+  });
+}
 
-  more.mDir = 0.0;
-  bool   downwardsPrev = true;
-  double delta = -0.1;
+uint32_t getCpuCount(MoreParameters const& aMore) {
+  uint32_t result = std::thread::hardware_concurrency();
+  result -= (result <= aMore.mRestrictCpu ? result - 1u : aMore.mRestrictCpu);
+  return result;
+}
+
+// Computes the critical direction for each value of the swept option into iterated.txt. The
+// points are split in contiguous runs, one per thread with its own Eikonal and solvers. In a
+// run, the root search of each point starts from the linear extrapolation of the previous two,
+// so it needs only a few probes.
+void sweep(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters const& aMore) {
+  auto member = cgSweepable.at(aMore.mSweepParameter);
+  auto parameters = getPreciseParameters(aParameters);
+  if(member == &MoreParameters::mDist) {
+    parameters.mDistAlongRay = 2.0 * std::max(std::abs(aMore.mSweepStart), std::abs(aMore.mSweepStart + (aMore.mSweepCount - 1u) * aMore.mSweepStep));
+  }
+  else {} // nothing to do
+  uint32_t cpus = getCpuCount(aMore);
+  uint32_t runCount = std::min(cpus, aMore.mSweepCount);
+  std::vector<double> directions(aMore.mSweepCount, std::nan(""));
+  WorkerPool workers(cpus);
+  TileScheduler scheduler(workers, runCount);
+  scheduler.run([&aMore, &parameters, member, runCount, &directions](uint32_t const, uint32_t const aRun) {
+    auto more = aMore;
+    Eikonal eikonal(more.mEarthForm, more.mEarthRadius, more.mMode, more.mTempAmb, more.mTempAmb, more.mTempAmb, more.mTempBase);
+    SolverPool pool(parameters, eikonal);
+    double previous = std::nan("");
+    double beforePrevious = std::nan("");
+    for(uint32_t i = aMore.mSweepCount * aRun / runCount; i < aMore.mSweepCount * (aRun + 1u) / runCount; ++i) {
+      more.*member = aMore.mSweepStart + i * aMore.mSweepStep;
+      more.mDir = aMore.mDir;
+      eikonal.setTemperatures(more.mTempAmb, more.mTempAmb, more.mTempAmb, more.mTempBase);
+      auto guess = (std::isnan(beforePrevious) ? previous : 2.0 * previous - beforePrevious);
+      if(resolveCriticalIfNeeded(pool, more, guess)) {
+        directions[i] = more.mDir;
+        beforePrevious = previous;
+        previous = more.mDir;
+      }
+      else {
+        previous = std::nan("");                      // The next one starts cold.
+        beforePrevious = std::nan("");
+      }
+    }
+  });
+  std::ofstream out("iterated.txt");
+  out << "--" << aMore.mSweepParameter << " direction\n";
+  for(uint32_t i = 0u; i < aMore.mSweepCount; ++i) {
+    out << aMore.mSweepStart + i * aMore.mSweepStep;
+    if(!std::isnan(directions[i])) {
+      out << ' ' << directions[i];
+    }
+    else {} // nothing to do, failed points have no direction
+    out << '\n';
+  }
+}
 
-  while(std::abs(delta) > cTolerance) {
-    more.mDir += delta;
-    auto solution = comp1(parameters, more);
-    bool downwardsNow = (solution.mDirection(1) < 0);
-    if(downwardsPrev != downwardsNow) {
-      delta /= -3.0;
-      downwardsPrev = downwardsNow;
+// Reads aLine of a batch query into aMore. Returns false if it is malformed.
+bool parseQuery(std::string const& aLine, MoreParameters &aMore) {
+  std::istringstream in(aLine);
+  std::string nameBase;
+  std::array<std::string, 5u> fields;
+  in >> nameBase;
+  for(auto &field : fields) {
+    in >> field;
+  }
+  bool result = !in.fail();
+  if(result) {
+    if(nameBase == "conventional") {
+      aMore.mMode = Eikonal::Model::cConventional;
+    }
+    else if(nameBase == "porous") {
+      aMore.mMode = Eikonal::Model::cPorous;
+    }
+    else if(nameBase == "water") {
+      aMore.mMode = Eikonal::Model::cWater;
+    }
+    else {
+      result = false;
+    }
+    try {                                             // std::stod also takes nan, unlike the stream.
+      aMore.mTempAmb   = std::stod(fields[0u]);
+      aMore.mTempBase  = std::stod(fields[1u]);
+      auto camCenter   = std::stod(fields[2u]);       // nan keeps the command line value.
+      auto dist        = std::stod(fields[3u]);
+      aMore.mCamCenter = (std::isnan(camCenter) ? aMore.mCamCenter : camCenter);
+      aMore.mDist      = (std::isnan(dist) ? aMore.mDist : dist);
+      aMore.mDir       = std::stod(fields[4u]);
+    }
+    catch(std::logic_error &) {
+      result = false;
+    }
+  }
+  else {} // nothing to do
+  if(result) {
+    if(std::isnan(aMore.mTempAmb)) {
+      aMore.mTempAmb = (aMore.mMode == Eikonal::Model::cConventional ? 20.0 :
+              (aMore.mMode == Eikonal::Model::cPorous ? 38.5 : 10.0));
+    }
+    else {} // nothing to do
+    if(std::isnan(aMore.mTempBase)) {
+      aMore.mTempBase = 13.0;
     }
     else {} // nothing to do
+    result = (aMore.mCamCenter > 0.0 && aMore.mDist > 0.0);
   }
+  else {} // nothing to do
+  return result;
+}
+
+// Solvers of one batch thread for one base type, kept between its queries.
+struct BatchSolvers final {
+  Eikonal                   mEikonal;
+  std::optional<SolverPool> mPrecisePool;             // Rebuilt when a query needs a longer ray.
+  double                    mLastCritical = std::nan("");
+
+  BatchSolvers(MoreParameters const& aMore) : mEikonal(aMore.mEarthForm, aMore.mEarthRadius, aMore.mMode, aMore.mTempAmb, aMore.mTempAmb, aMore.mTempAmb, aMore.mTempBase) {}
 
-  return more.mDir;
+  BatchSolvers(BatchSolvers const&) = delete;
+  BatchSolvers(BatchSolvers &&) = delete;
+  BatchSolvers& operator=(BatchSolvers const&) = delete;
+  BatchSolvers& operator=(BatchSolvers &&) = delete;
+};
+
+// Answers one batch query with aSolvers of its base type. The critical search starts from the
+// last critical direction of aSolvers, as the queries usually differ only a little.
+std::string answerQuery(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters &aMore, BatchSolvers &aSolvers) {
+  aSolvers.mEikonal.setTemperatures(aMore.mTempAmb, aMore.mTempAmb, aMore.mTempAmb, aMore.mTempBase);
+  if(!aSolvers.mPrecisePool || aSolvers.mPrecisePool->getParameters().mDistAlongRay < aMore.mDist * 2.0) {
+    auto parameters = getPreciseParameters(aParameters);
+    parameters.mDistAlongRay = aMore.mDist * 2.0;
+    aSolvers.mPrecisePool.reset();
+    aSolvers.mPrecisePool.emplace(parameters, aSolvers.mEikonal);
+  }
+  else {} // nothing to do
+  std::ostringstream result;
+  result << std::setprecision(10);
+  if(resolveCriticalIfNeeded(*aSolvers.mPrecisePool, aMore, aSolvers.mLastCritical)) {
+    aSolvers.mLastCritical = aMore.mDir;
+    result << aMore.mDir << ' ' << calculateMirrorDirection(*aSolvers.mPrecisePool, aMore);
+  }
+  else {
+    result << "nan nan";
+  }
+  return result.str();
+}
+
+// Reads queries from stdin until its end and writes one line per query in their order, each as
+// soon as it and all before are ready. The queries are solved concurrently, each thread keeps
+// its solvers per base type, so after the first few queries nothing is allocated. The base type,
+// temperatures, camera height, distance and start direction come from the query, the rest from
+// the command line. A malformed query or one whose integration throws gets an error line.
+void batch(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters const& aMore) {
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::deque<std::pair<uint64_t, std::string>> pending;
+  std::map<uint64_t, std::string> answered;
+  uint64_t nextToWrite = 0u;
+  bool finished = false;
+  std::vector<std::thread> threads(getCpuCount(aMore));
+  for(auto &thread : threads) {
+    thread = std::thread([&] {
+      std::array<std::unique_ptr<BatchSolvers>, 3u> solvers;   // Per Eikonal::Model
+      std::unique_lock<std::mutex> lock(mutex);
+      while(true) {
+        wakeup.wait(lock, [&pending, &finished]{ return finished || !pending.empty(); });
+        if(pending.empty()) {
+          break;
+        }
+        else {} // nothing to do
+        auto [index, line] = std::move(pending.front());
+        pending.pop_front();
+        lock.unlock();
+        auto more = aMore;
+        std::string answer;
+        try {
+          if(parseQuery(line, more)) {
+            auto &cached = solvers[static_cast<uint32_t>(more.mMode)];
+            if(!cached) {
+              cached = std::make_unique<BatchSolvers>(more);
+            }
+            else {} // nothing to do
+            try {
+              answer = answerQuery(aParameters, more, *cached);
+            }
+            catch(...) {
+              cached.reset();                               // Its solvers may be in the middle of a step.
+              throw;
+            }
+          }
+          else {
+            answer = "Wrong query: " + line;
+          }
+        }
+        catch(std::exception &e) {
+          answer = "Failed query: " + line + " (" + e.what() + ')';
+        }
+        catch(...) {
+          answer = "Failed query: " + line;
+        }
+        lock.lock();
+        answered.emplace(index, std::move(answer));
+        for(auto found = answered.find(nextToWrite); found != answered.end(); found = answered.find(nextToWrite)) {
+          std::cout << found->second << '\n';
+          answered.erase(found);
+          ++nextToWrite;
+        }
+        std::cout.flush();
+      }
+    });
+  }
+  uint64_t count = 0u;
+  std::string line;
+  while(std::getline(std::cin, line)) {
+    if(!line.empty()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.emplace_back(count, line);
+      ++count;
+      wakeup.notify_one();
+    }
+    else {} // nothing to do
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+  }
+  wakeup.notify_all();
+  for(auto &thread : threads) {
+    thread.join();
+  }
 }
 
 void dump(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters const& aMore, double const aMirrorDirection, std::string const& aNameBase, std::string const& aNameForm, std::string const& aNameStepper) {
   if(!aMore.mSilent) {
     std::cout << "base type:                               .  .  .  " << aNameBase << ' ' << static_cast<int>(aMore.mMode) << '\n';
+    std::cout << "batch queries from stdin:                         " << aMore.mBatch << '\n';
+    std::cout << "binary sample files:                              " << aMore.mBinary << '\n';
     std::cout << "camera height (m):                                " << aMore.mCamCenter << '\n';
     std::cout << "start direction, neg downwards (degrees):         " << aMore.mDir << '\n';
     std::cout << "horizontal distance to travel (m):    .  .  .  .  " << aMore.mDist << '\n';
     std::cout << "Earth form:                                       " << aNameForm << ' ' << static_cast<int>(aMore.mEarthForm) << '\n';
     std::cout << "Earth radius (km):                                " << aMore.mEarthRadius / 1000.0 << '\n';
     std::cout << "max of cos of direction change to reset big step: " << std::setprecision(17) << aParameters.mMaxCosDirChange << '\n';
+    std::cout << "integrate in the vertical plane:                  " << aParameters.mPlanar << '\n';
     std::cout << "number of samples on ray:                         " << aMore.mSamples << '\n';
+    std::cout << "amount of CPUs to save in sweeps and batches:     " << aMore.mRestrictCpu << '\n';
     std::cout << "initial step size (m):                            " << aParameters.mStep1 << '\n';
     std::cout << "minimal step size (m): .  .  .  .  .  .  .  .  .  " << aParameters.mStepMin << '\n';
     std::cout << "maximal step size (m):                            " << aParameters.mStepMax << '\n';
+    std::cout << "sweep point count:                                " << aMore.mSweepCount << '\n';
+    std::cout << "swept option:    .  .  .  .  .  .  .  .  .  .  .  " << aMore.mSweepParameter << '\n';
+    std::cout << "swept option value in the first point:            " << aMore.mSweepStart << '\n';
+    std::cout << "swept option change between points:               " << aMore.mSweepStep << '\n';
     std::cout << "stepper type:                                     " << aNameStepper << ' ' << static_cast<int>(aParameters.mStepper) << '\n';
+    std::cout << "error controller for native steppers:             " << static_cast<int>(aParameters.mController) << '\n';
     std::cout << "ambient temperature (Celsius):              .  .  " << aMore.mTempAmb << '\n';
     std::cout << "base temperature, only for water (Celsius):       " << aMore.mTempBase << '\n';
     std::cout << "absolute tolerance (m):                           " << aParameters.mTolAbs << '\n';
@@ -278,23 +687,34 @@ void dump(RungeKuttaRayBending::Parameters const& aParameters, MoreParameters co
 int main(int aArgc, char **aArgv) {
   auto[result, parameters, more, nameBase, nameForm, nameStepper] = parse(aArgc, aArgv);
 
-  bool valid = (result == CliResult::cOk && resolveCriticalIfNeeded(parameters, more));
-
-  if(valid) {
-    double mirrorDirection = calculateMirrorDirection(parameters, more);
-    dump(parameters, more, mirrorDirection, nameBase, nameForm, nameStepper);
-    comp("crit", parameters, more, true);
-    more.mDir = mirrorDirection;
-    comp("mirr", parameters, more, false);
+  if(result == CliResult::cOk && more.mBatch) {
+    batch(parameters, more);
   }
-  else {
-    if(result == CliResult::cOk) {
-      std::cout << "Can't compute critical ray, increase --dist.\n";
+  else if(result == CliResult::cOk && more.mSweepCount > 0u) {
+    sweep(parameters, more);
+  }
+  else if(result == CliResult::cOk) {
+    Eikonal eikonal(more.mEarthForm, more.mEarthRadius, more.mMode, more.mTempAmb, more.mTempAmb, more.mTempAmb, more.mTempBase);
+    SolverPool pool(parameters, eikonal);
+    SolverPool precisePool(getPreciseParameters(parameters), eikonal);
+    if(resolveCriticalIfNeeded(precisePool, more)) {
+      double mirrorDirection = calculateMirrorDirection(precisePool, more);
+      dump(parameters, more, mirrorDirection, nameBase, nameForm, nameStepper);
+      comp("crit", pool, more, true);
+      more.mDir = mirrorDirection;
+      comp("mirr", pool, more, false);
+      if(!more.mSilent) {
+        std::cout << "solver workspaces allocated: " << pool.getAllocationCount() + precisePool.getAllocationCount() << '\n';
+      }
+      else {} // nothing to do
     }
-    else if(result == CliResult::cParamError) {
-      std::cout << "Wrong parameters.\n";
+    else {
+      std::cout << "Can't compute critical ray, increase --dist.\n";
     }
-    else {} // nothing to do
   }
+  else if(result == CliResult::cParamError) {
+    std::cout << "Wrong parameters.\n";
+  }
+  else {} // nothing to do
   return 0;
 }
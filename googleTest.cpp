@@ -1,7 +1,18 @@
 #include "RungeKuttaRayBending.h"
+#include "BatchRayBending.h"
+#include "RayMapTable.h"
+#include "SolverPool.h"
+#include "TileScheduler.h"
+#include "TrajectoryFile.h"
+#include "Texture.h"
+#include "PngRowWriter.h"
 #include "ShepardInterpolation.h"
 #include "gtest/gtest.h"
 #include <random>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 constexpr float cgEpsilon = 0.0001f;
@@ -14,6 +25,23 @@ bool eq(double const aF1, double const aF2) {
   return eq(aF1, aF2, cgEpsilon);
 }
 
+
+// Native solver parameters of most tests, which change only what they need.
+RungeKuttaRayBending::Parameters getTestParameters() {
+  RungeKuttaRayBending::Parameters result;
+  result.mStepper         = StepperType::cNativeFehlberg45;
+  result.mController      = ErrorController::cStandard;
+  result.mDistAlongRay    = 2000.0;
+  result.mTolAbs          = 0.001;
+  result.mTolRel          = 0.001;
+  result.mStep1           = 0.01;
+  result.mStepMin         = 1e-4;
+  result.mStepMax         = 55.5;
+  result.mMaxCosDirChange = 0.99999999999;
+  result.mPlanar          = false;
+  return result;
+}
+
 TEST(polynomApprox, x20) {
   double const y[] = {0.0, 0.0, 0.0};
   double const x[] = {1.0, 2.0, 3.0};
@@ -120,6 +148,502 @@ TEST(polynomApprox, 10y_x_x2__x3_xy) {
   EXPECT_TRUE(eq(poly.getRrmsError(), 0.0f));
 }
 
+TEST(polynomApprox, fixedDegreesSameAsGeneric) {
+  double const y[] = {0.0, 1.0, -2.0, -15.0, 10.0, 12.0, 10.0, -2.0, 20.0, 23.0, 22.0, 11.0};
+  double const x1[] = {0.0, 1.0, 2.0, 3.0, 0.0, 1.0, 2.0, 3.0, 0.0, 1.0, 2.0, 3.0};
+  double const x2[] = {0.0, 0.0, 0.0, 0.0, 1.0, 1.0, 1.0, 1.0, 2.0, 2.0, 2.0, 2.0};
+  PolynomApprox poly(12u, y, {{x1, 3u}, {x2, 1u}});
+  EXPECT_TRUE(eq(poly.eval<3u, 1u>({0.0, 4.0}),  40.0));
+  EXPECT_TRUE(eq(poly.eval<3u, 1u>({4.0, 0.0}), -44.0));
+  EXPECT_TRUE(eq(poly.eval<3u, 1u>({4.0, 4.0}),  12.0));
+  EXPECT_THROW((poly.eval<2u, 1u>({4.0, 4.0})), std::invalid_argument);
+  double const variables[] = {0.0, 4.0, 4.0, 1.5,
+                              4.0, 0.0, 4.0, 0.5};
+  double results[4u];
+  poly.eval<3u, 1u>(variables, 4u, results);
+  for(uint32_t i = 0u; i < 4u; ++i) {
+    EXPECT_TRUE(eq(results[i], poly.eval(std::initializer_list<double>{variables[i], variables[4u + i]})));
+  }
+}
+
+class OdeSin final {
+public:
+  static constexpr uint32_t csNvar = 2u;
+
+  int differentials(double const, const double aY[], double aDydt[]) const {
+    aDydt[0] = aY[1];
+    aDydt[1] = -aY[0];
+    return GSL_SUCCESS;
+  }
+};
+
+template <typename tButcherTableau>
+void testOdeSolverRungeKutta(ErrorController const aController) {
+  OdeSolverRungeKutta<OdeSin, tButcherTableau> solver(0.0, 10.0, 1e-9, 1e-9, 1e-3, 1e-9, 10.0, OdeSin(), aController);
+  auto solution = solver.solve({0.0, 1.0}, [](double const aT, auto const&){ return aT >= 2.0; }, [](auto const&, auto const&){ return false; });
+  EXPECT_TRUE(solution.mValid);
+  EXPECT_TRUE(eq(solution.mValue[0], std::sin(solution.mAtIndependent)));
+  EXPECT_TRUE(eq(solution.mValue[1], std::cos(solution.mAtIndependent)));
+  EXPECT_TRUE(eq(solution.mAtIndependent, 2.0, 1e-9));
+}
+
+TEST(odeSolverRungeKutta, fehlberg45) {
+  testOdeSolverRungeKutta<ButcherTableauFehlberg45>(ErrorController::cStandard);
+}
+
+TEST(odeSolverRungeKutta, cashKarp45) {
+  testOdeSolverRungeKutta<ButcherTableauCashKarp45>(ErrorController::cStandard);
+}
+
+TEST(odeSolverRungeKutta, dormandPrince45) {
+  testOdeSolverRungeKutta<ButcherTableauDormandPrince45>(ErrorController::cStandard);
+}
+
+TEST(odeSolverRungeKutta, dormandPrince45pi) {
+  testOdeSolverRungeKutta<ButcherTableauDormandPrince45>(ErrorController::cProportionalIntegral);
+}
+
+TEST(batchRayBending, sameAsScalar) {
+  auto para = getTestParameters();
+  Eikonal eikonal(Eikonal::EarthForm::cRound, 6371000.0, Eikonal::Model::cWater, 10.0, 8.0, 14.0, 13.0);
+  RungeKuttaRayBending scalar(para, eikonal);
+  BatchRayBending batch(para, eikonal);
+  std::vector<Ray> rays;
+  for(uint32_t i = 0u; i < 13u; ++i) {                    // Not a multiple of the lane count.
+    Ray ray;
+    ray.mStart = Vertex(1.0, 1.1, 0.0);
+    auto elevation = -0.003 + 0.001 * i;
+    ray.mDirection = Vector(std::cos(elevation), std::sin(elevation), 0.001 * i);
+    ray.mDirection.normalize();
+    rays.push_back(ray);
+  }
+  std::vector<RungeKuttaRayBending::Result> results(rays.size());
+  batch.solve4x(rays.data(), rays.size(), 1000.0, results.data());
+  for(uint32_t i = 0u; i < rays.size(); ++i) {
+    auto expected = scalar.solve4x(rays[i].mStart, rays[i].mDirection, 1000.0);
+    EXPECT_EQ(expected.mValid, results[i].mValid);
+    if(expected.mValid) {
+      EXPECT_TRUE(eq(expected.mValue(0), results[i].mValue(0), 1e-6));
+      EXPECT_TRUE(eq(expected.mValue(1), results[i].mValue(1), 1e-6));
+      EXPECT_TRUE(eq(expected.mValue(2), results[i].mValue(2), 1e-6));
+    }
+    else {} // nothing to do
+  }
+}
+
+void testPlanarSameAs3d(Eikonal::EarthForm const aEarthForm) {
+  auto para = getTestParameters();
+  Eikonal eikonal(aEarthForm, 6371000.0, Eikonal::Model::cWater, 10.0, 8.0, 14.0, 13.0);
+  RungeKuttaRayBending full(para, eikonal);
+  para.mPlanar          = true;
+  RungeKuttaRayBending planar(para, eikonal);
+  Vertex start(1.0, 1.1, 0.0);
+  for(uint32_t i = 0u; i < 12u; ++i) {
+    auto elevation = -0.003 + 0.001 * i;
+    auto azimuth = -0.006 + 0.001 * i;
+    Vector dir(std::cos(elevation) * std::cos(azimuth), std::sin(elevation), std::cos(elevation) * std::sin(azimuth));
+    auto expected = full.solve4x(start, dir, 1000.0);
+    auto result = planar.solve4x(start, dir, 1000.0);
+    EXPECT_EQ(expected.mValid, result.mValid);
+    if(expected.mValid) {
+      EXPECT_TRUE(eq(expected.mValue(0), result.mValue(0), 1e-6));
+      EXPECT_TRUE(eq(expected.mValue(1), result.mValue(1), 1e-3));
+      EXPECT_TRUE(eq(expected.mValue(2), result.mValue(2), 1e-3));
+      EXPECT_TRUE(eq(expected.mDirection.dot(result.mDirection), 1.0, 1e-9));
+    }
+    else {} // nothing to do
+  }
+}
+
+TEST(rungeKuttaRayBending, planarFlat) {
+  testPlanarSameAs3d(Eikonal::EarthForm::cFlat);
+}
+
+TEST(rungeKuttaRayBending, planarRound) {
+  testPlanarSameAs3d(Eikonal::EarthForm::cRound);
+}
+
+TEST(rungeKuttaRayBending, trajectorySameAsSeparate) {
+  auto para = getTestParameters();
+  para.mStepper         = StepperType::cNativeDormandPrince45;
+  Eikonal eikonal(Eikonal::EarthForm::cRound, 6371000.0, Eikonal::Model::cWater, 10.0, 8.0, 14.0, 13.0);
+  RungeKuttaRayBending solver(para, eikonal);
+  Vertex start(0.0, 1.1, 0.0);
+  Vector dir(std::cos(-0.002), std::sin(-0.002), 0.0);
+  std::vector<double> xs{10.0, 10.0, 250.0, 500.0, 999.0, 1000.0, 3000.0, 4000.0};
+  std::vector<RungeKuttaRayBending::Result> trajectory(xs.size());
+  solver.solveTrajectory(start, dir, xs.data(), xs.size(), trajectory.data());
+  for(uint32_t i = 0u; i + 2u < xs.size(); ++i) {
+    auto separate = solver.solve4x(start, dir, xs[i]);
+    EXPECT_TRUE(trajectory[i].mValid);
+    EXPECT_EQ(separate.mValue, trajectory[i].mValue);
+    EXPECT_EQ(separate.mDirection, trajectory[i].mDirection);
+  }
+  EXPECT_EQ(solver.solve4x(start, dir, xs[6]).mValue, trajectory[6].mValue);   // Beyond mDistAlongRay: the end state
+  EXPECT_FALSE(trajectory[7].mValid);
+  solver.solveTrajectory(start, dir, nullptr, 0u, nullptr);   // Nothing to read or write.
+}
+
+TEST(eikonal, tempDerivativesMatchFiniteDifference) {
+  double const delta = 1e-4;
+  for(auto const model : {Eikonal::Model::cConventional, Eikonal::Model::cPorous, Eikonal::Model::cWater}) {
+    Eikonal eikonal(Eikonal::EarthForm::cFlat, 6371000.0, model, 10.0, 10.0, 10.0, 13.0);
+    Eikonal ambientAbove(Eikonal::EarthForm::cFlat, 6371000.0, model, 10.0 + delta, 10.0, 10.0, 13.0);
+    Eikonal ambientBelow(Eikonal::EarthForm::cFlat, 6371000.0, model, 10.0 - delta, 10.0, 10.0, 13.0);
+    Eikonal baseAbove(Eikonal::EarthForm::cFlat, 6371000.0, model, 10.0, 10.0, 10.0, 13.0 + delta);
+    Eikonal baseBelow(Eikonal::EarthForm::cFlat, 6371000.0, model, 10.0, 10.0, 10.0, 13.0 - delta);
+    for(auto const height : {0.01, 0.1, 1.0}) {
+      auto derivatives = eikonal.getTempDerivatives(height);
+      EXPECT_NEAR(derivatives.mRefractByAmbient, (ambientAbove.calculateRefract(height) - ambientBelow.calculateRefract(height)) / 2.0 / delta, 1e-9);
+      EXPECT_NEAR(derivatives.mRefractByBase, (baseAbove.calculateRefract(height) - baseBelow.calculateRefract(height)) / 2.0 / delta, 1e-9);
+      EXPECT_NEAR(derivatives.mRefractDiffByAmbient, (ambientAbove.calculateRefractDiff(height) - ambientBelow.calculateRefractDiff(height)) / 2.0 / delta, 1e-8);
+      EXPECT_NEAR(derivatives.mRefractDiffByBase, (baseAbove.calculateRefractDiff(height) - baseBelow.calculateRefractDiff(height)) / 2.0 / delta, 1e-8);
+    }
+  }
+}
+
+TEST(rungeKuttaRayBending, jacobianMatchesFiniteDifference) {
+  auto para = getTestParameters();
+  para.mStepper         = StepperType::cNativeDormandPrince45;
+  para.mTolAbs          = 1e-9;
+  para.mTolRel          = 1e-9;
+  para.mStepMin         = 1e-9;
+  para.mStepMax         = 22.2;
+  using Parameter = RungeKuttaRayBending::Parameter;
+  for(auto const form : {Eikonal::EarthForm::cFlat, Eikonal::EarthForm::cRound}) {
+    Eikonal eikonal(form, 6371000.0, Eikonal::Model::cWater, 10.0, 10.0, 10.0, 13.0);
+    RungeKuttaRayBending solver(para, eikonal);
+    Vertex start(0.0, 1.1, 0.0);
+    double const elevation = -0.0015;
+    double const azimuth = 0.01;
+    double const delta = 1e-6;
+    auto getDir = [](double const aElevation, double const aAzimuth) {
+      return Vector(std::cos(aElevation) * std::cos(aAzimuth), std::sin(aElevation), std::cos(aElevation) * std::sin(aAzimuth));
+    };
+    auto result = solver.solveJacobian(start, getDir(elevation, azimuth), 1000.0, true);
+    EXPECT_TRUE(result.mValid);
+    EXPECT_NEAR(result.mValue(1), solver.solve4x(start, getDir(elevation, azimuth), 1000.0).mValue(1), 1e-6);
+
+    auto above = solver.solve4x(start, getDir(elevation + delta, azimuth), 1000.0);
+    auto below = solver.solve4x(start, getDir(elevation - delta, azimuth), 1000.0);
+    auto const &byElevation = result.get(Parameter::cElevation);
+    EXPECT_NEAR(byElevation.mValue(0), 0.0, 1e-6);
+    EXPECT_NEAR(byElevation.mValue(1), (above.mValue(1) - below.mValue(1)) / 2.0 / delta, 0.1);
+    EXPECT_NEAR(byElevation.mDirection(1), (above.mDirection(1) - below.mDirection(1)) / 2.0 / delta, 1e-3);
+
+    above = solver.solve4x(start, getDir(elevation, azimuth + delta), 1000.0);
+    below = solver.solve4x(start, getDir(elevation, azimuth - delta), 1000.0);
+    auto const &byAzimuth = result.get(Parameter::cAzimuth);
+    EXPECT_NEAR(byAzimuth.mValue(2), (above.mValue(2) - below.mValue(2)) / 2.0 / delta, 0.1);
+    EXPECT_NEAR(byAzimuth.mDirection(2), (above.mDirection(2) - below.mDirection(2)) / 2.0 / delta, 1e-3);
+
+    double const deltaTemp = 1e-3;
+    eikonal.setTemperatures(10.0, 10.0, 10.0, 13.0 + deltaTemp);
+    above = solver.solve4x(start, getDir(elevation, azimuth), 1000.0);
+    eikonal.setTemperatures(10.0, 10.0, 10.0, 13.0 - deltaTemp);
+    below = solver.solve4x(start, getDir(elevation, azimuth), 1000.0);
+    auto const &byBase = result.get(Parameter::cTempBase);
+    EXPECT_NEAR(byBase.mValue(1), (above.mValue(1) - below.mValue(1)) / 2.0 / deltaTemp, 1e-3);
+    EXPECT_NEAR(byBase.mDirection(1), (above.mDirection(1) - below.mDirection(1)) / 2.0 / deltaTemp, 1e-5);
+
+    eikonal.setTemperatures(10.0 + deltaTemp, 10.0, 10.0, 13.0);
+    above = solver.solve4x(start, getDir(elevation, azimuth), 1000.0);
+    eikonal.setTemperatures(10.0 - deltaTemp, 10.0, 10.0, 13.0);
+    below = solver.solve4x(start, getDir(elevation, azimuth), 1000.0);
+    auto const &byAmbient = result.get(Parameter::cTempAmbient);
+    EXPECT_NEAR(byAmbient.mValue(1), (above.mValue(1) - below.mValue(1)) / 2.0 / deltaTemp, 1e-3);
+    EXPECT_NEAR(byAmbient.mDirection(1), (above.mDirection(1) - below.mDirection(1)) / 2.0 / deltaTemp, 1e-5);
+
+    auto directions = solver.solveJacobian(start, getDir(elevation, azimuth), 1000.0, false);
+    EXPECT_NEAR(directions.get(Parameter::cElevation).mValue(1), byElevation.mValue(1), 0.01);   // Other steps, as all columns are in the error control.
+    EXPECT_EQ(directions.get(Parameter::cTempBase).mValue(1), 0.0);
+  }
+}
+
+TEST(rayMapTable, interpolationWithinTolerance) {
+  auto para = getTestParameters();
+  Eikonal eikonal(Eikonal::EarthForm::cRound, 6371000.0, Eikonal::Model::cWater, 10.0, 8.0, 14.0, 13.0);
+  RungeKuttaRayBending rk(para, eikonal);
+  Vertex start(1.0, 1.1, 0.0);
+  double const tolerance = 0.01;
+  RayMapTable table(start, {-0.002, 0.004, -0.003, 0.003}, tolerance, [&rk](Ray const * const aRays, uint32_t const aCount, RungeKuttaRayBending::Result * const aResults) {
+    for(uint32_t i = 0u; i < aCount; ++i) {
+      aResults[i] = rk.solve4x(aRays[i].mStart, aRays[i].mDirection, 1000.0);
+    }
+  });
+  EXPECT_LT(table.getSampleCount(), 20000u);
+  std::mt19937 generator(1u);
+  std::uniform_real_distribution<double> elevations(-0.002, 0.004);
+  std::uniform_real_distribution<double> azimuths(-0.003, 0.003);
+  uint32_t mapped = 0u;
+  for(uint32_t i = 0u; i < 300u; ++i) {
+    auto elevation = elevations(generator);
+    auto azimuth = azimuths(generator);
+    Vector dir(std::cos(elevation) * std::cos(azimuth), std::sin(elevation), std::cos(elevation) * std::sin(azimuth));
+    auto result = table.lookup(dir);
+    if(result) {
+      auto expected = rk.solve4x(start, dir, 1000.0);
+      ++mapped;
+      EXPECT_EQ(expected.mValid, result->mValid);
+      if(expected.mValid && result->mValid) {
+        EXPECT_LT((expected.mValue - result->mValue).norm(), 10.0 * tolerance);
+      }
+      else {} // nothing to do
+    }
+    else {} // nothing to do
+  }
+  EXPECT_GT(mapped, 250u);
+  EXPECT_FALSE(table.lookup(Vector(0.0, 0.0, 1.0)));
+}
+
+TEST(rayMapTable, findsThinStripOfValidRays) {
+  Vertex start(1.0, 1.1, 0.0);
+  double const low = 0.0101;                                  // Between two samples of a root cell, which are 0.003125 apart.
+  double const high = 0.0114;
+  RayMapTable table(start, {0.0, 0.1, -0.05, 0.05}, 0.01, [low, high](Ray const * const aRays, uint32_t const aCount, RungeKuttaRayBending::Result * const aResults) {
+    for(uint32_t i = 0u; i < aCount; ++i) {
+      auto elevation = std::asin(aRays[i].mDirection(1));
+      aResults[i].mValid = (elevation > low && elevation < high);
+      aResults[i].mValue = Vertex(1000.0, elevation * 1000.0, 0.0);
+      aResults[i].mDirection = Vector(1.0, 0.0, 0.0);
+    }
+  });
+  auto elevation = (low + high) / 2.0;
+  auto result = table.lookup(Vector(std::cos(elevation), std::sin(elevation), 0.0));
+  EXPECT_FALSE(result && !result->mValid);
+}
+
+TEST(solverPool, reusesWorkspaces) {
+  auto para = getTestParameters();
+  Eikonal eikonal(Eikonal::EarthForm::cRound, 6371000.0, Eikonal::Model::cWater, 10.0, 8.0, 14.0, 13.0);
+  SolverPool pool(para, eikonal);
+  Vertex start(1.0, 1.1, 0.0);
+  Vector dir(1.0, 0.0, 0.0);
+  auto expected = pool.borrow()->mSolver.solve4x(start, dir, 1000.0);
+  for(uint32_t i = 0u; i < 10u; ++i) {
+    auto result = pool.borrow()->mSolver.solve4x(start, dir, 1000.0);
+    EXPECT_EQ(result.mValue, expected.mValue);
+  }
+  EXPECT_EQ(pool.getAllocationCount(), 1u);
+  {
+    auto first = pool.borrow();
+    auto second = pool.borrow();
+    EXPECT_NE(&*first, &*second);
+  }
+  EXPECT_EQ(pool.getAllocationCount(), 2u);
+  eikonal.setWaterTempAmb(Eikonal::Temperature::cMaximum);    // The workspaces follow the Eikonal.
+  RungeKuttaRayBending fresh(para, eikonal);
+  EXPECT_EQ(pool.borrow()->mSolver.solve4x(start, dir, 1000.0).mValue, fresh.solve4x(start, dir, 1000.0).mValue);
+  EXPECT_EQ(pool.getAllocationCount(), 2u);
+}
+
+TEST(tileScheduler, eachTileOnce) {
+  uint32_t const tileCount = 1000u;
+  std::vector<std::atomic<uint32_t>> visits(tileCount);
+  WorkerPool workers(8u);
+  TileScheduler scheduler(workers, tileCount);
+  scheduler.run([&visits](uint32_t const aThread, uint32_t const aTile) {
+    ++visits[aTile];
+    if(aThread == 0u) {                                        // Let the others steal from the slow thread.
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    else {} // nothing to do
+  });
+  for(auto const &visit : visits) {
+    EXPECT_EQ(visit.load(), 1u);
+  }
+  uint32_t tiles = 0u;
+  uint32_t steals = 0u;
+  for(auto const &stats : scheduler.getStats()) {
+    tiles += stats.mTiles;
+    steals += stats.mSteals;
+  }
+  EXPECT_EQ(tiles, tileCount);
+  EXPECT_GT(steals, 0u);
+  EXPECT_LT(scheduler.getStats()[0u].mTiles, tileCount / 8u);
+}
+
+TEST(tileScheduler, inOrderEachTileOnce) {
+  uint32_t const tileCount = 1000u;
+  std::vector<std::atomic<uint32_t>> visits(tileCount);
+  WorkerPool workers(8u);
+  TileScheduler scheduler(workers, tileCount);
+  std::vector<std::vector<uint32_t>> order(workers.getThreadCount());
+  scheduler.runInOrder([&visits, &order](uint32_t const aThread, uint32_t const aTile) {
+    ++visits[aTile];
+    order[aThread].push_back(aTile);
+  });
+  for(auto const &visit : visits) {
+    EXPECT_EQ(visit.load(), 1u);
+  }
+  uint32_t tiles = 0u;
+  for(auto const &stats : scheduler.getStats()) {
+    tiles += stats.mTiles;
+  }
+  EXPECT_EQ(tiles, tileCount);
+  for(auto const &tilesOfThread : order) {
+    EXPECT_TRUE(std::is_sorted(tilesOfThread.begin(), tilesOfThread.end()));   // Each thread goes from the top.
+  }
+}
+
+TEST(pngRowWriter, readsBackRows) {
+  std::string name = "pngRowWriterTest.png";
+  uint32_t const width = 7u;
+  uint32_t const height = 5u;
+  std::vector<PngRowWriter::Color> palette;
+  for(uint32_t i = 0u; i < 256u; ++i) {                        // Gray, so the indices read back as gray.
+    palette.push_back(PngRowWriter::Color{static_cast<uint8_t>(i), static_cast<uint8_t>(i), static_cast<uint8_t>(i)});
+  }
+  {
+    PngRowWriter writer(name.c_str(), width, height, palette);
+    std::vector<uint8_t> row(width);
+    for(uint32_t y = 0u; y < height; ++y) {
+      for(uint32_t x = 0u; x < width; ++x) {
+        row[x] = static_cast<uint8_t>(x * 30u + y * 3u);
+      }
+      writer.write(row.data());
+      EXPECT_EQ(writer.getRowsWritten(), y + 1u);
+    }
+    EXPECT_THROW(writer.write(row.data()), std::runtime_error);
+  }
+  png::image<png::gray_pixel> image(name);
+  ASSERT_EQ(image.get_width(), width);
+  ASSERT_EQ(image.get_height(), height);
+  for(uint32_t y = 0u; y < height; ++y) {
+    for(uint32_t x = 0u; x < width; ++x) {
+      EXPECT_EQ(image.get_pixel(x, y), x * 30u + y * 3u);
+    }
+  }
+  std::remove(name.c_str());
+  EXPECT_THROW(PngRowWriter("noSuchDirectory/pngRowWriterTest.png", width, height, palette), std::runtime_error);
+}
+
+TEST(workerPool, keepsThreadsBetweenRuns) {
+  WorkerPool workers(4u);
+  std::vector<std::thread::id> first(workers.getThreadCount());
+  std::vector<std::thread::id> second(workers.getThreadCount());
+  workers.run([&first](uint32_t const aThread) { first[aThread] = std::this_thread::get_id(); });
+  workers.run([&second](uint32_t const aThread) { second[aThread] = std::this_thread::get_id(); });
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(first[0u], std::this_thread::get_id());
+  for(uint32_t i = 1u; i < first.size(); ++i) {
+    EXPECT_NE(first[i], first[0u]);
+  }
+  EXPECT_THROW(workers.run([](uint32_t const aThread) {
+    if(aThread == 0u) {
+      throw std::runtime_error("job");
+    }
+    else {} // nothing to do
+  }), std::runtime_error);
+  EXPECT_THROW(workers.run([](uint32_t const aThread) {
+    if(aThread == 2u) {
+      throw std::out_of_range("job");
+    }
+    else {} // nothing to do
+  }), std::out_of_range);
+  workers.run([&second](uint32_t const aThread) { second[aThread] = std::this_thread::get_id(); });
+  EXPECT_EQ(first, second);
+}
+
+TEST(trajectoryFile, mapsWhatWasWritten) {
+  std::vector<double> xs = {0.0, 10.0, 20.0};
+  std::vector<double> ys = {1.1, 1.05, 0.98};
+  double const *columns[2u] = {xs.data(), ys.data()};
+  std::string name = "trajectoryFileTest.bin";
+  ASSERT_TRUE(TrajectoryFile::write(name, 2u, xs.size(), columns));
+  auto mapped = TrajectoryFile::map(name);
+  ASSERT_TRUE(mapped);
+  EXPECT_EQ(mapped->getColumnCount(), 2u);
+  EXPECT_EQ(mapped->getRowCount(), xs.size());
+  for(uint32_t i = 0u; i < xs.size(); ++i) {
+    EXPECT_EQ(mapped->getColumn(0u)[i], xs[i]);
+    EXPECT_EQ(mapped->getColumn(1u)[i], ys[i]);
+  }
+  mapped.reset();
+  std::remove(name.c_str());
+  EXPECT_FALSE(TrajectoryFile::map(name));
+}
+
+TEST(texture, cacheFollowsSource) {
+  std::string name = "textureTest.png";
+  std::string cacheName = name + ".texture";
+  auto writePng = [&name](uint32_t const aWidth, uint32_t const aHeight) {
+    png::image<png::gray_pixel> image(aWidth, aHeight);
+    for(uint32_t y = 0u; y < aHeight; ++y) {
+      for(uint32_t x = 0u; x < aWidth; ++x) {
+        image.set_pixel(x, y, static_cast<png::gray_pixel>(x * 7u + y * 3u));
+      }
+    }
+    image.write(name);
+  };
+  auto patchCache = [&cacheName](uint8_t const aValue) {   // The first pixel, to tell a mapped cache from a decoded PNG.
+    std::FILE *file = std::fopen(cacheName.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    std::fseek(file, Texture::csAlignment, SEEK_SET);
+    std::fputc(aValue, file);
+    std::fclose(file);
+  };
+  std::remove(cacheName.c_str());
+  writePng(10u, 5u);
+
+  auto decoded = Texture::load(name, true);
+  EXPECT_EQ(decoded->getWidth(), 10u);
+  EXPECT_EQ(decoded->getHeight(), 5u);
+  EXPECT_EQ(decoded->getPixel(3u, 2u), 27u);
+  patchCache(99u);
+  auto mapped = Texture::load(name, true);
+  EXPECT_EQ(mapped->getPixel(0u, 0u), 99u);
+  for(uint32_t y = 0u; y < 5u; ++y) {
+    for(uint32_t x = (y == 0u ? 1u : 0u); x < 10u; ++x) {
+      EXPECT_EQ(mapped->getPixel(x, y), decoded->getPixel(x, y));
+    }
+  }
+  mapped->buildMipLevels();
+  EXPECT_EQ(mapped->getMipLevelCount(), 5u);                    // 10x5, 5x3, 3x2, 2x1, 1x1
+  EXPECT_EQ(mapped->getTexel(0u, 3, 2), 27.0);                  // The picture itself.
+  EXPECT_EQ(mapped->getTexel(0u, 10, 0), 0.0);
+  EXPECT_DOUBLE_EQ(mapped->getTexel(1u, 1, 1), (decoded->getPixel(2u, 2u) + decoded->getPixel(3u, 2u) + decoded->getPixel(2u, 3u) + decoded->getPixel(3u, 3u)) / 4.0);
+  EXPECT_DOUBLE_EQ(mapped->getTexel(1u, 4, 2), (decoded->getPixel(8u, 4u) + decoded->getPixel(9u, 4u)) / 2.0);   // The last row is repeated.
+  mapped.reset();
+
+  struct timespec const times[2] = {{0, UTIME_OMIT}, {1234567890, 0}};
+  ASSERT_EQ(::utimensat(AT_FDCWD, name.c_str(), times, 0), 0);
+  EXPECT_EQ(Texture::load(name, true)->getPixel(0u, 0u), 0u);  // Other modification time, the cache was rewritten.
+  patchCache(99u);
+  writePng(40u, 5u);                                            // A few bytes longer PNG.
+  ASSERT_EQ(::utimensat(AT_FDCWD, name.c_str(), times, 0), 0);  // Same time, other size.
+  auto resized = Texture::load(name, true);
+  EXPECT_EQ(resized->getWidth(), 40u);
+  EXPECT_EQ(resized->getPixel(0u, 0u), 0u);
+  resized.reset();
+
+  ASSERT_EQ(::truncate(cacheName.c_str(), Texture::csAlignment + 10u), 0);
+  auto fromTruncated = Texture::load(name, true);
+  EXPECT_EQ(fromTruncated->getWidth(), 40u);
+  EXPECT_EQ(fromTruncated->getPixel(39u, 4u), 29u);
+  fromTruncated.reset();
+  std::remove(name.c_str());
+  std::remove(cacheName.c_str());
+}
+
+TEST(refractionProfile, water) {
+  Eikonal exact(Eikonal::EarthForm::cFlat, 6371000.0, Eikonal::Model::cWater, 10.0, 8.0, 14.0, 13.0);
+  Eikonal profile(exact);
+  double const tolerance = 1e-12;
+  profile.useProfile(tolerance);
+  ASSERT_TRUE(profile.getProfile() != nullptr);
+  EXPECT_LE(profile.getProfile()->getErrorRefract(), tolerance);
+  EXPECT_LE(profile.getProfile()->getErrorDiff(), tolerance);
+  for(auto which : { Eikonal::Temperature::cAmbient, Eikonal::Temperature::cMinimum }) {
+    exact.setWaterTempAmb(which);
+    profile.setWaterTempAmb(which);
+    for(double h = 0.0; h < 10.0; h += 0.0123) {
+      EXPECT_TRUE(eq(exact.getRefract(h), profile.getRefract(h), 2.0 * tolerance));
+      EXPECT_TRUE(eq(exact.getRefractDiff(h), profile.getRefractDiff(h), 2.0 * tolerance));
+    }
+  }
+}
+
 /*TEST(shepardInterpolation, level0_dim1_data0) {
   using ShepIntpol = ShepardInterpolation<float, 1u, int, 4>;
   std::vector<ShepIntpol::Data> data;
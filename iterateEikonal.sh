@@ -1,7 +1,8 @@
 #!/bin/bash
 if [[ "$#" -lt 4 ]]; then
-  echo "Usage: bash iterateEikonal.sh <start> <diff> <count> <parameterToIterate> [rest of params to be passed to main]"
-  echo "parameterToIterate <actual value> will be appended."
+  echo "Usage: bash iterateEikonal.sh <start> <diff> <count> <parameterToIterate> [rest of params to be passed to eikonal]"
+  echo "parameterToIterate is the option name like --tempAmb. The ones in eikonal --help of --sweepParameter"
+  echo "are swept in one process, any other is given to one eikonal run per value."
   echo "Output goes into iterated.txt."
   exit
 fi
@@ -14,6 +15,12 @@ shift
 shift
 shift
 shift
+case ${p#--} in
+  camCenter|dist|tempAmb|tempBase)
+    ./eikonal --sweepParameter ${p#--} --sweepStart $t --sweepStep $d --sweepCount $n $*
+    exit
+    ;;
+esac
 echo $p direction >iterated.txt
 while [[ $i -lt $n ]]; do
   echo ./eikonal $p $t $*
@@ -1,7 +1,8 @@
 #!/bin/bash
 if [[ "$#" -lt 4 ]]; then
   echo "Usage: bash iterateMain.sh <start> <diff> <count> <parameterToIterate> [rest of params to be passed to main]"
-  echo "parameterToIterate <actual value> will be appended."
+  echo "parameterToIterate is the option name like --tempAmb. The ones in main --help of --sweepParameter"
+  echo "are swept in one process, any other is given to one main run per value."
   echo "Do not specify output name, it will be series<n>.png"
   exit
 fi
@@ -14,6 +15,12 @@ shift
 shift
 shift
 shift
+case ${p#--} in
+  adaptive|borderFactor|bullLift|camCenter|dist|height|markIndent|tempAmb|tempAmbMin|tempAmbMax|tempBase|tilt)
+    ./main --sweepParameter ${p#--} --sweepStart $t --sweepStep $d --sweepCount $n $*
+    exit
+    ;;
+esac
 while [[ $i -lt $n ]]; do
   i=$((i+1))
   echo Iteration $i of $n
@@ -1,14 +1,22 @@
 #include "simpleRaytracer.h"
 #include "CLI11.hpp"
+#include <cstdio>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <stdexcept>
 #include <thread>
 
+double constexpr cgProgressiveRelax = 4.0;   // Tolerance factor of each progressive pass relative to the next one.
+
 
 int main(int aArgc, char **aArgv) {
   RungeKuttaRayBending::Parameters paraRk;
   Image::Parameters                paraIm;
 
   CLI::App opt{"Usage"};
+  paraIm.mAdaptiveThreshold = 0.0;
+  opt.add_option("--adaptive", paraIm.mAdaptiveThreshold, "subsample pixels adaptively up to subsample^2 rays until the standard error is below this, 0 for the fixed grid (gray levels) [0.0]");
   std::string nameBase = "water";
   opt.add_option("--base", nameBase, "base type (conventional / porous / water) [water]");
   paraIm.mBorderFactor = 0.05;
@@ -17,12 +25,16 @@ int main(int aArgc, char **aArgv) {
   opt.add_option("--bullLift", bullLift, "lift of bulletin from ground (m) [0.0]");
   paraIm.mCamCenter = 1.1;
   opt.add_option("--camCenter", paraIm.mCamCenter, "height of camera center (m) [1.1]");
+  std::string nameController = "Standard";
+  opt.add_option("--controller", nameController, "error controller for native steppers (Standard / ProportionalIntegral) [Standard]");
   double dist = 1000.0;
   opt.add_option("--dist", dist, "distance of bulletin and camera [1000]");
   std::string nameForm = "round";
   opt.add_option("--earthForm", nameForm, "Earth form (flat / round) [round]");
   double rawRadius = 6371.0;
   opt.add_option("--earthRadius", rawRadius, "Earth radius (km) [6371.0]");
+  paraIm.mTextureFilter = false;
+  opt.add_option("--filter", paraIm.mTextureFilter, "filter the bulletin texture over the footprint of each ray from a mip pyramid, not with adaptive (true, false) [false]");
   double height = 9.0;
   opt.add_option("--height", height, "height of bulletin (m) [9.0]  its width will be calculated");
   paraIm.mMarkAcross = false;
@@ -39,10 +51,18 @@ int main(int aArgc, char **aArgv) {
   opt.add_option("--nameOut", nameOut, "output filename [result.png]");
   std::string nameSurf = "";
   opt.add_option("--nameSurf", nameSurf, "surface filename, no rendering if empty []");
+  paraRk.mPlanar = false;
+  opt.add_option("--planar", paraRk.mPlanar, "integrate rays in their vertical plane with 4 variables (true, false) [false]");
+  double profileTolerance = 0.0;
+  opt.add_option("--profileTolerance", profileTolerance, "use tabulated refraction profile with this error limit, 0 for exact calculation (-) [0.0]");
+  uint32_t progressive = 0u;
+  opt.add_option("--progressive", progressive, "render this many passes into nameOut, each one before the last with half the resolution of the next, one ray per pixel and 4 times looser tolerances, 0 for a single pass (count) [0]");
+  paraIm.mRayMapTolerance = 0.0;
+  opt.add_option("--rayMapTolerance", paraIm.mRayMapTolerance, "interpolate hits from a ray map with this error limit on the bulletin, 0 to integrate each ray (m) [0.0]");
   paraIm.mResolutionX = 1000u;
   opt.add_option("--resolution", paraIm.mResolutionX, "film resulution in X direction (pixel) [1000]");
-  paraIm.mRestrictCpu = 0u;
-  opt.add_option("--saveCpus", paraIm.mRestrictCpu, "amount of CPUs to save to keep the system responsive (natural integer) [0]");
+  uint32_t restrictCpu = 0u;
+  opt.add_option("--saveCpus", restrictCpu, "amount of CPUs to save to keep the system responsive (natural integer) [0]");
   bool silent = true;
   opt.add_option("--silent", silent, "surpress parameter echo (true, false) [true]");
   paraRk.mStep1 = 0.01;
@@ -52,9 +72,17 @@ int main(int aArgc, char **aArgv) {
   paraRk.mStepMax = 55.5;
   opt.add_option("--stepMax", paraRk.mStepMax, "maximal step size (m) [55.5]");
   std::string nameStepper = "RungeKuttaFehlberg45";
-  opt.add_option("--stepper", nameStepper, "stepper type (RungeKutta23 / RungeKuttaClass4 / RungeKuttaFehlberg45 / RungeKuttaCashKarp45 / RungeKuttaPrinceDormand89 / BulirschStoerBaderDeuflhard) [RungeKuttaFehlberg45]");
+  opt.add_option("--stepper", nameStepper, "stepper type (RungeKutta23 / RungeKuttaClass4 / RungeKuttaFehlberg45 / RungeKuttaCashKarp45 / RungeKuttaPrinceDormand89 / BulirschStoerBaderDeuflhard / NativeFehlberg45 / NativeCashKarp45 / NativeDormandPrince45) [RungeKuttaFehlberg45]");
   paraIm.mSubsample = 2u;
   opt.add_option("--subsample", paraIm.mSubsample, "subsampling each pixel in both directions (count) [2]");
+  uint32_t sweepCount = 0u;
+  opt.add_option("--sweepCount", sweepCount, "render this many frames into series<n>.png in one process, 0 for a single image into nameOut (count) [0]");
+  std::string sweepParameter = "tempAmb";
+  opt.add_option("--sweepParameter", sweepParameter, "option to sweep (adaptive / borderFactor / bullLift / camCenter / dist / height / markIndent / tempAmb / tempAmbMin / tempAmbMax / tempBase / tilt), others with iterateMain.sh [tempAmb]");
+  double sweepStart = 0.0;
+  opt.add_option("--sweepStart", sweepStart, "value of the swept option in the first frame [0.0]");
+  double sweepStep = 0.0;
+  opt.add_option("--sweepStep", sweepStep, "change of the swept option between frames [0.0]");
   double tempAmb = std::nan("");
   opt.add_option("--tempAmb", tempAmb, "ambient temperature (Celsius) [20 for conventional, 38.5 for porous, 10 for water]");
   double tempAmbMin = std::nan("");
@@ -63,6 +91,8 @@ int main(int aArgc, char **aArgv) {
   opt.add_option("--tempAmbMax", tempAmbMax, "maximum ambient temperature for limit calculation (Celsius) [TODO for conventional, TODO for porous, tempBase+1 for water]");
   double tempBase = 13.0;
   opt.add_option("--tempBase", tempBase, "base temperature, only for water (Celsius) [13]");
+  bool textureCache = false;
+  opt.add_option("--textureCache", textureCache, "keep the decoded input in nameIn.texture and map it in later runs (true, false) [false]");
   paraIm.mTilt = 0.0;
   opt.add_option("--tilt", paraIm.mTilt, "camera tilt, neg downwards (degrees) [0.0]");
   paraRk.mTolAbs = 0.001;
@@ -118,41 +148,117 @@ int main(int aArgc, char **aArgv) {
   else if(nameStepper == "BulirschStoerBaderDeuflhard") {
     paraRk.mStepper = StepperType::cBulirschStoerBaderDeuflhard;
   }
+  else if(nameStepper == "NativeFehlberg45") {
+    paraRk.mStepper = StepperType::cNativeFehlberg45;
+  }
+  else if(nameStepper == "NativeCashKarp45") {
+    paraRk.mStepper = StepperType::cNativeCashKarp45;
+  }
+  else if(nameStepper == "NativeDormandPrince45") {
+    paraRk.mStepper = StepperType::cNativeDormandPrince45;
+  }
   else {
     std::cerr << "Illegal stepper value: " << nameStepper << '\n';
     return 1;
   }
 
-  if(std::isnan(tempAmb)) {
-    tempAmb = (base == Eikonal::Model::cConventional ? 20.0 :
-              (base == Eikonal::Model::cPorous ? 38.5 : 10.0));
+  if(nameController == "Standard") {
+    paraRk.mController = ErrorController::cStandard;
   }
-  else {} // nothing to do
-
-  if(std::isnan(tempAmbMin)) {
-    tempAmbMin = tempBase - 5.0;
+  else if(nameController == "ProportionalIntegral") {
+    paraRk.mController = ErrorController::cProportionalIntegral;
+  }
+  else {
+    std::cerr << "Illegal controller value: " << nameController << '\n';
+    return 1;
   }
-  else {} // nothing to do
 
-  if(std::isnan(tempAmbMax)) {
-    tempAmbMax = tempBase + 1.0;
+  // Options which only affect the Image are changed between frames, temperatures are changed in the Medium,
+  // the rest needs a new Object and Medium.
+  std::map<std::string, double*> const sweepable = {
+    {"adaptive", &paraIm.mAdaptiveThreshold}, {"borderFactor", &paraIm.mBorderFactor}, {"bullLift", &bullLift}, {"camCenter", &paraIm.mCamCenter},
+    {"dist", &dist}, {"height", &height}, {"markIndent", &paraIm.mMarkIndent}, {"tempAmb", &tempAmb}, {"tempAmbMin", &tempAmbMin},
+    {"tempAmbMax", &tempAmbMax}, {"tempBase", &tempBase}, {"tilt", &paraIm.mTilt}};
+  double *sweepValue = nullptr;
+  if(sweepCount > 0u) {
+    auto found = sweepable.find(sweepParameter);
+    if(found == sweepable.end()) {
+      std::cerr << "Illegal sweep parameter value: " << sweepParameter << '\n';
+      return 1;
+    }
+    else {
+      sweepValue = found->second;
+    }
   }
   else {} // nothing to do
-
-  if(tempAmb < tempAmbMin || tempAmb > tempAmbMax || tempBase < tempAmbMin || tempBase > tempAmbMax) {
-    std::cerr << "TempAmb and tempBase must be between tempAmbMin and tempAmbMax.\n";
+  if(sweepCount > 0u && progressive > 1u) {
+    std::cerr << "Progressive passes are not possible in sweeps.\n";
     return 1;
   }
   else {} // nothing to do
+  bool const sweepGeometry = (sweepValue == &dist || sweepValue == &bullLift || sweepValue == &height);
+  bool const deriveTempAmb = std::isnan(tempAmb);
+  bool const deriveTempAmbMin = std::isnan(tempAmbMin);
+  bool const deriveTempAmbMax = std::isnan(tempAmbMax);
+
+  // Sets the swept value of the frame and recalculates the temperatures depending on it. Returns
+  // false if the options of the frame are not compatible.
+  auto prepareFrame = [&](uint32_t const aFrame) {
+    if(sweepValue != nullptr) {
+      *sweepValue = sweepStart + aFrame * sweepStep;
+    }
+    else {} // nothing to do
+
+    if(deriveTempAmb && sweepValue != &tempAmb) {
+      tempAmb = (base == Eikonal::Model::cConventional ? 20.0 :
+                (base == Eikonal::Model::cPorous ? 38.5 : 10.0));
+    }
+    else {} // nothing to do
+
+    if(deriveTempAmbMin && sweepValue != &tempAmbMin) {
+      tempAmbMin = tempBase - 5.0;
+    }
+    else {} // nothing to do
+
+    if(deriveTempAmbMax && sweepValue != &tempAmbMax) {
+      tempAmbMax = tempBase + 1.0;
+    }
+    else {} // nothing to do
+
+    bool valid = !(tempAmb < tempAmbMin || tempAmb > tempAmbMax || tempBase < tempAmbMin || tempBase > tempAmbMax);
+    if(!valid) {
+      std::cerr << "TempAmb and tempBase must be between tempAmbMin and tempAmbMax.\n";
+    }
+    else if(paraIm.mTextureFilter && paraIm.mAdaptiveThreshold > 0.0) {
+      std::cerr << "Texture filter is not possible with adaptive subsampling.\n";
+      valid = false;
+    }
+    else {} // nothing to do
+    return valid;
+  };
+
+  uint32_t const frameCount = std::max(sweepCount, 1u);
+  for(uint32_t frame = 0u; frame < frameCount; ++frame) {   // All frames are checked before anything is written.
+    if(!prepareFrame(frame)) {
+      return 1;
+    }
+    else {} // nothing to do
+  }
+  prepareFrame(0u);
+  uint32_t nCpus = std::thread::hardware_concurrency();
+  nCpus -= (nCpus <= restrictCpu ? nCpus - 1u : restrictCpu);
 
   if(!silent) {
+    std::cout << "adaptive subsampling threshold (gray levels):      " << paraIm.mAdaptiveThreshold << '\n';
     std::cout << "base type:                                         " << nameBase << ' ' << static_cast<int>(base) << '\n';
     std::cout << "border factor:                                     " << paraIm.mBorderFactor << '\n';
     std::cout << "lift of bulletin from ground (m): .  .  .  .  .  . " << bullLift << '\n';
     std::cout << "height of camera center (m):                       " << paraIm.mCamCenter << '\n';
+    std::cout << "error controller for native steppers:              " << nameController << ' ' << static_cast<int>(paraRk.mController) << '\n';
     std::cout << "distance of bulletin and camera (m):               " << dist << '\n';
     std::cout << "Earth form:                          .  .  .  .  . " << nameForm << ' ' << static_cast<int>(earthForm) << '\n';
     std::cout << "Earth radius (km):                                 " << earthRadius / 1000.0 << '\n';
+    std::cout << "filter bulletin texture:                           " << paraIm.mTextureFilter << '\n';
     std::cout << "height of bulletin (m):                            " << height << '\n';
     std::cout << "draw mark across the image: .  .  .  .  .  .  .  . " << paraIm.mMarkAcross << '\n';
     std::cout << "mark indent:                                       " << paraIm.mMarkIndent << '\n';
@@ -161,31 +267,121 @@ int main(int aArgc, char **aArgv) {
     std::cout << "input filename:                                    " << nameIn << '\n';
     std::cout << "output filename:   .  .  .  .  .  .  .  .  .  .  . " << nameOut << '\n';
     std::cout << "surface filename:                                  " << nameSurf << '\n';
+    std::cout << "integrate rays in their vertical plane:            " << paraRk.mPlanar << '\n';
+    std::cout << "refraction profile tolerance:                      " << profileTolerance << '\n';
+    std::cout << "progressive passes:                                " << progressive << '\n';
+    std::cout << "ray map tolerance (m):                             " << paraIm.mRayMapTolerance << '\n';
     std::cout << "film resolution in X direction (pixel):            " << paraIm.mResolutionX << '\n';
     std::cout << "initial step size (m):                             " << paraRk.mStep1 << '\n';
     std::cout << "minimal step size (m):   .  .  .  .  .  .  .  .  . " << paraRk.mStepMin << '\n';
     std::cout << "maximal step size (m):                             " << paraRk.mStepMax << '\n';
     std::cout << "stepper type:                                      " << nameStepper << ' ' << static_cast<int>(paraRk.mStepper) << '\n';
     std::cout << "subsampling each pixel in both directions (count): " << paraIm.mSubsample << '\n';
+    std::cout << "sweep frame count:                                 " << sweepCount << '\n';
+    std::cout << "swept option:    .  .  .  .  .  .  .  .  .  .  .  . " << sweepParameter << '\n';
+    std::cout << "swept option value in the first frame:             " << sweepStart << '\n';
+    std::cout << "swept option change between frames:                " << sweepStep << '\n';
     std::cout << "ambient temperature (Celsius):                     " << tempAmb << '\n';
     std::cout << "minimum ambient temperature (Celsius):  .  .  .  . " << tempAmbMin << '\n';
     std::cout << "maximum ambient temperature (Celsius):             " << tempAmbMax << '\n';
     std::cout << "base temperature, only for water (Celsius):        " << tempBase << '\n';
+    std::cout << "use texture cache file:                            " << textureCache << '\n';
     std::cout << "camera tilt, neg downwards (degrees):      .  .  . " << paraIm.mTilt << '\n';
     std::cout << "absolute tolerance (m):                            " << paraRk.mTolAbs << '\n';
     std::cout << "relative tolerance (m):                            " << paraRk.mTolRel << '\n';
-    uint32_t nCpus = std::thread::hardware_concurrency();
-    nCpus -= (nCpus <= paraIm.mRestrictCpu ? nCpus - 1u : paraIm.mRestrictCpu);
     std::cout << "Using " << nCpus << " thread(s)" << std::endl;
   }
   else {} // nothing to do
 
-  paraRk.mDistAlongRay    = dist * 2.0;
-  auto effectiveRadius = (earthForm == Eikonal::EarthForm::cFlat ? std::numeric_limits<double>::infinity() : earthRadius);
+  auto picture = Texture::load(nameIn, textureCache);   // Once for all frames.
+  WorkerPool workers(nCpus);                            // Also kept between frames.
+  std::optional<Object> object;
+  std::optional<Medium> medium;                   // Kept between frames with its solver workspaces.
+  auto createMedium = [&](std::optional<Medium> &aMedium, RungeKuttaRayBending::Parameters const &aParameters) {
+    aMedium.emplace(aParameters, earthForm, earthRadius, base, tempAmb, tempAmbMin, tempAmbMax, tempBase, *object);
+    if(profileTolerance > 0.0) {
+      aMedium->useRefractionProfile(profileTolerance);
+    }
+    else {} // nothing to do
+  };
+  try {                                                 // The object may not be visible in some frame.
+    for(uint32_t frame = 0u; frame < frameCount; ++frame) {
+      if(frame > 0u) {
+        prepareFrame(frame);
+      }
+      else {} // nothing to do
 
-  Object object(nameIn.c_str(), dist, bullLift, height, effectiveRadius);
-  Medium medium(paraRk, earthForm, earthRadius, base, tempAmb, tempAmbMin, tempAmbMax, tempBase, object);
-  Image image(paraIm, medium);
-  image.process(nameSurf.c_str(), nameOut.c_str());
+      if(!medium || sweepGeometry) {
+        paraRk.mDistAlongRay    = dist * 2.0;
+        auto effectiveRadius = (earthForm == Eikonal::EarthForm::cFlat ? std::numeric_limits<double>::infinity() : earthRadius);
+        medium.reset();
+        object.emplace(picture, dist, bullLift, height, effectiveRadius);
+        createMedium(medium, paraRk);
+      }
+      else {
+        medium->setTemperatures(tempAmb, tempAmbMin, tempAmbMax, tempBase);
+      }
+
+      std::string name = nameOut;
+      if(sweepCount > 0u) {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "series%03u.png", frame + 1u);
+        name = buffer;
+        if(!silent) {
+          std::cout << "Frame " << frame + 1u << " of " << sweepCount << ": " << sweepParameter << " = " << *sweepValue << std::endl;
+        }
+        else {} // nothing to do
+      }
+      else {} // nothing to do
+
+      // Passes before the last one render a preview with a separate Medium of looser tolerances,
+      // and seed the angle limit search of the next pass.
+      uint32_t const passCount = std::max(progressive, 1u);
+      Image::LimitSeeds seeds;
+      for(uint32_t pass = 1u; pass <= passCount; ++pass) {
+        auto const coarsening = passCount - pass;
+        auto paraPass = paraIm;
+        std::optional<Medium> preview;
+        if(coarsening > 0u) {
+          auto paraPreview = paraRk;
+          paraPreview.mTolAbs *= std::pow(cgProgressiveRelax, coarsening);
+          paraPreview.mTolRel *= std::pow(cgProgressiveRelax, coarsening);
+          createMedium(preview, paraPreview);
+          paraPass.mResolutionX = std::max(paraIm.mResolutionX >> coarsening, 2u);
+          paraPass.mSubsample = 1u;
+          paraPass.mAdaptiveThreshold = 0.0;
+        }
+        else {} // nothing to do
+        if(!silent && passCount > 1u) {
+          std::cout << "Pass " << pass << " of " << passCount << ": resolution " << paraPass.mResolutionX << std::endl;
+        }
+        else {} // nothing to do
+
+        Medium &passMedium = (preview ? *preview : *medium);
+        Image image(paraPass, passMedium, workers);
+        image.setLimitSeeds(seeds);
+        image.process(nameSurf.c_str(), name.c_str());
+        seeds = image.getLimitSeeds();
+        if(!silent) {
+          std::cout << "solver workspaces allocated: " << image.getSolverAllocations() << std::endl;
+          std::cout << "mirage rays: " << image.getMirageRays() << std::endl;
+          auto const &tileStats = image.getTileStats();
+          for(uint32_t i = 0u; i < tileStats.size(); ++i) {
+            std::cout << "thread " << i << ": tiles " << tileStats[i].mTiles << " steals " << tileStats[i].mSteals << " finished " << std::setprecision(3) << tileStats[i].mFinished << " s" << std::endl;
+          }
+          std::cout << "thread finish imbalance: " << std::setprecision(3) << image.getTileImbalance() * 100.0 << " %" << std::endl;
+        }
+        else {} // nothing to do
+        if(!silent && passMedium.getRayMap() != nullptr) {
+          std::cout << "ray map samples: " << passMedium.getRayMap()->getSampleCount() << " cells: " << passMedium.getRayMap()->getNodeCount() << std::endl;
+        }
+        else {} // nothing to do
+      }
+    }
+  }
+  catch(std::runtime_error &e) {
+    std::cerr << e.what() << '\n';
+    return 1;
+  }
   return 0;
 }
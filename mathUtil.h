@@ -2,7 +2,9 @@
 #define MATHUTIL_H
 
 #include "Eigen/Dense"
+#include <algorithm>
 #include <functional>
+#include <stdexcept>
 #include <vector>
 #include <array>
 
@@ -53,11 +55,89 @@ public:
 
   double eval(double const aX) const { return eval(normalize(aX, 0u), 0u); }
 
+  // Like eval(std::vector), with the variable count and the degrees fixed at compile time, which
+  // must match the construction. Nested Horner without the scratch members, so it does not
+  // allocate and may be called from many threads at once.
+  template <uint32_t... tDegrees>
+  double eval(std::array<double, sizeof...(tDegrees)> const& aVariables) const {
+    checkDegrees<tDegrees...>();
+    std::array<double, sizeof...(tDegrees)> normalized;
+    for(uint32_t v = 0u; v < sizeof...(tDegrees); ++v) {
+      normalized[v] = normalize(aVariables[v], v);
+    }
+    return evalHorner<sizeof...(tDegrees) - 1u, tDegrees...>(normalized.data(), mCoefficients.data());
+  }
+
+  // Evaluates aCount points into aResults like above. aVariables holds the variables one after
+  // the other, each for all the points, so the loop over the points vectorises.
+  template <uint32_t... tDegrees>
+  void eval(double const * const aVariables, uint32_t const aCount, double * const aResults) const {
+    constexpr uint32_t cVariableCount = sizeof...(tDegrees);
+    checkDegrees<tDegrees...>();
+    std::array<double, cVariableCount> factors;                     // normalize as start + factor * x
+    std::array<double, cVariableCount> starts;
+    for(uint32_t v = 0u; v < cVariableCount; ++v) {
+      factors[v] = mSpanFactor / mSpanOriginals[v];
+      starts[v]  = mSpanStart - factors[v] * mXmins[v];
+    }
+    auto const coefficients = mCoefficients.data();
+#pragma omp simd
+    for(uint32_t i = 0u; i < aCount; ++i) {
+      double normalized[cVariableCount];
+      for(uint32_t v = 0u; v < cVariableCount; ++v) {
+        normalized[v] = starts[v] + factors[v] * aVariables[v * aCount + i];
+      }
+      aResults[i] = evalHorner<cVariableCount - 1u, tDegrees...>(normalized, coefficients);
+    }
+  }
+
 private:
   double normalize(double const aX, uint32_t const aIndex) const { return mSpanStart + mSpanFactor * (aX - mXmins[aIndex]) / mSpanOriginals[aIndex]; }
 
   double eval(double const aX, uint32_t const aOffset) const;
 
+  template <uint32_t... tDegrees>
+  void checkDegrees() const {
+    std::array<uint32_t, sizeof...(tDegrees)> const degrees = {tDegrees...};
+    if(degrees.size() != mVariableCount || !std::equal(degrees.begin(), degrees.end(), mDegrees.begin())) {
+      throw std::invalid_argument("eval: variable count or degree mismatch.");
+    }
+    else {} // nothing to do
+  }
+
+  // Count of coefficients belonging to one exponent of aVariable, as the lower variables vary faster.
+  template <uint32_t tVariable, uint32_t... tDegrees>
+  static constexpr uint32_t getStride() {
+    constexpr uint32_t cDegrees[] = {tDegrees...};
+    uint32_t result = 1u;
+    for(uint32_t v = 0u; v < tVariable; ++v) {
+      result *= cDegrees[v] + 1u;
+    }
+    return result;
+  }
+
+  // Horner in aNormalized[tVariable] over the polynomials of the lower variables.
+  template <uint32_t tVariable, uint32_t... tDegrees>
+  static double evalHorner(double const * const aNormalized, double const * const aCoefficients) {
+    constexpr uint32_t cDegrees[] = {tDegrees...};
+    constexpr uint32_t cDegree = cDegrees[tVariable];
+    constexpr uint32_t cStride = getStride<tVariable, tDegrees...>();
+    double result;
+    if constexpr(tVariable == 0u) {
+      result = aCoefficients[cDegree];
+      for(uint32_t i = cDegree; i > 0u; --i) {
+        result = result * aNormalized[0u] + aCoefficients[i - 1u];
+      }
+    }
+    else {
+      result = evalHorner<tVariable - 1u, tDegrees...>(aNormalized, aCoefficients + cDegree * cStride);
+      for(uint32_t i = cDegree; i > 0u; --i) {
+        result = result * aNormalized[tVariable] + evalHorner<tVariable - 1u, tDegrees...>(aNormalized, aCoefficients + (i - 1u) * cStride);
+      }
+    }
+    return result;
+  }
+
   // based on Table 1 of Condition number of Vandermonde matrix in least-squares polynomial fitting problems
   static constexpr double getXspan(double const aDegree) { // Optimal for big sample counts
     return 1.90313131 + aDegree * (-0.23114312 + aDegree * (0.02573205 - aDegree * 0.00098032));
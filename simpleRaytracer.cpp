@@ -1,16 +1,22 @@
 #include "simpleRaytracer.h"
+#include <algorithm>
+#include <deque>
+#include <exception>
 #include <iomanip>
 #include <iostream>
-#include <thread>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 
 
-Object::Object(char const * const aName, double const aDispX, double const aLiftY, double const aHeight, double const aEarthRadius)
-  : mImage(aName)
-  , mDy(aHeight / mImage.get_height())
+Object::Object(std::shared_ptr<Texture const> const &aTexture, double const aDispX, double const aLiftY, double const aHeight, double const aEarthRadius)
+  : mTexture(aTexture)
+  , mDy(aHeight / mTexture->getHeight())
   , mDz(mDy)
   , mMinY(aLiftY)
   , mMaxY(aLiftY + aHeight)
-  , mMinZ(-static_cast<double>(mImage.get_width()) * aHeight / static_cast<double>(mImage.get_height()) / 2.0)
+  , mMinZ(-static_cast<double>(mTexture->getWidth()) * aHeight / static_cast<double>(mTexture->getHeight()) / 2.0)
   , mMaxZ(-mMinZ)
   , mX(aDispX) {
   double shift = (std::isinf(aEarthRadius) ? 0.0 : std::sqrt(aEarthRadius * aEarthRadius - mX * mX) - aEarthRadius);
@@ -25,9 +31,9 @@ bool Object::hasPixel(Vertex const &aHit) const {
 uint8_t Object::getPixel(Vertex const &aHit) const {
   uint8_t result = 0u;
   int32_t x = static_cast<int32_t>(::round((aHit(2) - mMinZ) / mDz));
-  int32_t y = static_cast<int32_t>(::round(mImage.get_height() - (aHit(1) - mMinY) / mDy - 1u));
-  if(x >= 0 && y >= 0 && x < mImage.get_width() && y < mImage.get_height()) {
-    result = mImage.get_pixel(x, y);
+  int32_t y = static_cast<int32_t>(::round(mTexture->getHeight() - (aHit(1) - mMinY) / mDy - 1u));
+  if(x >= 0 && y >= 0 && x < static_cast<int32_t>(mTexture->getWidth()) && y < static_cast<int32_t>(mTexture->getHeight())) {
+    result = mTexture->getPixel(x, y);
 //std::cout << "h " << aHit(2) << ' ' << aHit(1) << "  /  " << x << ' ' << y << "  -  " << result << '\n';
   }
   else {
@@ -36,10 +42,38 @@ uint8_t Object::getPixel(Vertex const &aHit) const {
   return result;
 }
 
+// Pixel coordinates as in getPixel, the level is chosen so the footprint covers about one texel.
+double Object::getFiltered(Vertex const &aHit, double const aFootprint) const {
+  auto x = (aHit(2) - mMinZ) / mDz;
+  auto y = mTexture->getHeight() - (aHit(1) - mMinY) / mDy - 1.0;
+  auto lod = std::max(0.0, std::min(std::log2(std::max(aFootprint / mDy, 1.0)) + csLodBias, mTexture->getMipLevelCount() - 1.0));
+  auto level = static_cast<uint32_t>(lod);
+  auto weight = lod - level;
+  auto result = getBilinear(level, x, y);
+  if(weight > 0.0 && level + 1u < mTexture->getMipLevelCount()) {
+    result += weight * (getBilinear(level + 1u, x, y) - result);
+  }
+  else {} // nothing to do
+  return result;
+}
+
+// The texel u of level k is centered on pixel 2^k u + (2^k - 1) / 2.
+double Object::getBilinear(uint32_t const aLevel, double const aX, double const aY) const {
+  auto size = static_cast<double>(1u << aLevel);
+  auto u = (aX - (size - 1.0) / 2.0) / size;
+  auto v = (aY - (size - 1.0) / 2.0) / size;
+  auto u0 = static_cast<int32_t>(std::floor(u));
+  auto v0 = static_cast<int32_t>(std::floor(v));
+  auto fu = u - u0;
+  auto fv = v - v0;
+  return (1.0 - fv) * ((1.0 - fu) * mTexture->getTexel(aLevel, u0, v0)     + fu * mTexture->getTexel(aLevel, u0 + 1, v0)) +
+                fv  * ((1.0 - fu) * mTexture->getTexel(aLevel, u0, v0 + 1) + fu * mTexture->getTexel(aLevel, u0 + 1, v0 + 1));
+}
+
 
 uint8_t Medium::trace(Ray const& aRay) {
   try {
-    auto hit = mSolver.solve4x(aRay.mStart, aRay.mDirection, mObject.getX());
+    auto hit = getHit(aRay);
     if(hit.mValid) {
       return mObject.getPixel(hit.mValue);
     }
@@ -54,9 +88,80 @@ std::cout << aRay.mStart(0) << ' ' << aRay.mStart(1) << ' ' << aRay.mStart(2) <<
   }
 }
 
+// The consecutive samples belong to the same or neighbouring cells, so the chunks stay coherent.
+void Medium::buildRayMap(WorkerPool &aWorkers, Vertex const &aStart, RayMapTable::Range const &aRange, double const aTolerance) {
+  mRayMap.reset();
+  std::vector<std::unique_ptr<SolverPool::Lease>> leases(aWorkers.getThreadCount());   // Borrowed on first use by each thread.
+  mRayMap = std::make_shared<RayMapTable const>(aStart, aRange, aTolerance, [this, &aWorkers, &leases](Ray const * const aRays, uint32_t const aCount, RungeKuttaRayBending::Result * const aResults) {
+    TileScheduler scheduler(aWorkers, (aCount + csRayMapChunk - 1u) / csRayMapChunk);
+    scheduler.run([this, aRays, aCount, aResults, &leases](uint32_t const aThread, uint32_t const aTile) {
+      auto &lease = leases[aThread];
+      if(!lease) {
+        lease.reset(new SolverPool::Lease(mSolvers.borrow()));
+      }
+      else {} // nothing to do
+      auto begin = aTile * csRayMapChunk;
+      solveBatch(**lease, aRays + begin, std::min(csRayMapChunk, aCount - begin), aResults + begin);
+    });
+  });
+}
+
+void Medium::traceBatch(Ray const * const aRays, uint32_t const aCount, uint8_t * const aColors, RungeKuttaRayBending::Result * const aHits) {
+  auto workspace = mSolvers.borrow();
+  auto &rays = workspace->mBatchRays;
+  auto &indices = workspace->mBatchIndices;
+  auto &results = workspace->mBatchResults;
+  rays.clear();
+  indices.clear();
+  for(uint32_t i = 0u; i < aCount; ++i) {
+    auto mapped = lookup(aRays[i]);
+    if(mapped) {
+      aColors[i] = (mapped->mValid ? mObject.getPixel(mapped->mValue) : 0u);
+      if(aHits != nullptr) {
+        aHits[i] = *mapped;
+      }
+      else {} // nothing to do
+    }
+    else {
+      rays.push_back(aRays[i]);
+      indices.push_back(i);
+    }
+  }
+  results.resize(rays.size());
+  solveBatch(*workspace, rays.data(), rays.size(), results.data());
+  for(uint32_t i = 0u; i < rays.size(); ++i) {
+    aColors[indices[i]] = (results[i].mValid ? mObject.getPixel(results[i].mValue) : 0u);
+    if(aHits != nullptr) {
+      aHits[indices[i]] = results[i];
+    }
+    else {} // nothing to do
+  }
+}
+
+void Medium::solveBatch(SolverPool::Workspace &aWorkspace, Ray const * const aRays, uint32_t const aCount, RungeKuttaRayBending::Result * const aResults) {
+  if(aWorkspace.mBatchSolver.isSupported()) {
+    aWorkspace.mBatchSolver.solve4x(aRays, aCount, mObject.getX(), aResults);
+  }
+  else {
+    for(uint32_t i = 0u; i < aCount; ++i) {
+      aResults[i] = aWorkspace.mSolver.solve4x(aRays[i].mStart, aRays[i].mDirection, mObject.getX());
+    }
+  }
+}
+
 bool Medium::hits(Ray const& aRay) {
+  double height;
+  return hits(aRay, height);
+}
+
+bool Medium::hits(Ray const& aRay, double &aHeight) {
+  aHeight = std::nan("");
   try {
-    auto hit = mSolver.solve4x(aRay.mStart, aRay.mDirection, mObject.getX());
+    auto hit = getHit(aRay);
+    if(hit.mValid) {
+      aHeight = hit.mValue(1);
+    }
+    else {} // nothing to do
     return hit.mValid && mObject.hasPixel(hit.mValue);
   }
   catch(...) {
@@ -67,9 +172,9 @@ std::cout << aRay.mStart(0) << ' ' << aRay.mStart(1) << ' ' << aRay.mStart(2) <<
 }
 
 
-Image::Image(Parameters const& aPara, Medium &aMedium)
-  : mRestrictCpu(aPara.mRestrictCpu)
-  , mPalette(256)
+Image::Image(Parameters const& aPara, Medium &aMedium, WorkerPool &aWorkers)
+  : mWorkers(aWorkers)
+  , mPalette(256u, PngRowWriter::Color{0u, 0u, 0u})
   , mResolutionX(aPara.mResolutionX)
   , mBorderFactor(aPara.mBorderFactor)
   , mSubSample(aPara.mSubsample)
@@ -83,96 +188,194 @@ Image::Image(Parameters const& aPara, Medium &aMedium)
   , mMarkIndent(std::max(0.0, std::min(1.0, aPara.mMarkIndent)))
   , mMarkAcross(aPara.mMarkAcross)
   , mMarkTriple(aPara.mMarkTriple)
+  , mRayMapTolerance(aPara.mRayMapTolerance)
+  , mAdaptiveThreshold(aPara.mAdaptiveThreshold)
+  , mTextureFilter(aPara.mTextureFilter)
   , mMedium(aMedium) {
-  mPalette[csColorMirror] = png::color(255u, 0u, 0u);
-  mPalette[csColorBase] = png::color(0u, 255u, 0u);
+  mPalette[csColorMirror] = PngRowWriter::Color{255u, 0u, 0u};
+  mPalette[csColorBase] = PngRowWriter::Color{0u, 255u, 0u};
   for(uint32_t i = csColorBlack; i < mPalette.size(); ++i) {
-    mPalette[i] = png::color(i, i, i);
+    mPalette[i] = PngRowWriter::Color{static_cast<uint8_t>(i), static_cast<uint8_t>(i), static_cast<uint8_t>(i)};
   }
-  mImage.set_palette(mPalette);
+  if(mTextureFilter) {
+    mMedium.buildTextureFilter();
+  }
+  else {} // nothing to do
 }
 
 void Image::process(char const * const aNameSurf, char const * const aNameOut) {
-  calculateAngleLimits(Eikonal::Temperature::cAmbient);
-  calculateAngleLimits(Eikonal::Temperature::cBase);
-  calculateAngleLimits(Eikonal::Temperature::cMinimum);
-  calculateAngleLimits(Eikonal::Temperature::cMaximum);
-  calculateBiases(*aNameSurf != 0);
-  mLimitAngleTop.reset();
-  mLimitAngleBottom.reset();
-  calculateAngleLimits(Eikonal::Temperature::cAmbient);
-  mLimitPixelTop        = calculatePixelLimitY(*mLimitAngleTop);
-  mLimitPixelBottom     = calculatePixelLimitY(*mLimitAngleBottom) + 1;
-  mLimitAngleTop.reset();
-  mLimitAngleBottom.reset();
-  calculateAngleLimits(Eikonal::Temperature::cBase);
-  mLimitPixelBaseTop        = calculatePixelLimitY(*mLimitAngleTop);
-  mLimitPixelBaseBottom     = calculatePixelLimitY(*mLimitAngleBottom);
-  mLimitPixelBaseBottomSurf = calculatePixelLimitY(mLimitAngleBottomSurf);
-  calculateAngleLimits(Eikonal::Temperature::cMinimum);
-  calculateAngleLimits(Eikonal::Temperature::cMaximum);
-  calculateAngleLimits(Eikonal::Temperature::cAmbient);
-  mLimitPixelDeep       = calculatePixelLimitZ(*mLimitAngleDeep);
-  mLimitPixelShallow    = calculatePixelLimitZ(*mLimitAngleShallow);
-  if(*aNameSurf != 0) {
-    renderSurface(aNameSurf);
+  auto allocationsBefore = mMedium.getSolverAllocationCount();
+  std::array<AngleLimits, 4u> limits;                     // Each temperature once, ambient last to render with it.
+  for(auto const which : {Eikonal::Temperature::cBase, Eikonal::Temperature::cMinimum, Eikonal::Temperature::cMaximum, Eikonal::Temperature::cAmbient}) {
+    limits[static_cast<uint32_t>(which)] = calculateAngleLimits(which);
   }
-  else {} // nothing to do
-  int mirrorHeight = calculateMirrorHeight();
-  calculateMirage();
-  drawMarks(mirrorHeight);
-  mImage.write(aNameOut);
+  auto const &ambient = limits[static_cast<uint32_t>(Eikonal::Temperature::cAmbient)];
+  auto const &base    = limits[static_cast<uint32_t>(Eikonal::Temperature::cBase)];
+  AngleLimits all = ambient;
+  for(auto const &one : limits) {
+    all.mTop    = std::max(all.mTop, one.mTop);
+    all.mBottom = std::min(all.mBottom, one.mBottom);
+    all.mDeep   = std::min(all.mDeep, one.mDeep);
+  }
+  calculateBiases(*aNameSurf != 0, all);
+  mLimitPixelTop            = calculatePixelLimitY(ambient.mTop);
+  mLimitPixelBottom         = calculatePixelLimitY(ambient.mBottom) + 1;
+  mLimitPixelBaseTop        = calculatePixelLimitY(base.mTop);
+  mLimitPixelBaseBottom     = calculatePixelLimitY(base.mBottom);
+  mLimitPixelBaseBottomSurf = calculatePixelLimitY(mLimitAngleBottomSurf);
+  mLimitPixelDeep           = calculatePixelLimitZ(all.mDeep);
+  mLimitPixelShallow        = calculatePixelLimitZ(all.getShallow());
+  buildSurfaceTable(aNameSurf);
+  mMirrorHeight = calculateMirrorHeight();
+  PngRowWriter writer(aNameOut, mResolutionX, mResolutionY, mPalette);
+  calculateMirage(writer);
+  mSolverAllocations = mMedium.getSolverAllocationCount() - allocationsBefore;
 }
 
-void Image::calculateAngleLimits(Eikonal::Temperature const aWhich) {
+// The elevations csLimitLow - csLimitDelta + k * csLimitDelta are first checked with a stride of
+// csLimitCoarse, and the fine grid is only evaluated in the coarse intervals around a change of
+// hit or miss. A band may also hide in a coarse interval where the rays start or stop ending in
+// the surface, where their height at the object passes the object, or around a turn of that
+// height, like at the fold of a mirage, where a band can be arbitrarily narrow. These intervals
+// are refined too. The transitions found are then located by bisection in parallel. Seeds from a
+// previous pass only add the coarse intervals holding them to the refined ones, so a pass finds
+// at least the transitions it would find without them.
+Image::AngleLimits Image::calculateAngleLimits(Eikonal::Temperature const aWhich) {
   mMedium.setWaterTempAmb(aWhich);
-  Ray ray;
-  ray.mStart = mPinhole;
-  ray.mDirection = getDirectionInXy(csLimitLow - csLimitDelta);
-  auto lastHit = mMedium.hits(ray);
-  bool was = false;
-  double limitAnglePrev;
-  for(auto angle = csLimitLow; angle <= csLimitHigh; angle += csLimitDelta) {
-    ray.mDirection = getDirectionInXy(angle);
-    auto thisHit = mMedium.hits(ray);
-    if(lastHit != thisHit) {
-      auto critical = binarySearch(angle - csLimitDelta, angle, csLimitEpsilon, [this, &ray](auto const search){
-        ray.mDirection = getDirectionInXy(search);
-        return mMedium.hits(ray);
-      });
-      critical += (thisHit ? csLimitEpsilon : 0.0);
-      limitAnglePrev = mLimitAngleTop.value_or(0.0);
-      auto tmp = critical * csLimitAngleBoost;
-      mLimitAngleTop = (mLimitAngleTop ? std::max(*mLimitAngleTop, tmp) : tmp);
-      if(!was) {
-        mLimitAngleBottom = (mLimitAngleBottom ? std::min(*mLimitAngleBottom, tmp) : tmp);
-        was = true;
+  auto const epsilon = std::min(csLimitDelta / 2.0, std::max(csLimitEpsilon, mMedium.getAngularTolerance()));
+  int const fineCount = static_cast<int>(std::floor((csLimitHigh - csLimitLow) / csLimitDelta)) + 2;
+  auto getAngle = [](int const aIndex) { return csLimitLow + (aIndex - 1) * csLimitDelta; };
+  auto hitsInXy = [this](double const aAngle) {
+    Ray ray;
+    ray.mStart = mPinhole;
+    ray.mDirection = getDirectionInXy(aAngle);
+    return mMedium.hits(ray);
+  };
+  std::vector<int8_t> hits(fineCount, -1);                // -1 for not evaluated
+  std::vector<double> heights(fineCount, std::nan(""));   // at the object, NaN for invalid rays
+  auto evaluate = [this, &getAngle, &hits, &heights](std::vector<int> const &aIndices) {
+    TileScheduler scheduler(mWorkers, aIndices.size());
+    scheduler.run([this, &getAngle, &hits, &heights, &aIndices](uint32_t const, uint32_t const aTile) {
+      Ray ray;
+      ray.mStart = mPinhole;
+      ray.mDirection = getDirectionInXy(getAngle(aIndices[aTile]));
+      hits[aIndices[aTile]] = (mMedium.hits(ray, heights[aIndices[aTile]]) ? 1 : 0);
+    });
+  };
+  auto findTransitions = [fineCount, &hits]() {
+    std::vector<int> result;                              // Upper fine index of each changing pair of neighbours.
+    int lastIndex = 0;
+    for(int i = 1; i < fineCount; ++i) {
+      if(hits[i] >= 0) {
+        if(hits[i] != hits[lastIndex] && lastIndex == i - 1) {
+          result.push_back(i);
+        }
+        else {} // nothing to do
+        lastIndex = i;
       }
       else {} // nothing to do
     }
+    return result;
+  };
+
+  auto &seeds = mLimitSeeds[static_cast<uint32_t>(aWhich)];
+  auto scanAll = [this, fineCount, &hits, &heights, &evaluate, &findTransitions, &seeds]() {
+    std::vector<int> coarse;
+    for(int i = 0; i < fineCount; i += csLimitCoarse) {
+      coarse.push_back(i);
+    }
+    if(coarse.back() != fineCount - 1) {
+      coarse.push_back(fineCount - 1);
+    }
     else {} // nothing to do
-    lastHit = thisHit;
+    evaluate(coarse);
+    std::vector<bool> refine(coarse.size() - 1u, false);
+    auto mark = [&refine](uint32_t const aFirst, uint32_t const aLast) {
+      for(uint32_t r = aFirst; r <= std::min<uint32_t>(aLast, refine.size() - 1u); ++r) {
+        refine[r] = true;
+      }
+    };
+    for(uint32_t c = 0u; c + 1u < coarse.size(); ++c) {
+      auto low = heights[coarse[c]];
+      auto high = heights[coarse[c + 1u]];
+      if(hits[coarse[c]] != hits[coarse[c + 1u]]) {
+        mark(c > 0u ? c - 1u : 0u, c + 1u);               // Intervals next to a changing one too, a narrow hit range may hide in them.
+      }
+      else if(std::isnan(low) != std::isnan(high) || (!std::isnan(low) && mMedium.getSideY(low) != mMedium.getSideY(high))) {
+        mark(c, c);
+      }
+      else {} // nothing to do
+      if(c > 0u && (high - low) * (low - heights[coarse[c - 1u]]) < 0.0) {   // false for NaN
+        mark(c - 1u, c);
+      }
+      else {} // nothing to do
+    }
+    for(auto const seed : seeds) {                        // The pair of fine indices seed - 1 and seed.
+      for(int i = std::max(seed - 1, 0); i <= std::min(seed, fineCount - 1); ++i) {
+        refine[std::min<uint32_t>(i / csLimitCoarse, refine.size() - 1u)] = true;
+      }
+    }
+    std::vector<int> fine;
+    for(uint32_t c = 0u; c < refine.size(); ++c) {
+      if(refine[c]) {
+        for(int i = coarse[c] + 1; i < coarse[c + 1u]; ++i) {
+          fine.push_back(i);
+        }
+      }
+      else {} // nothing to do
+    }
+    evaluate(fine);
+    return findTransitions();
+  };
+
+  auto transitions = scanAll();
+  seeds = transitions;
+
+  std::vector<double> criticals(transitions.size());
+  TileScheduler scheduler(mWorkers, transitions.size());
+  scheduler.run([epsilon, &getAngle, &hitsInXy, &hits, &transitions, &criticals](uint32_t const, uint32_t const aTile) {
+    auto index = transitions[aTile];
+    criticals[aTile] = binarySearch(getAngle(index - 1), getAngle(index), epsilon, hitsInXy) + (hits[index] > 0 ? epsilon : 0.0);
+  });
+
+  if(criticals.empty()) {
+    static char const * const cNames[] = {"ambient", "base", "minimum ambient", "maximum ambient"};
+    throw std::runtime_error(std::string("No elevation between ") + std::to_string(csLimitLow * 180.0 / cgPi) + " and " +
+                             std::to_string(csLimitHigh * 180.0 / cgPi) + " degrees hits the object at the " +
+                             cNames[static_cast<uint32_t>(aWhich)] + " temperature.");
   }
-  auto angleY = (limitAnglePrev + *mLimitAngleTop) / 2.0;
+  else {} // nothing to do
+  AngleLimits result;
+  std::optional<double> top;
+  double limitAnglePrev = 0.0;
+  for(auto const critical : criticals) {
+    limitAnglePrev = top.value_or(0.0);
+    auto tmp = critical * csLimitAngleBoost;
+    top = (top ? std::max(*top, tmp) : tmp);
+  }
+  result.mTop = *top;
+  result.mBottom = criticals.front() * csLimitAngleBoost;
+  Ray ray;
+  ray.mStart = mPinhole;
+  auto angleY = (limitAnglePrev + result.mTop) / 2.0;
   ray.mDirection = getDirectionYz(angleY, csLimitLow - csLimitDelta);
-  auto tmp = binarySearch(csLimitLow, 0.0, csLimitEpsilon, [this, &ray, angleY](auto const search){
+  auto tmp = binarySearch(csLimitLow, 0.0, epsilon, [this, &ray, angleY](auto const search){
     ray.mDirection = getDirectionYz(angleY, search);
     return mMedium.hits(ray);
   });
-  tmp *= csLimitAngleBoost;
-  mLimitAngleDeep = (mLimitAngleDeep ? std::min(*mLimitAngleDeep, tmp) : tmp);
-  mLimitAngleShallow = -*mLimitAngleDeep;
+  result.mDeep = tmp * csLimitAngleBoost;
+  return result;
 }
 
-void Image::calculateBiases(bool const aRenderSurface) {
+void Image::calculateBiases(bool const aRenderSurface, AngleLimits const &aLimits) {
   auto film = Plane::createFrom2vectors1point(mInPlaneY, mInPlaneZ, mCenter);
-  auto angleDiff    = *mLimitAngleTop + *mLimitAngleShallow - *mLimitAngleBottom - *mLimitAngleDeep;
+  auto angleDiff    = aLimits.mTop + aLimits.getShallow() - aLimits.mBottom - aLimits.mDeep;
 
-  auto angleTop               = *mLimitAngleTop     + angleDiff * mBorderFactor;
-  auto angleBottom            = *mLimitAngleBottom  - angleDiff * mBorderFactor * (aRenderSurface ? csRenderSurfaceFactor : 1.0);
-       mLimitAngleBottomSurf  = *mLimitAngleBottom  - angleDiff * mBorderFactor * (csRenderSurfaceFactor - 1.0);
-  auto angleDeep              = *mLimitAngleDeep    - angleDiff * mBorderFactor;
-  auto angleShallow           = *mLimitAngleShallow + angleDiff * mBorderFactor;
+  auto angleTop               = aLimits.mTop        + angleDiff * mBorderFactor;
+  auto angleBottom            = aLimits.mBottom     - angleDiff * mBorderFactor * (aRenderSurface ? csRenderSurfaceFactor : 1.0);
+       mLimitAngleBottomSurf  = aLimits.mBottom     - angleDiff * mBorderFactor * (csRenderSurfaceFactor - 1.0);
+  auto angleDeep              = aLimits.mDeep       - angleDiff * mBorderFactor;
+  auto angleShallow           = aLimits.getShallow() + angleDiff * mBorderFactor;
 
   auto limitTop     = film.intersect(mPinhole, -getDirectionInXy(angleTop)).mPoint;
   auto limitBottom  = film.intersect(mPinhole, -getDirectionInXy(angleBottom)).mPoint;
@@ -188,18 +391,16 @@ void Image::calculateBiases(bool const aRenderSurface) {
   mBiasY = (resolutionY - 1.0) * (mCenter - limitBottom).norm() / height;
   mPixelSize = (width / mResolutionX + height / resolutionY) / 2.0;
 
-  mBuffer.reserve(mResolutionX * resolutionY);
-  mBuffer.insert(mBuffer.begin(), mResolutionX * resolutionY, csColorVoid);
-  mImage.resize(mResolutionX, resolutionY);
+  mResolutionY = resolutionY;
 }
 
 int Image::calculatePixelLimitZ(double const aAngle) {
   Ray ray;
   ray.mStart = mPinhole;
-  int y = mImage.get_height() / 2;
+  int y = mResolutionY / 2;
   int result;
   double minDist = std::numeric_limits<double>::max();
-  for(int z = 0; z < mImage.get_width(); ++z) {
+  for(int z = 0; z < static_cast<int>(mResolutionX); ++z) {
     Vertex subpixel = mCenter + mPixelSize * (
       (z - mBiasZ) * mInPlaneZ +
       (y - mBiasY) * mInPlaneY);
@@ -218,10 +419,10 @@ int Image::calculatePixelLimitZ(double const aAngle) {
 int Image::calculatePixelLimitY(double const aAngle) {
   Ray ray;
   ray.mStart = mPinhole;
-  int z = mImage.get_width() / 2;
+  int z = mResolutionX / 2;
   int result;
   double minDist = std::numeric_limits<double>::max();
-  for(int y = 0; y < mImage.get_height(); ++y) {
+  for(int y = 0; y < static_cast<int>(mResolutionY); ++y) {
     Vertex subpixel = mCenter + mPixelSize * (
       (z - mBiasZ) * mInPlaneZ +
       (y - mBiasY) * mInPlaneY);
@@ -240,10 +441,10 @@ int Image::calculatePixelLimitY(double const aAngle) {
 int Image::calculateMirrorHeight() {
   int result = -1;
   double minHit = std::numeric_limits<double>::max();
-  int z = mImage.get_width() / 2;
+  int z = mResolutionX / 2;
   Ray ray;
   ray.mStart = mPinhole;
-  for(int y = 0; y < mImage.get_height(); ++y) {
+  for(int y = 0; y < static_cast<int>(mResolutionY); ++y) {
     Vertex subpixel = mCenter + mPixelSize * (
       (z - mBiasZ) * mInPlaneZ +
       (y - mBiasY) * mInPlaneY);
@@ -258,97 +459,530 @@ int Image::calculateMirrorHeight() {
   return result;
 }
 
-void Image::renderSurface(char const * const aNameSurf) {
-  png::image<png::gray_pixel> surface(aNameSurf);
-  auto ssFactor = 1.0 / csSurfSubsample;
-  auto transform = static_cast<double>(surface.get_width()) / (mLimitPixelShallow - mLimitPixelDeep);
-  for(int y = mLimitPixelBaseBottomSurf; y <= mLimitPixelBottom; ++y) {
+// The table has a zero row and column in front, so entry (u, v) is the sum of the pixels below u
+// and v. The picture is mirrored in both directions to match the orientation of the film.
+void Image::buildSurfaceTable(char const * const aNameSurf) {
+  mSurfaceTable.clear();
+  mSurfaceWidth = 0;
+  mSurfaceHeight = 0;
+  if(*aNameSurf != 0) {
+    png::image<png::gray_pixel> surface(aNameSurf);
+    mSurfaceWidth = static_cast<int>(surface.get_width());
+    mSurfaceHeight = static_cast<int>(surface.get_height());
+    auto const stride = static_cast<size_t>(mSurfaceWidth) + 1u;
+    mSurfaceTable.assign(stride * (mSurfaceHeight + 1u), 0.0);
+    for(int v = 0; v < mSurfaceHeight; ++v) {
+      double rowSum = 0.0;
+      for(int u = 0; u < mSurfaceWidth; ++u) {
+        rowSum += surface.get_pixel(mSurfaceWidth - 1 - u, mSurfaceHeight - 1 - v);
+        mSurfaceTable[(v + 1u) * stride + u + 1u] = mSurfaceTable[v * stride + u + 1u] + rowSum;
+      }
+    }
+  }
+  else {} // nothing to do
+}
+
+// The integral up to a fractional point is the bilinear interpolation of the table, because the
+// pixels are constant inside.
+double Image::getSurfaceIntegral(double const aU0, double const aU1, double const aV0, double const aV1) const {
+  auto const stride = static_cast<size_t>(mSurfaceWidth) + 1u;
+  auto upTo = [this, stride](double const aU, double const aV) {
+    auto u = std::clamp(aU, 0.0, static_cast<double>(mSurfaceWidth));
+    auto v = std::clamp(aV, 0.0, static_cast<double>(mSurfaceHeight));
+    auto u0 = std::min(static_cast<int>(u), mSurfaceWidth - 1);
+    auto v0 = std::min(static_cast<int>(v), mSurfaceHeight - 1);
+    auto fu = u - u0;
+    auto fv = v - v0;
+    auto const *low = mSurfaceTable.data() + v0 * stride + u0;
+    auto const *high = low + stride;
+    return (1.0 - fv) * ((1.0 - fu) * low[0] + fu * low[1]) + fv * ((1.0 - fu) * high[0] + fu * high[1]);
+  };
+  return upTo(aU1, aV1) - upTo(aU0, aV1) - upTo(aU1, aV0) + upTo(aU0, aV0);
+}
+
+// Each pixel is the mean of the surface picture over its footprint, so it costs the same for any
+// size of the picture. Rows are independent, one tile each.
+void Image::renderSurface(int const aYbegin, int const aYend) {
+  auto const transform = static_cast<double>(mSurfaceWidth) / (mLimitPixelShallow - mLimitPixelDeep);
+  auto const area = transform * transform;
+  mSurfaceRowsBottom = aYbegin;
+  mSurfaceRows.assign(static_cast<size_t>(mResolutionX) * std::max(aYend - aYbegin, 0), csColorVoid);
+  TileScheduler scheduler(mWorkers, std::max(aYend - aYbegin, 0));
+  scheduler.run([this, aYbegin, transform, area](uint32_t const, uint32_t const aTile) {
+    auto const y = aYbegin + static_cast<int>(aTile);
+    auto *row = mSurfaceRows.data() + static_cast<size_t>(aTile) * mResolutionX;
+    auto const v0 = (y - mLimitPixelBaseBottomSurf) * transform;
     for(int x = mLimitPixelDeep; x < mLimitPixelShallow - 1; ++x) {
-      double sum = 0.0;
-      for(int i = 0; i < csSurfSubsample; ++i) {
-        for(int j = 0; j < csSurfSubsample; ++j) {
-          auto effectiveX = static_cast<int>((x + i * ssFactor - mLimitPixelDeep) * transform);
-          auto effectiveY = static_cast<int>((y + j * ssFactor - mLimitPixelBaseBottomSurf) * transform);
-          if(effectiveY < surface.get_height()) {
-            sum += surface.get_pixel(surface.get_width() - 1 - effectiveX, surface.get_height() - 1 - effectiveY);
-          }
-          else {} // nothing to do
+      auto const u0 = (x - mLimitPixelDeep) * transform;
+      auto sum = getSurfaceIntegral(u0, u0 + transform, v0, v0 + transform);
+      row[mResolutionX - x - 2] = std::max(csColorBlack, static_cast<uint8_t>(::round(sum / area)));
+    }
+  });
+}
+
+// The range covers the film area of calculateMirage with a small margin.
+void Image::buildRayMap() {
+  RayMapTable::Range range{ std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(),
+                            std::numeric_limits<double>::max(), -std::numeric_limits<double>::max() };
+  for(int i = 0; i < 3; ++i) {
+    for(int j = 0; j < 3; ++j) {
+      auto z = mLimitPixelDeep - 0.5 + i * (mLimitPixelShallow - mLimitPixelDeep) / 2.0;
+      auto y = mLimitPixelBottom - 0.5 + j * (mLimitPixelTop - mLimitPixelBottom) / 2.0;
+      Vertex subpixel = mCenter + mPixelSize * ((z - mBiasZ) * mInPlaneZ + (y - mBiasY) * mInPlaneY);
+      Vector direction = (mPinhole - subpixel).normalized();
+      auto elevation = std::asin(direction(1));
+      auto azimuth = std::atan2(direction(2), direction(0));
+      range.mElevationLow  = std::min(range.mElevationLow, elevation);
+      range.mElevationHigh = std::max(range.mElevationHigh, elevation);
+      range.mAzimuthLow    = std::min(range.mAzimuthLow, azimuth);
+      range.mAzimuthHigh   = std::max(range.mAzimuthHigh, azimuth);
+    }
+  }
+  auto marginElevation = (range.mElevationHigh - range.mElevationLow) * csRayMapMargin;
+  auto marginAzimuth = (range.mAzimuthHigh - range.mAzimuthLow) * csRayMapMargin;
+  range.mElevationLow  -= marginElevation;
+  range.mElevationHigh += marginElevation;
+  range.mAzimuthLow    -= marginAzimuth;
+  range.mAzimuthHigh   += marginAzimuth;
+  mMedium.buildRayMap(mWorkers, mPinhole, range, mRayMapTolerance);
+}
+
+// In fixed mode the tiles are handed out in scanline order from the top in one run, so they finish
+// about in that order. A tile row is kept only until it and all above it are finished, then the
+// thread finishing it writes it, unless an other thread is writing. So only the few tile rows in
+// flight are in memory. The surface rows below the mirage are written after the run, as they are
+// rendered in parallel too. The adaptive mode needs the neighbours of each pixel, so it renders
+// all the mirage before writing.
+void Image::calculateMirage(PngRowWriter &aWriter) {
+  if(mRayMapTolerance > 0.0) {
+    buildRayMap();
+  }
+  else {} // nothing to do
+  auto nCpus = getCpuCount();
+  mTileStats.clear();
+  mTileImbalance = 0.0;
+  mMirageRays = 0u;
+  mRow.resize(mResolutionX);
+  int const columns = std::max(mLimitPixelShallow - mLimitPixelDeep, 0);
+  if(mAdaptiveThreshold > 0.0) {
+    mBufferBottom = mLimitPixelBottom;
+    mBuffer.assign(static_cast<size_t>(columns) * std::max(mLimitPixelTop - mLimitPixelBottom, 0), csColorVoid);
+    calculateMirageAdaptive(nCpus);
+  }
+  else {
+    mBufferBottom = mLimitPixelTop;
+    mBuffer.clear();
+    writeRows(aWriter, mLimitPixelTop);
+    calculateMirageFixed(nCpus, aWriter);
+  }
+  writeRows(aWriter, 0);
+  mBuffer.clear();
+  mBuffer.shrink_to_fit();
+}
+
+void Image::writeRows(PngRowWriter &aWriter, int const aYend) {
+  int const columns = std::max(mLimitPixelShallow - mLimitPixelDeep, 0);
+  int const bufferTop = mBufferBottom + (columns > 0 ? static_cast<int>(mBuffer.size()) / columns : 0);
+  auto const nCpus = getCpuCount();
+  int const surfaceBand = csTileHeight * static_cast<int>(csStreamTilesPerCpu * nCpus);
+  mSurfaceRowsBottom = 0;
+  mSurfaceRows.clear();
+  for(int y = static_cast<int>(mResolutionY - aWriter.getRowsWritten()) - 1; y >= aYend; --y) {
+    if(!mSurfaceTable.empty() && y >= mLimitPixelBaseBottomSurf && y <= mLimitPixelBottom) {
+      if(y < mSurfaceRowsBottom || mSurfaceRows.empty()) {
+        auto bottom = std::max(std::max(y + 1 - surfaceBand, aYend), mLimitPixelBaseBottomSurf);
+        renderSurface(bottom, y + 1);
+      }
+      else {} // nothing to do
+      auto surface = mSurfaceRows.begin() + static_cast<size_t>(y - mSurfaceRowsBottom) * mResolutionX;
+      std::copy(surface, surface + mResolutionX, mRow.begin());
+    }
+    else {
+      std::fill(mRow.begin(), mRow.end(), csColorVoid);
+    }
+    if(y >= mBufferBottom && y < bufferTop) {
+      auto buffer = mBuffer.data() + static_cast<size_t>(y - mBufferBottom) * columns;
+      for(int z = mLimitPixelDeep; z < mLimitPixelShallow; ++z) {
+        auto color = buffer[z - mLimitPixelDeep];
+        if(color != csColorVoid) {
+          mRow[mResolutionX - z - 1] = color;
         }
+        else {} // nothing to do
       }
-      uint8_t color = std::max(csColorBlack, static_cast<uint8_t>(::round(sum / static_cast<double>(csSurfSubsample * csSurfSubsample))));
-      mImage.set_pixel(mImage.get_width() - x - 2, mImage.get_height() - y - 1, color);
     }
+    else {} // nothing to do
+    drawMarks(y);
+    aWriter.write(mRow.data());
   }
 }
 
-void Image::calculateMirage() {
-  uint32_t nCpus = std::thread::hardware_concurrency();
-  nCpus -= (nCpus <= mRestrictCpu ? nCpus - 1u : mRestrictCpu);
-  std::vector<std::thread> threads(nCpus);
-  for (uint32_t i = 0u; i < nCpus; ++i) {
-    threads[i] = std::thread([this, nCpus, i] {
-      Ray ray;
-      ray.mStart = mPinhole;
-      Medium localMedium(mMedium);
-      auto yBegin = mLimitPixelBottom + i * (mLimitPixelTop - mLimitPixelBottom) / nCpus;
-      auto yEnd = mLimitPixelBottom + (i + 1u) * (mLimitPixelTop - mLimitPixelBottom) / nCpus;
+void Image::calculateMirageFixed(uint32_t const aCpus, PngRowWriter &aWriter) {
+  int const columns = std::max(mLimitPixelShallow - mLimitPixelDeep, 0);
+  int const rows = std::max(mLimitPixelTop - mLimitPixelBottom, 0);
+  int const tilesZ = (columns + csTileWidth - 1) / csTileWidth;
+  int const tilesY = (rows + csTileHeight - 1) / csTileHeight;
+  auto getRowBottom = [this](int const aTileRow) { return std::max(mLimitPixelTop - (aTileRow + 1) * csTileHeight, mLimitPixelBottom); };
+  struct TileRow {
+    int                  mRemaining;                      // unfinished tiles
+    std::vector<uint8_t> mColors;                         // like mBuffer from the bottom of the tile row
+  };
+  std::deque<TileRow> pending;                            // Tile rows from firstPending on not written yet.
+  int firstPending = 0;
+  std::mutex progressMutex;
+  std::mutex writeMutex;
+  std::exception_ptr writeError;
+  // Writes the finished tile rows at the front of pending, but not the last mirage row, which may
+  // need the surface. Returns at once if an other thread is writing, which checks pending again after.
+  auto writeReady = [this, &aWriter, &getRowBottom, &pending, &firstPending, &progressMutex, &writeMutex, &writeError]() {
+    auto popFinished = [&pending, &firstPending, &progressMutex](std::vector<uint8_t> &aColors) {
+      std::lock_guard<std::mutex> lock(progressMutex);
+      int result = -1;
+      if(!pending.empty() && pending.front().mRemaining == 0) {
+        aColors = std::move(pending.front().mColors);
+        pending.pop_front();
+        result = firstPending;
+        ++firstPending;
+      }
+      else {} // nothing to do
+      return result;
+    };
+    std::unique_lock<std::mutex> writing(writeMutex, std::try_to_lock);
+    while(writing.owns_lock() && !writeError) {
+      std::vector<uint8_t> colors;
+      auto tileRow = popFinished(colors);
+      if(tileRow >= 0) {
+        mBuffer = std::move(colors);                      // The last one stays for the last mirage row.
+        mBufferBottom = getRowBottom(tileRow);
+        try {
+          writeRows(aWriter, std::max(mBufferBottom, mLimitPixelBottom + 1));
+        }
+        catch(...) {
+          writeError = std::current_exception();          // Rethrown after the run.
+        }
+      }
+      else {
+        writing.unlock();
+        std::lock_guard<std::mutex> lock(progressMutex);
+        if(!pending.empty() && pending.front().mRemaining == 0) {
+          writing.try_lock();
+        }
+        else {} // nothing to do
+      }
+    }
+  };
+  auto subCount = mSubSample * mSubSample;
+  std::vector<std::vector<Ray>> rays(aCpus);              // Per thread, all the rays of a tile are traced at once to keep the batch lanes busy.
+  std::vector<std::vector<uint8_t>> colors(aCpus);
+  std::vector<std::vector<RungeKuttaRayBending::Result>> hits(aCpus);   // Only for the texture filter.
+  std::vector<std::vector<double>> filtered(aCpus);
+  TileScheduler scheduler(mWorkers, tilesZ * tilesY);     // Scanline order of tiles from the top.
+  scheduler.runInOrder([this, columns, tilesZ, subCount, &getRowBottom, &rays, &colors, &hits, &filtered, &pending, &firstPending, &progressMutex, &writeReady]
+                       (uint32_t const aThread, uint32_t const aTile) {
+    auto &tileRays = rays[aThread];
+    auto &tileColors = colors[aThread];
+    auto &tileHits = hits[aThread];
+    auto &tileFiltered = filtered[aThread];
+    auto zBegin = mLimitPixelDeep + static_cast<int>(aTile % tilesZ) * csTileWidth;
+    auto zEnd = std::min(zBegin + csTileWidth, mLimitPixelShallow);
+    auto tileRow = static_cast<int>(aTile / tilesZ);
+    auto yEnd = mLimitPixelTop - tileRow * csTileHeight;
+    auto yBegin = getRowBottom(tileRow);
+    tileRays.clear();
+    for(int y = yBegin; y < yEnd; ++y) {
+      for(int z = zBegin; z < zEnd; ++z) {
+        for(uint32_t i = 0; i < mSubSample; ++i) {
+          for(uint32_t j = 0; j < mSubSample; ++j) {
+            tileRays.push_back(getSubpixelRay(y, z, mSsFactor * (j - mBiasSub), mSsFactor * (i - mBiasSub)));
+          }
+        }
+      }
+    }
+    tileColors.resize(tileRays.size());
+    if(mTextureFilter) {
+      tileHits.resize(tileRays.size());
+      tileFiltered.resize(tileRays.size());
+      mMedium.traceBatch(tileRays.data(), tileRays.size(), tileColors.data(), tileHits.data());
+      filterTile(yEnd - yBegin, zEnd - zBegin, tileHits.data(), tileFiltered.data());
+    }
+    else {
+      mMedium.traceBatch(tileRays.data(), tileRays.size(), tileColors.data());
+    }
+    {
+      std::lock_guard<std::mutex> lock(progressMutex);
+      while(static_cast<int>(pending.size()) <= tileRow - firstPending) {
+        auto bottom = getRowBottom(firstPending + static_cast<int>(pending.size()));
+        auto top = mLimitPixelTop - (firstPending + static_cast<int>(pending.size())) * csTileHeight;
+        pending.push_back(TileRow{tilesZ, std::vector<uint8_t>(static_cast<size_t>(columns) * (top - bottom), csColorVoid)});
+      }
+      auto &row = pending[tileRow - firstPending];
+      uint32_t sample = 0u;
       for(int y = yBegin; y < yEnd; ++y) {
-        for(int z = mLimitPixelDeep; z < mLimitPixelShallow; ++z) {
+        for(int z = zBegin; z < zEnd; ++z) {
           double sum = 0.0;
-          for(uint32_t i = 0; i < mSubSample; ++i) {
-            for(uint32_t j = 0; j < mSubSample; ++j) {
-              Vertex subpixel = mCenter + mPixelSize * (
-                    (z - mBiasZ + mSsFactor * (i - mBiasSub)) * mInPlaneZ +
-                    (y - mBiasY + mSsFactor * (j - mBiasSub)) * mInPlaneY);
-              ray.mDirection = (mPinhole - subpixel).normalized();
-              auto angleY = std::atan(ray.mDirection(1) / ray.mDirection(0));
-              auto angleZ = std::atan(ray.mDirection(2) / ray.mDirection(0));
-              sum += localMedium.trace(ray);
-            }
+          for(uint32_t s = 0u; s < subCount; ++s) {
+            sum += (mTextureFilter ? tileFiltered[sample] : tileColors[sample]);
+            ++sample;
           }
-          uint8_t color;
-          color = std::max(csColorBlack, static_cast<uint8_t>(::round(sum / static_cast<double>(mSubSample * mSubSample))));
-          mBuffer[(mImage.get_width() - z - 1u) + mImage.get_width() * (mImage.get_height() - y - 1u)] = color;
+          row.mColors[static_cast<size_t>(y - yBegin) * columns + (z - mLimitPixelDeep)] = getColor(sum / static_cast<double>(subCount));
         }
       }
-    });
-  }
-  for (auto& t : threads) {
-    t.join();
+      --row.mRemaining;
+    }
+    writeReady();
+  });
+  if(writeError) {
+    std::rethrow_exception(writeError);
   }
-  for(int y = 0; y < mImage.get_height(); ++y) {
-    for(int z = 0; z < mImage.get_width(); ++z) {
-      auto color = mBuffer[y * mImage.get_width() + z];
-      if(color != csColorVoid) {
-        mImage.set_pixel(z, y, color);
+  else {} // nothing to do
+  addTileStats(scheduler);
+  mMirageRays += static_cast<uint64_t>(columns) * rows * subCount;
+}
+
+// The footprint of a ray is the distance of its hit from the hits of the next rays of the
+// subsample grid in both directions, or of the previous ones at the edge of the tile.
+void Image::filterTile(int const aRows, int const aColumns, RungeKuttaRayBending::Result const * const aHits, double * const aColors) const {
+  int const subSample = mSubSample;
+  int const gridRows = aRows * subSample;
+  int const gridColumns = aColumns * subSample;
+  auto getIndex = [subSample, aColumns](int const aRow, int const aColumn) {   // Ray order of calculateMirageFixed
+    return ((aRow / subSample * aColumns + aColumn / subSample) * subSample + aColumn % subSample) * subSample + aRow % subSample;
+  };
+  for(int row = 0; row < gridRows; ++row) {
+    for(int column = 0; column < gridColumns; ++column) {
+      auto const &hit = aHits[getIndex(row, column)];
+      double footprint = 0.0;
+      for(int axis = 0; axis < 2 && hit.mValid; ++axis) {
+        auto neighbourRow = row;
+        auto neighbourColumn = column;
+        if(axis == 0) {
+          neighbourRow = (row + 1 < gridRows ? row + 1 : row - 1);
+        }
+        else {
+          neighbourColumn = (column + 1 < gridColumns ? column + 1 : column - 1);
+        }
+        if(neighbourRow >= 0 && neighbourColumn >= 0) {
+          auto const &neighbour = aHits[getIndex(neighbourRow, neighbourColumn)];
+          if(neighbour.mValid) {
+            footprint = std::max(footprint, std::hypot(hit.mValue(1) - neighbour.mValue(1), hit.mValue(2) - neighbour.mValue(2)));
+          }
+          else {} // nothing to do
+        }
+        else {} // nothing to do
       }
-      else {} // nothing to do
+      aColors[getIndex(row, column)] = mMedium.getFilteredColor(hit, footprint);
     }
   }
 }
 
-void Image::drawMarks(int const aMirrorHeight) {
-  auto dashLength = std::max(static_cast<int>(mImage.get_width() / csDashCount), 2);
-  auto dashLimit  = dashLength / 2;
-  for(int y = (mMarkTriple ? -1 : 0); y < (mMarkTriple ? 2 : 1); ++y)
-  for(int z = 0; z < mImage.get_width(); ++z) {
-    if(mMarkAcross || z < mLimitPixelDeep * mMarkIndent || z > mImage.get_width() - mLimitPixelDeep * mMarkIndent) {
-      auto height = aMirrorHeight + y;
-      if(height >= 0 && height < mImage.get_width() && (z % dashLength < dashLimit)) {
-        mImage.set_pixel(z, mImage.get_height() - 1 - height, csColorMirror);
+// First csAdaptiveRound subsamples of each pixel are traced, spread over the mSubSample grid. A
+// pixel gets more rays in rounds of csAdaptiveRound subsamples only if the standard error of its
+// mean color is above mAdaptiveThreshold, its mean differs from a neighbouring one by more than
+// mAdaptiveThreshold, or the hits of the neighbours around it are not on a nearly straight line,
+// like at the mirror line. A pixel is finished when the standard error falls below the threshold
+// or all the grid is traced, in which case the result is the same as of the fixed grid.
+void Image::calculateMirageAdaptive(uint32_t const aCpus) {
+  int const columns = std::max(mLimitPixelShallow - mLimitPixelDeep, 0);
+  int const rows = std::max(mLimitPixelTop - mLimitPixelBottom, 0);
+  int const tilesZ = (columns + csTileWidth - 1) / csTileWidth;
+  int const tilesY = (rows + csTileHeight - 1) / csTileHeight;
+  uint32_t const subCount = mSubSample * mSubSample;
+  uint32_t const initialCount = std::min(csAdaptiveRound, subCount);
+
+  std::vector<uint32_t> order(subCount);                  // Spreads the subsamples of the first rounds over the pixel.
+  uint32_t stride = static_cast<uint32_t>(std::ceil(subCount * 0.618));
+  while(std::gcd(stride, subCount) != 1u) {
+    ++stride;
+  }
+  for(uint32_t k = 0u; k < subCount; ++k) {
+    order[k] = (k * stride) % subCount;
+  }
+
+  struct Pixel {
+    int      mY;
+    int      mZ;
+    uint32_t mCount;
+    double   mSum;
+    double   mSumSquares;
+    RungeKuttaRayBending::Result mHit;                    // of the first subsample
+  };
+  auto getMean = [](Pixel const &aPixel) { return aPixel.mSum / aPixel.mCount; };
+  auto getVarianceOfMean = [&getMean](Pixel const &aPixel) {
+    auto mean = getMean(aPixel);
+    return aPixel.mCount > 1u ? std::max(0.0, aPixel.mSumSquares / aPixel.mCount - mean * mean) / (aPixel.mCount - 1u) : 0.0;
+  };
+  // Traces the next subsamples of aPixels for one round, and keeps the unfinished ones.
+  auto traceRound = [this, subCount, &order, &getMean, &getVarianceOfMean](std::vector<Pixel> &aPixels, uint32_t const aAdd, std::vector<Ray> &aRays,
+                                                                          std::vector<uint8_t> &aColors, std::vector<RungeKuttaRayBending::Result> &aHits) {
+    aRays.clear();
+    for(auto const &pixel : aPixels) {
+      for(uint32_t k = pixel.mCount; k < std::min(pixel.mCount + aAdd, subCount); ++k) {
+        auto i = order[k] / mSubSample;
+        auto j = order[k] % mSubSample;
+        aRays.push_back(getSubpixelRay(pixel.mY, pixel.mZ, mSsFactor * (j - mBiasSub), mSsFactor * (i - mBiasSub)));
+      }
+    }
+    aColors.resize(aRays.size());
+    aHits.resize(aRays.size());
+    mMedium.traceBatch(aRays.data(), aRays.size(), aColors.data(), aHits.data());
+    uint32_t sample = 0u;
+    for(auto &pixel : aPixels) {
+      auto end = std::min(pixel.mCount + aAdd, subCount);
+      if(pixel.mCount == 0u) {
+        pixel.mHit = aHits[sample];
       }
       else {} // nothing to do
-      height = mLimitPixelBaseTop + y;
-      if(height >= 0 && height < mImage.get_width() && (z % dashLength >= dashLimit)) {
-        mImage.set_pixel(z, mImage.get_height() - 1 - height, csColorBase);
+      for(; pixel.mCount < end; ++pixel.mCount) {
+        pixel.mSum += aColors[sample];
+        pixel.mSumSquares += aColors[sample] * aColors[sample];
+        ++sample;
+      }
+    }
+    return aRays.size();
+  };
+
+  std::vector<Pixel> pixels(static_cast<size_t>(columns) * rows);
+  std::vector<std::vector<Ray>> rays(aCpus);
+  std::vector<std::vector<uint8_t>> colors(aCpus);
+  std::vector<std::vector<RungeKuttaRayBending::Result>> hits(aCpus);
+  std::vector<std::vector<Pixel>> pendings(aCpus);
+  std::vector<uint64_t> rayCounts(aCpus, 0u);
+  auto getIndex = [this, columns](int const aY, int const aZ) { return static_cast<size_t>(aY - mLimitPixelBottom) * columns + (aZ - mLimitPixelDeep); };
+
+  TileScheduler initialScheduler(mWorkers, tilesZ * tilesY);
+  initialScheduler.run([this, tilesZ, initialCount, &getIndex, &traceRound, &pixels, &rays, &colors, &hits, &pendings, &rayCounts](uint32_t const aThread, uint32_t const aTile) {
+    auto &pending = pendings[aThread];
+    auto zBegin = mLimitPixelDeep + static_cast<int>(aTile % tilesZ) * csTileWidth;
+    auto zEnd = std::min(zBegin + csTileWidth, mLimitPixelShallow);
+    auto yBegin = mLimitPixelBottom + static_cast<int>(aTile / tilesZ) * csTileHeight;
+    auto yEnd = std::min(yBegin + csTileHeight, mLimitPixelTop);
+    pending.clear();
+    for(int y = yBegin; y < yEnd; ++y) {
+      for(int z = zBegin; z < zEnd; ++z) {
+        pending.push_back(Pixel{y, z, 0u, 0.0, 0.0, RungeKuttaRayBending::Result{}});
+      }
+    }
+    rayCounts[aThread] += traceRound(pending, initialCount, rays[aThread], colors[aThread], hits[aThread]);
+    for(auto const &pixel : pending) {
+      pixels[getIndex(pixel.mY, pixel.mZ)] = pixel;
+    }
+  });
+  addTileStats(initialScheduler);
+
+  auto needsMore = [this, &getIndex, &getMean, &getVarianceOfMean, &pixels](Pixel const &aPixel) {
+    bool result = getVarianceOfMean(aPixel) > mAdaptiveThreshold * mAdaptiveThreshold;
+    for(int axis = 0; axis < 2 && !result; ++axis) {
+      auto dy = (axis == 0 ? 1 : 0);
+      auto dz = 1 - dy;
+      bool hasPrev = (aPixel.mY - dy >= mLimitPixelBottom && aPixel.mZ - dz >= mLimitPixelDeep);
+      bool hasNext = (aPixel.mY + dy < mLimitPixelTop && aPixel.mZ + dz < mLimitPixelShallow);
+      auto const &prev = (hasPrev ? pixels[getIndex(aPixel.mY - dy, aPixel.mZ - dz)] : aPixel);
+      auto const &next = (hasNext ? pixels[getIndex(aPixel.mY + dy, aPixel.mZ + dz)] : aPixel);
+      result = std::abs(getMean(aPixel) - getMean(prev)) > mAdaptiveThreshold ||
+               std::abs(getMean(aPixel) - getMean(next)) > mAdaptiveThreshold ||
+               aPixel.mHit.mValid != prev.mHit.mValid ||
+               aPixel.mHit.mValid != next.mHit.mValid;
+      if(!result && hasPrev && hasNext && aPixel.mHit.mValid) {
+        Vector before = aPixel.mHit.mValue - prev.mHit.mValue;
+        Vector after = next.mHit.mValue - aPixel.mHit.mValue;
+        result = (after - before).norm() > csAdaptiveDivergence * (before.norm() + after.norm());
       }
       else {} // nothing to do
-      height = mLimitPixelBaseBottom + y;
-      if(height >= 0 && height < mImage.get_width() && (z % dashLength >= dashLimit)) {
-        mImage.set_pixel(z, mImage.get_height() - 1 - height, csColorBase);
+    }
+    return result;
+  };
+
+  TileScheduler refineScheduler(mWorkers, tilesZ * tilesY);
+  refineScheduler.run([this, tilesZ, subCount, &getIndex, &getMean, &getVarianceOfMean, &needsMore, &traceRound, &pixels, &rays, &colors, &hits, &pendings, &rayCounts]
+                      (uint32_t const aThread, uint32_t const aTile) {
+    auto &pending = pendings[aThread];
+    auto zBegin = mLimitPixelDeep + static_cast<int>(aTile % tilesZ) * csTileWidth;
+    auto zEnd = std::min(zBegin + csTileWidth, mLimitPixelShallow);
+    auto yBegin = mLimitPixelBottom + static_cast<int>(aTile / tilesZ) * csTileHeight;
+    auto yEnd = std::min(yBegin + csTileHeight, mLimitPixelTop);
+    pending.clear();
+    for(int y = yBegin; y < yEnd; ++y) {
+      for(int z = zBegin; z < zEnd; ++z) {
+        auto const &pixel = pixels[getIndex(y, z)];
+        if(pixel.mCount < subCount && needsMore(pixel)) {
+          pending.push_back(pixel);
+        }
+        else {
+          setBuffer(y, z, getMean(pixel));
+        }
+      }
+    }
+    while(!pending.empty()) {                             // Rounds over all the unfinished pixels of the tile.
+      rayCounts[aThread] += traceRound(pending, csAdaptiveRound, rays[aThread], colors[aThread], hits[aThread]);
+      uint32_t kept = 0u;
+      for(auto const &pixel : pending) {
+        if(pixel.mCount == subCount || getVarianceOfMean(pixel) <= mAdaptiveThreshold * mAdaptiveThreshold) {
+          setBuffer(pixel.mY, pixel.mZ, getMean(pixel));
+        }
+        else {
+          pending[kept] = pixel;
+          ++kept;
+        }
+      }
+      pending.resize(kept);
+    }
+  });
+  addTileStats(refineScheduler);
+  for(auto const count : rayCounts) {
+    mMirageRays += count;
+  }
+}
+
+uint32_t Image::getCpuCount() const {
+  return mWorkers.getThreadCount();
+}
+
+void Image::addTileStats(TileScheduler const &aScheduler) {
+  auto const &stats = aScheduler.getStats();
+  mTileStats.resize(stats.size(), TileScheduler::ThreadStats{0u, 0u, 0.0});
+  for(uint32_t i = 0u; i < stats.size(); ++i) {
+    mTileStats[i].mTiles    += stats[i].mTiles;
+    mTileStats[i].mSteals   += stats[i].mSteals;
+    mTileStats[i].mFinished += stats[i].mFinished;
+  }
+  mTileImbalance = std::max(mTileImbalance, aScheduler.getImbalance());
+}
+
+Ray Image::getSubpixelRay(int const aY, int const aZ, double const aSubY, double const aSubZ) const {
+  Ray result;
+  Vertex subpixel = mCenter + mPixelSize * (
+        (aZ - mBiasZ + aSubZ) * mInPlaneZ +
+        (aY - mBiasY + aSubY) * mInPlaneY);
+  result.mStart = mPinhole;
+  result.mDirection = (mPinhole - subpixel).normalized();
+  return result;
+}
+
+void Image::setBuffer(int const aY, int const aZ, double const aColor) {
+  auto index = static_cast<size_t>(aY - mBufferBottom) * (mLimitPixelShallow - mLimitPixelDeep) + (aZ - mLimitPixelDeep);
+  mBuffer[index] = getColor(aColor);
+}
+
+// Marks row aY where the lines drawn at the mirror and the base limits cross it. Later lines overwrite earlier ones.
+void Image::drawMarks(int const aY) {
+  int const resolutionX = mResolutionX;
+  auto dashLength = std::max(resolutionX / csDashCount, 2);
+  auto dashLimit  = dashLength / 2;
+  for(int y = (mMarkTriple ? -1 : 0); y < (mMarkTriple ? 2 : 1); ++y) {
+    bool mirror     = (aY == mMirrorHeight + y && aY < resolutionX);
+    bool baseTop    = (aY == mLimitPixelBaseTop + y && aY < resolutionX);
+    bool baseBottom = (aY == mLimitPixelBaseBottom + y && aY < resolutionX);
+    for(int z = 0; z < resolutionX && (mirror || baseTop || baseBottom); ++z) {
+      if(mMarkAcross || z < mLimitPixelDeep * mMarkIndent || z > resolutionX - mLimitPixelDeep * mMarkIndent) {
+        if(mirror && (z % dashLength < dashLimit)) {
+          mRow[z] = csColorMirror;
+        }
+        else {} // nothing to do
+        if((baseTop || baseBottom) && (z % dashLength >= dashLimit)) {
+          mRow[z] = csColorBase;
+        }
+        else {} // nothing to do
       }
       else {} // nothing to do
     }
-    else {} // nothing to do
   }
 }
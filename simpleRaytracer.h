@@ -4,14 +4,24 @@
 //#define __FreeBSD__ 12 // Hack to let png++ compile under cygwin
 
 #include "RungeKuttaRayBending.h"
+#include "BatchRayBending.h"
+#include "RayMapTable.h"
+#include "SolverPool.h"
+#include "TileScheduler.h"
+#include "PngRowWriter.h"
+#include "Texture.h"
 #include "3dGeomUtil.h"
 #include "png.hpp"
+#include <array>
+#include <memory>
 #include <optional>
 
 
 class Object final {
 private:
-  png::image<png::gray_pixel> mImage;
+  static constexpr double csLodBias = -0.5;     // The bilinear tent of a level is wider than the box of the footprint.
+
+  std::shared_ptr<Texture const> mTexture;
   double const mDy;
   double const mDz;
   double       mMinY;
@@ -21,44 +31,105 @@ private:
   double const mX;
 
 public:
-  Object(char const * const aName, double const aDispX, double const aLiftY, double const aHeight, double const aEarthRadius);
+  Object(char const * const aName, double const aDispX, double const aLiftY, double const aHeight, double const aEarthRadius)
+  : Object(Texture::load(aName, false), aDispX, aLiftY, aHeight, aEarthRadius) {}
+  // For sweeps, which load the picture only once.
+  Object(std::shared_ptr<Texture const> const &aTexture, double const aDispX, double const aLiftY, double const aHeight, double const aEarthRadius);
   double  getX() const { return mX; }
   bool    hasPixel(Vertex const &aHit) const;
+  // -1 below, 1 above the object or 0 in its height range.
+  int     getSideY(double const aY) const { return aY <= mMinY ? -1 : (aY >= mMaxY ? 1 : 0); }
   uint8_t getPixel(Vertex const &aHit) const;
+  // Needed before getFiltered. The pyramid is kept by the texture, so Objects sharing it build it once.
+  void    buildMipLevels() const { mTexture->buildMipLevels(); }
+  // Trilinear lookup in the mip pyramid averaging over about aFootprint meters around aHit.
+  double  getFiltered(Vertex const &aHit, double const aFootprint) const;
+
+private:
+  double getBilinear(uint32_t const aLevel, double const aX, double const aY) const;
 };
 
 
+// Tracing is thread safe, each call borrows its solver from mSolvers.
+// The medium itself must not be changed while tracing.
 class Medium final {
 private:
+  static constexpr uint32_t csRayMapChunk = 64u;   // rays of a tile of the ray map build
+
   Eikonal              mEikonal;
-  RungeKuttaRayBending mSolver;
+  SolverPool           mSolvers;
   Object const&        mObject;
+  std::shared_ptr<RayMapTable const> mRayMap;
 
 public:
   Medium(RungeKuttaRayBending::Parameters const& aParameters,
          Eikonal::EarthForm const aEarthForm, double const aEarthRadius, Eikonal::Model const aModel,
          double const aTempAmbient, double const tempAmbMin, double const tempAmbMax, double const aTempBase, Object const& aObject)
   : mEikonal(aEarthForm, aEarthRadius, aModel, aTempAmbient, tempAmbMin, tempAmbMax, aTempBase)
-  , mSolver(aParameters, mEikonal)
+  , mSolvers(aParameters, mEikonal)
   , mObject(aObject) {}
 
-  Medium(Medium const&) = default;
+  Medium(Medium const&) = delete;
   Medium(Medium &&) = delete;
   Medium& operator=(Medium const&) = delete;
   Medium& operator=(Medium &&) = delete;
 
-  void setWaterTempAmb(Eikonal::Temperature const aWhich) { mEikonal.setWaterTempAmb(aWhich); }
+  void setWaterTempAmb(Eikonal::Temperature const aWhich) {
+    mEikonal.setWaterTempAmb(aWhich);
+    mRayMap.reset();
+  }
+
+  void setTemperatures(double const aTempAmbient, double const aTempAmbMin, double const aTempAmbMax, double const aTempBase) {
+    mEikonal.setTemperatures(aTempAmbient, aTempAmbMin, aTempAmbMax, aTempBase);
+    mRayMap.reset();
+  }
+
+  void useRefractionProfile(double const aTolerance) {
+    mEikonal.useProfile(aTolerance);
+    mRayMap.reset();
+  }
+
+  // Afterwards rays from aStart in aRange are answered by interpolation as long as the medium does not change.
+  // The samples of each level are integrated in parallel on aWorkers.
+  void buildRayMap(WorkerPool &aWorkers, Vertex const &aStart, RayMapTable::Range const &aRange, double const aTolerance);
+  RayMapTable const* getRayMap() const { return mRayMap.get(); }
+
   uint8_t trace(Ray const& aRay);
+  // Traces aCount rays into aColors and, if given, their hits into aHits. Uses the batch solver for native steppers, trace() otherwise.
+  void traceBatch(Ray const * const aRays, uint32_t const aCount, uint8_t * const aColors, RungeKuttaRayBending::Result * const aHits = nullptr);
   bool hits(Ray const& aRay);
-  RungeKuttaRayBending::Result getHit(Ray const& aRay) { return mSolver.solve4x(aRay.mStart, aRay.mDirection, mObject.getX()); }
-  double getRefract(double const aH) const { return mSolver.getRefract(aH); }
+  // Gives also the height of the ray at the object in aHeight, NaN if the ray is invalid there.
+  bool hits(Ray const& aRay, double &aHeight);
+  int getSideY(double const aY) const { return mObject.getSideY(aY); }
+  RungeKuttaRayBending::Result getHit(Ray const& aRay) {
+    auto mapped = lookup(aRay);
+    return mapped ? *mapped : mSolvers.borrow()->mSolver.solve4x(aRay.mStart, aRay.mDirection, mObject.getX());
+  }
+  double getRefract(double const aH) const { return mEikonal.getRefract(aH); }
+  // Needed before getFilteredColor.
+  void buildTextureFilter() const { mObject.buildMipLevels(); }
+  // Color of the object around a hit of traceBatch with a footprint in meters there.
+  double getFilteredColor(RungeKuttaRayBending::Result const &aHit, double const aFootprint) const {
+    return aHit.mValid ? mObject.getFiltered(aHit.mValue, aFootprint) : 0.0;
+  }
+  // Change of ray angle corresponding to the absolute ODE tolerance at the object.
+  double getAngularTolerance() { return mSolvers.getParameters().mTolAbs / mObject.getX(); }
+
+  // Count of solver workspaces constructed so far, stays constant once all threads have one.
+  uint32_t getSolverAllocationCount() { return mSolvers.getAllocationCount(); }
+
+private:
+  std::optional<RungeKuttaRayBending::Result> lookup(Ray const& aRay) const {
+    return mRayMap && aRay.mStart == mRayMap->getStart() ? mRayMap->lookup(aRay.mDirection) : std::nullopt;
+  }
+
+  void solveBatch(SolverPool::Workspace &aWorkspace, Ray const * const aRays, uint32_t const aCount, RungeKuttaRayBending::Result * const aResults);
 };
 
 
 class Image final {
 public:
   struct Parameters {
-    uint32_t mRestrictCpu;
     double   mCamCenter;
     double   mTilt;
     double   mBorderFactor;
@@ -67,30 +138,52 @@ public:
     double   mMarkIndent;
     bool     mMarkAcross;
     bool     mMarkTriple;
+    double   mRayMapTolerance;    // 0 to integrate each ray.
+    double   mAdaptiveThreshold;  // Gray levels, 0 for the fixed mSubsample grid.
+    bool     mTextureFilter;      // Filters the object texture over the footprint of each ray, only for the fixed grid.
   };
 
+  // Fine elevation indices of the hit / miss transitions found for each Eikonal::Temperature.
+  using LimitSeeds = std::array<std::vector<int>, 4u>;
+
 private:
   static constexpr double   csLimitHigh           =  cgPi / 33.3;
   static constexpr double   csLimitLow            = -cgPi / 33.3;
   static constexpr double   csLimitDelta          =  cgPi / 33333.3;
-  static constexpr double   csLimitEpsilon        =  cgPi / 1234567.8;
+  static constexpr double   csLimitEpsilon        =  cgPi / 1234567.8;   // Bisection tolerance unless the ODE tolerance is looser.
+  // Stride of the first pass in csLimitDelta. A narrower hit or miss band between coarse samples is
+  // still found, unless the height of the rays at the object turns twice or the rays end in the
+  // surface and come back inside one coarse interval, see calculateAngleLimits.
+  static constexpr int      csLimitCoarse         =     16;
   static constexpr double   csLimitAngleBoost     =      1.001;
   static constexpr double   csRenderSurfaceFactor =      2.0;
   static constexpr double   csSurfaceDistance     =   1000; // meters
   static constexpr double   csSurfPinholeDist     =      1; // meters
-  static constexpr int      csSurfSubsample       =      7;
   static constexpr uint8_t  csColorVoid           =      0u;
   static constexpr uint8_t  csColorMirror         =      1u;
   static constexpr uint8_t  csColorBase           =      2u;
   static constexpr uint8_t  csColorBlack          =      3u;
   static constexpr int      csDashCount           =     20;
+  static constexpr double   csRayMapMargin        =      0.01;
+  static constexpr int      csTileWidth           =     32;    // pixels
+  static constexpr int      csTileHeight          =      4;    // pixels
+  static constexpr uint32_t csAdaptiveRound       =      4u;   // subsamples added to a pixel at once
+  static constexpr double   csAdaptiveDivergence  =      0.25; // relative change of hit distance of neighbouring pixels
+  static constexpr uint32_t csStreamTilesPerCpu   =      8u;   // tile rows of surface per CPU rendered at once
 
-  uint32_t const  mRestrictCpu;
-  std::vector<uint8_t>         mBuffer;
-  png::image<png::index_pixel> mImage;
-  png::palette                 mPalette;
+  WorkerPool                      &mWorkers;
+  std::vector<uint8_t>             mBuffer;         // Mirage colors from row mBufferBottom: all of it in adaptive mode, else one tile row. csColorVoid if not traced.
+  int                              mBufferBottom;
+  std::vector<uint8_t>             mRow;            // Next row to write.
+  std::vector<PngRowWriter::Color> mPalette;
+  std::vector<double>              mSurfaceTable;   // Summed-area table of the mirrored surface picture, empty if none.
+  int                              mSurfaceWidth;
+  int                              mSurfaceHeight;
+  std::vector<uint8_t>             mSurfaceRows;    // Surface colors of the rows from mSurfaceRowsBottom being written.
+  int                              mSurfaceRowsBottom;
   uint32_t const  mSubSample;
   uint32_t const  mResolutionX;
+  uint32_t        mResolutionY;
   double   const  mBorderFactor;
   double   const  mSsFactor;
   Vertex   const  mCenter;
@@ -102,12 +195,20 @@ private:
   double   const  mMarkIndent;
   bool     const  mMarkAcross;
   bool     const  mMarkTriple;
+  double   const  mRayMapTolerance;
+  double   const  mAdaptiveThreshold;
+  bool     const  mTextureFilter;
+
+  // Critical angles of one temperature.
+  struct AngleLimits {
+    double mTop;
+    double mBottom;
+    double mDeep;
+
+    double getShallow() const { return -mDeep; }
+  };
 
   Medium                &mMedium;
-  std::optional<double>  mLimitAngleTop;
-  std::optional<double>  mLimitAngleBottom;
-  std::optional<double>  mLimitAngleDeep;
-  std::optional<double>  mLimitAngleShallow;
   double                 mLimitAngleBottomSurf;
   int                    mLimitPixelBaseTop;
   int                    mLimitPixelBaseBottom;
@@ -116,24 +217,61 @@ private:
   int                    mLimitPixelShallow;
   int                    mLimitPixelTop;
   int                    mLimitPixelBottom;
+  int                    mMirrorHeight;
   double                 mPixelSize;
   double                 mBiasZ;
   double                 mBiasY;
+  uint32_t               mSolverAllocations = 0u;
+  std::vector<TileScheduler::ThreadStats> mTileStats;
+  double                 mTileImbalance = 0.0;
+  uint64_t               mMirageRays = 0u;
+  LimitSeeds             mLimitSeeds;
 
 public:
-  Image(Parameters const& aPara, Medium &aMedium);
+  // The threads of aWorkers are shared by all Images of a process.
+  Image(Parameters const& aPara, Medium &aMedium, WorkerPool &aWorkers);
 
+  // Throws std::runtime_error if the object is not visible at some of the temperatures.
   void process(char const * const aNameSurf, char const * const aNameOut);
+  // Solver workspaces constructed during the last process call.
+  uint32_t getSolverAllocations() const { return mSolverAllocations; }
+  // Rays traced for the pixels of the last mirage calculation.
+  uint64_t getMirageRays() const { return mMirageRays; }
+  // Tiles and steals per thread and the imbalance of the finishing times of the last mirage calculation.
+  std::vector<TileScheduler::ThreadStats> const& getTileStats() const { return mTileStats; }
+  double getTileImbalance() const { return mTileImbalance; }
+  // Transitions of the last process call. Given to the Image of the next progressive pass, the
+  // fine elevations around them are checked besides the ones around the changes of the coarse scan.
+  LimitSeeds const& getLimitSeeds() const { return mLimitSeeds; }
+  void setLimitSeeds(LimitSeeds const &aSeeds) { mLimitSeeds = aSeeds; }
 
 private:
-  void calculateAngleLimits(Eikonal::Temperature const aWhich);
-  void calculateBiases(bool const aRenderSurface);
+  // Throws std::runtime_error if no elevation in [csLimitLow, csLimitHigh] changes between hitting and missing the object.
+  AngleLimits calculateAngleLimits(Eikonal::Temperature const aWhich);
+  void calculateBiases(bool const aRenderSurface, AngleLimits const &aLimits);
   int calculatePixelLimitY(double const aAngle);
   int calculatePixelLimitZ(double const aAngle);
   int calculateMirrorHeight();
-  void renderSurface(char const * const aNameSurf);
-  void calculateMirage();
-  void drawMarks(int const aMirrorHeight);
+  void buildSurfaceTable(char const * const aNameSurf);
+  // Integral of the surface picture over [aU0, aU1) x [aV0, aV1) in its pixels, zero outside.
+  double getSurfaceIntegral(double const aU0, double const aU1, double const aV0, double const aV1) const;
+  // Renders the surface of the rows [aYbegin, aYend) into mSurfaceRows in parallel.
+  void renderSurface(int const aYbegin, int const aYend);
+  void buildRayMap();
+  void calculateMirage(PngRowWriter &aWriter);
+  // Renders the mirage and writes its rows above mLimitPixelBottom as they are finished. The last tile row stays in mBuffer.
+  void calculateMirageFixed(uint32_t const aCpus, PngRowWriter &aWriter);
+  void calculateMirageAdaptive(uint32_t const aCpus);
+  // Composes and writes the rows from the top down to aYend, which must be in mBuffer if inside the mirage.
+  void writeRows(PngRowWriter &aWriter, int const aYend);
+  uint32_t getCpuCount() const;
+  void addTileStats(TileScheduler const &aScheduler);
+  Ray getSubpixelRay(int const aY, int const aZ, double const aSubY, double const aSubZ) const;   // Subpixel offsets in pixels.
+  void setBuffer(int const aY, int const aZ, double const aColor);
+  static uint8_t getColor(double const aColor) { return std::max(csColorBlack, static_cast<uint8_t>(::round(aColor))); }
+  // Texture filtered colors of the rays of a tile of calculateMirageFixed from their hits.
+  void filterTile(int const aRows, int const aColumns, RungeKuttaRayBending::Result const * const aHits, double * const aColors) const;
+  void drawMarks(int const aY);
 
   static Vector getDirectionInXy(double const aAngle) { return Vector(std::cos(aAngle), std::sin(aAngle), 0.0); }
   static Vector getDirectionInXz(double const aAngle) { return Vector(std::cos(aAngle), 0.0, std::sin(aAngle)); }